@@ -24,29 +24,37 @@
 #if ALAC
 #include "alac_wrapper.h"
 
-#if BYTES_PER_FRAME == 4		
-#define ALIGN8(n) 	(n << 8)		
-#define ALIGN16(n) 	(n)
-#define ALIGN24(n)	(n >> 8) 
-#define ALIGN32(n)	(n >> 16)
-#else
-#define ALIGN8(n) 	(n << 24)		
-#define ALIGN16(n) 	(n << 16)
-#define ALIGN24(n)	(n << 8) 
-#define ALIGN32(n)	(n)
-#endif
-
 #define BLOCK_SIZE (4096 * BYTES_PER_FRAME)
 #define MIN_READ    BLOCK_SIZE
 #define MIN_SPACE  (MIN_READ * 4)
 
+// all per stream allocations are from the arena, reset when a stream is opened, with sample tables of long tracks
+// which do not fit placed on the heap and released with it
+#define ARENA_SIZE (2 * 1024 * 1024)
+
+// packet parallel decoding of hi-res alac: packet sizes are known from stsz so the decode thread copies whole packets
+// from streambuf into jobs which workers decode concurrently, each with its own decoder, and output is committed in order
+#define PARALLEL_BITRATE (48000 * 2 * 24) // streams above this are decoded in parallel if workers are available
+#define MAX_JOBS         8
+#define JOB_PAD          16               // zeroed bytes after each packet as the bit reader may read ahead
+
 struct chunk_table {
 	u32_t sample, offset;
 };
 
+struct alac_job {
+	struct decode_job job;
+	u8_t *in;                // one packet copied from streambuf
+	u8_t *out;               // decoded packet, interleaved stereo at the stream's sample size
+	u8_t *optr;              // next frame to commit once trimmed
+	u32_t frames;
+	bool ok, trimmed;
+};
+
 struct alac {
 	void *decoder;
 	u8_t *writebuf;
+	u8_t *wrapbuf;           // packets which wrap round the end of streambuf are copied here
 	// following used for mp4 only
 	u32_t consume;
 	u32_t pos;
@@ -62,9 +70,19 @@ struct alac {
 	unsigned sample_rate;
 	unsigned char channels, sample_size;
 	unsigned trak, play;
+	// parallel decoding
+	bool parallel;
+	bool endstream;          // packets can not be followed further, stop once those cut are output
+	u8_t *cookie;            // decoder config to create worker decoders
+	int cookie_len;
+	u32_t out_bytes;
+	struct alac_job jobs[MAX_JOBS];
+	unsigned jobs_head, jobs_count;
+	void *workers[MAX_DECODE_WORKERS];
 };
 
 static struct alac *l;
+static struct arena arena;
 
 extern log_level loglevel;
 
@@ -73,28 +91,36 @@ extern struct buffer *outputbuf;
 extern struct streamstate stream;
 extern struct outputstate output;
 extern struct decodestate decode;
-extern struct processstate process;
 
-#define LOCK_S   mutex_lock(streambuf->mutex)
-#define UNLOCK_S mutex_unlock(streambuf->mutex)
-#define LOCK_O   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(outputbuf->mutex)
+#define LOCK_S   buf_lock(streambuf)
+#define UNLOCK_S buf_unlock(streambuf)
+#define LOCK_O   buf_lock(outputbuf)
+#define UNLOCK_O buf_unlock(outputbuf)
 #if PROCESS
-#define LOCK_O_direct   if (decode.direct) mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct if (decode.direct) mutex_unlock(outputbuf->mutex)
-#define LOCK_O_not_direct   if (!decode.direct) mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_not_direct if (!decode.direct) mutex_unlock(outputbuf->mutex)
-#define IF_DIRECT(x)    if (decode.direct) { x }
-#define IF_PROCESS(x)   if (!decode.direct) { x }
+#define LOCK_O_direct   if (decode.direct) buf_lock(outputbuf)
+#define UNLOCK_O_direct if (decode.direct) buf_unlock(outputbuf)
+#define LOCK_O_not_direct   if (!decode.direct) buf_lock(outputbuf)
+#define UNLOCK_O_not_direct if (!decode.direct) buf_unlock(outputbuf)
 #else
-#define LOCK_O_direct   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct mutex_unlock(outputbuf->mutex)
+#define LOCK_O_direct   buf_lock(outputbuf)
+#define UNLOCK_O_direct buf_unlock(outputbuf)
 #define LOCK_O_not_direct
 #define UNLOCK_O_not_direct
-#define IF_DIRECT(x)    { x }
-#define IF_PROCESS(x)
 #endif
 
+// header allocations fall back to the heap rather than refusing a valid file, only job buffers are capped by the arena
+static void *_alac_alloc(size_t len, const char *what) {
+	void *ptr = arena_alloc(&arena, len);
+	if (!ptr) {
+		LOG_INFO("%s of %u bytes exceeds arena, using heap", what, (unsigned)len);
+		ptr = arena_spill(&arena, len);
+	}
+	if (!ptr) {
+		LOG_ERROR("unable to allocate %s", what);
+	}
+	return ptr;
+}
+
 // read mp4 header to extract config data
 static int read_mp4_header(void) {
 	size_t bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
@@ -122,13 +148,18 @@ static int read_mp4_header(void) {
 			u8_t *ptr = streambuf->readp + 36;
 			unsigned int block_size;
 			l->play = l->trak;						
+			if (l->decoder) alac_delete_decoder(l->decoder);
 			l->decoder = alac_create_decoder(len - 36, ptr, &l->sample_size, &l->sample_rate, &l->channels, &block_size);
-			l->writebuf = malloc(block_size + 256);
+			l->out_bytes = block_size + 256;
+			l->writebuf = _alac_alloc(l->out_bytes, "write buffer");
+			l->wrapbuf = _alac_alloc(l->out_bytes, "wrap buffer");
 			LOG_INFO("allocated write buffer of %u bytes", block_size);
-			if (!l->writebuf) {
-				LOG_ERROR("allocation failed");
+			l->cookie_len = len - 36;
+			l->cookie = _alac_alloc(l->cookie_len, "cookie");
+			if (!l->writebuf || !l->wrapbuf || !l->cookie) {
 				return -1;
 			}
+			memcpy(l->cookie, ptr, l->cookie_len);
 		}
 
 		// extract the total number of samples from stts
@@ -138,7 +169,10 @@ static int read_mp4_header(void) {
 			l->default_block_size = unpackN((u32_t *) ptr); ptr += 4;
 			if (!l->default_block_size) {
 				u32_t entries = unpackN((u32_t *)ptr); ptr += 4;
-				l->block_size = malloc((entries + 1)* 4);
+				l->block_size = _alac_alloc((entries + 1) * 4, "stsz");
+				if (!l->block_size) {
+					return -1;
+				}
 				for (i = 0; i < entries; i++) {
 					l->block_size[i] = unpackN((u32_t *)ptr); ptr += 4;
 				}
@@ -166,9 +200,8 @@ static int read_mp4_header(void) {
 
 		// stash sample to chunk info, assume it comes before stco
 		if (!strcmp(type, "stsc") && bytes > len && !l->chunkinfo) {
-			l->stsc = malloc(len - 12);
+			l->stsc = _alac_alloc(len - 12, "stsc");
 			if (l->stsc == NULL) {
-				LOG_WARN("malloc fail");
 				return -1;
 			}
 			memcpy(l->stsc, streambuf->readp + 12, len - 12);
@@ -181,9 +214,8 @@ static int read_mp4_header(void) {
 			u8_t *ptr = streambuf->readp + 12;
 			u32_t entries = unpackN((u32_t *)ptr);
 			ptr += 4;
-			l->chunkinfo = malloc(sizeof(struct chunk_table) * (entries + 1));
+			l->chunkinfo = _alac_alloc(sizeof(struct chunk_table) * (entries + 1), "stco");
 			if (l->chunkinfo == NULL) {
-				LOG_WARN("malloc fail");
 				return -1;
 			}
 			for (i = 0; i < entries; ++i) {
@@ -218,7 +250,6 @@ static int read_mp4_header(void) {
 					last_samples = samples;
 					ptr += 12;
 				}
-				free(l->stsc);
 				l->stsc = NULL;
 			}
 		}
@@ -314,11 +345,237 @@ static int read_mp4_header(void) {
 	return 0;
 }
 
+// move readp past a packet, skipping to the next chunk offset at the end of a chunk - called with LOCK_S
+// returns false if the stream can not be followed further
+static bool _alac_next(u32_t block_size, bool decoded) {
+	// mp4 end of chunk - skip to next offset
+	if (l->chunkinfo && l->chunkinfo[l->nextchunk].offset && l->sample++ == l->chunkinfo[l->nextchunk].sample) {
+		 if (l->chunkinfo[l->nextchunk].offset > l->pos) {
+			u32_t skip = l->chunkinfo[l->nextchunk].offset - l->pos;
+			if (_buf_used(streambuf) >= skip) {
+				_buf_inc_readp(streambuf, skip);
+				l->pos += skip;
+			} else {
+				l->consume = skip;
+			}
+			l->nextchunk++;
+		 } else {
+			LOG_ERROR("error: need to skip backwards!");
+			return false;
+		 }
+	// mp4 when not at end of chunk
+	} else if (decoded) {
+		_buf_inc_readp(streambuf, block_size);
+		l->pos += block_size;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+// apply gapless skip and trim to a decoded packet, returns the frames to output from *iptr
+static u32_t _alac_trim(u8_t **iptr, u32_t frames) {
+	if (l->skip) {
+		u32_t skip;
+		if (l->empty) {
+			l->empty = false;
+			l->skip -= frames;
+			LOG_DEBUG("gapless: first frame empty, skipped %u frames at start", frames);
+		}
+		skip = min(frames, l->skip);
+		LOG_DEBUG("gapless: skipping %u frames at start", skip);
+		frames -= skip;
+		l->skip -= skip;
+		// decoder output is always interleaved stereo
+		*iptr += skip * 2 * (l->sample_size / 8);
+	}
+
+	if (l->samples) {
+		if (l->samples < frames) {
+			LOG_DEBUG("gapless: trimming %u frames from end", frames - l->samples);
+			frames = (u32_t) l->samples;
+		}
+		l->samples -= frames;
+	}
+
+	return frames;
+}
+
+// convert decoded frames into outputbuf as far as there is space, returns frames written
+static u32_t _alac_output(u8_t *iptr, u32_t frames) {
+	u32_t done = 0;
+
+	LOCK_O_direct;
+
+	while (done < frames) {
+		size_t f;
+		u8_t *wptr;
+
+		f = min(frames - done, decode_reserve(&wptr));
+		if (f == 0) break;
+
+		// decoder output is native endian
+		conv_packed((ISAMPLE_T *)wptr, iptr + done * 2 * (l->sample_size / 8), f, 2, l->sample_size / 8, !SL_LITTLE_ENDIAN);
+		done += f;
+
+		decode_commit(f);
+	}
+
+	UNLOCK_O_direct;
+
+	return done;
+}
+
+// decode one packet on a worker with that worker's decoder
+static void _alac_job_run(struct decode_job *job, unsigned worker) {
+	struct alac_job *j = (struct alac_job *)job;
+
+	j->ok = false;
+	j->frames = 0;
+
+	if (!l->workers[worker]) {
+		unsigned char sample_size, channels;
+		unsigned sample_rate, block_size;
+		l->workers[worker] = alac_create_decoder(l->cookie_len, l->cookie, &sample_size, &sample_rate, &channels, &block_size);
+		if (!l->workers[worker]) {
+			LOG_ERROR("unable to create worker decoder");
+			return;
+		}
+	}
+
+	j->ok = alac_to_pcm(l->workers[worker], j->in, j->out, 2, &j->frames);
+}
+
+// job buffers for parallel decoding, all taken from the arena when the stream starts
+static bool _alac_parallel_init(void) {
+	unsigned i;
+
+	for (i = 0; i < MAX_JOBS; ++i) {
+		l->jobs[i].in = arena_alloc(&arena, l->out_bytes + JOB_PAD);
+		l->jobs[i].out = arena_alloc(&arena, l->out_bytes);
+		if (!l->jobs[i].in || !l->jobs[i].out) {
+			LOG_INFO("arena too small for parallel decoding");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// wait for jobs in flight and drop them
+static void _alac_drain(void) {
+	while (l->jobs_count) {
+		struct alac_job *j = &l->jobs[l->jobs_head];
+		while (!decode_wait(&j->job, 100));
+		l->jobs_head = (l->jobs_head + 1) % MAX_JOBS;
+		l->jobs_count--;
+	}
+}
+
+static decode_state _alac_parallel_decode(void) {
+	unsigned max_jobs = min(2 * decode_workers(), MAX_JOBS);
+	bool progress = false;
+	u32_t block_size;
+	size_t want = 0;
+	bool end;
+
+	// commit decoded packets in stream order, as far as there is space for them
+	while (l->jobs_count) {
+		struct alac_job *j = &l->jobs[l->jobs_head];
+		u32_t frames;
+
+		if (!decode_wait(&j->job, 0)) break;
+
+		if (!j->trimmed) {
+			if (!j->ok || !j->frames) {
+				LOG_ERROR("decode error");
+				return DECODE_ERROR;
+			}
+			j->optr = j->out;
+			j->frames = _alac_trim(&j->optr, j->frames);
+			j->trimmed = true;
+		}
+
+		frames = _alac_output(j->optr, j->frames);
+		j->optr += frames * 2 * (l->sample_size / 8);
+		j->frames -= frames;
+
+		if (j->frames) break;
+
+		l->jobs_head = (l->jobs_head + 1) % MAX_JOBS;
+		l->jobs_count--;
+		progress = true;
+	}
+
+	// copy whole packets from streambuf into jobs for the workers
+	LOCK_S;
+
+	while (l->jobs_count < max_jobs && !l->consume && !l->endstream) {
+		struct alac_job *j = &l->jobs[(l->jobs_head + l->jobs_count) % MAX_JOBS];
+		size_t cont;
+
+		block_size = l->default_block_size ? l->default_block_size : l->block_size[l->block_index];
+		if (!block_size || _buf_used(streambuf) < block_size) break;
+
+		if (block_size > l->out_bytes) {
+			LOG_ERROR("packet of %u bytes exceeds %u", block_size, l->out_bytes);
+			l->endstream = true;
+			break;
+		}
+
+		cont = min(block_size, _buf_cont_read(streambuf));
+		memcpy(j->in, streambuf->readp, cont);
+		memcpy(j->in + cont, streambuf->buf, block_size - cont);
+		memset(j->in + block_size, 0, JOB_PAD);
+
+		if (block_size != l->default_block_size) l->block_index++;
+		if (!_alac_next(block_size, true)) {
+			l->endstream = true;
+			break;
+		}
+
+		j->trimmed = false;
+		j->job.run = _alac_job_run;
+		decode_submit(&j->job);
+
+		l->jobs_count++;
+		progress = true;
+	}
+
+	block_size = l->default_block_size ? l->default_block_size : l->block_size[l->block_index];
+	end = STREAM_ENDED && (_buf_used(streambuf) == 0 || block_size == 0);
+
+	// the rest of the next packet, if there is room for another job
+	if (l->jobs_count < max_jobs && !STREAM_ENDED) {
+		want = block_size > _buf_used(streambuf) ? block_size : _buf_used(streambuf) + 1;
+	}
+
+	UNLOCK_S;
+
+	if (l->endstream && !l->jobs_count) {
+		LOG_WARN("unable to decode further");
+		return DECODE_ERROR;
+	}
+
+	if (end && !l->jobs_count) {
+		LOG_DEBUG("end of stream");
+		return DECODE_COMPLETE;
+	}
+
+	if (!progress) {
+		// wait for the next packet in order, or for more of the stream
+		decode_yield(want);
+	}
+
+	return DECODE_RUNNING;
+}
+
 static decode_state alac_decode(void) {
 	size_t bytes;
 	bool endstream;
 	u8_t *iptr;
-	u32_t frames, block_size;
+	u32_t frames, written, block_size;
 
 	LOCK_S;
 
@@ -352,6 +609,12 @@ static decode_state alac_decode(void) {
 			decode.new_stream = false;
 
 			UNLOCK_O;
+
+			l->parallel = l->sample_rate * l->channels * l->sample_size > PARALLEL_BITRATE && decode_workers() &&
+						  _alac_parallel_init();
+			if (l->parallel) {
+				LOG_INFO("decoding packets in parallel on %u workers", decode_workers());
+			}
 		} else if (found == -1) {
 			LOG_WARN("[%p]: error reading stream header");
 			UNLOCK_S;
@@ -363,11 +626,16 @@ static decode_state alac_decode(void) {
 		}
 	}
 
+	if (l->parallel) {
+		UNLOCK_S;
+		return _alac_parallel_decode();
+	}
+
 	bytes = _buf_used(streambuf);
 	block_size = l->default_block_size ? l->default_block_size : l->block_size[l->block_index];
 
 	// stream terminated
-	if (stream.state <= DISCONNECT && (bytes == 0 || block_size == 0)) {
+	if (STREAM_ENDED && (bytes == 0 || block_size == 0)) {
 		UNLOCK_S;
 		LOG_DEBUG("end of stream");
 		return DECODE_COMPLETE;
@@ -383,7 +651,12 @@ static decode_state alac_decode(void) {
 
 	// need to create a buffer with contiguous data
 	if (bytes < block_size) {
-		iptr = malloc(block_size);
+		if (block_size > l->out_bytes) {
+			LOG_ERROR("packet of %u bytes exceeds %u", block_size, l->out_bytes);
+			UNLOCK_S;
+			return DECODE_ERROR;
+		}
+		iptr = l->wrapbuf;
 		memcpy(iptr, streambuf->readp, bytes);
 		memcpy(iptr + bytes, streambuf->buf, block_size - bytes);
 	} else iptr = streambuf->readp;
@@ -394,34 +667,9 @@ static decode_state alac_decode(void) {
 		return DECODE_ERROR;
 	}
 
-	// and free it
-	if (bytes < block_size) free(iptr);
-
 	LOG_SDEBUG("block of %u bytes (%u frames)", block_size, frames);
 
-	endstream = false;
-	// mp4 end of chunk - skip to next offset
-	if (l->chunkinfo && l->chunkinfo[l->nextchunk].offset && l->sample++ == l->chunkinfo[l->nextchunk].sample) {
-		 if (l->chunkinfo[l->nextchunk].offset > l->pos) {
-			u32_t skip = l->chunkinfo[l->nextchunk].offset - l->pos;
-			if (_buf_used(streambuf) >= skip) {
-				_buf_inc_readp(streambuf, skip);
-				l->pos += skip;
-			} else {
-				l->consume = skip;
-			}
-			l->nextchunk++;
-		 } else {
-			LOG_ERROR("error: need to skip backwards!");
-			endstream = true;
-		 }
-	// mp4 when not at end of chunk
-	} else if (frames) {
-		_buf_inc_readp(streambuf, block_size);
-		l->pos += block_size;
-	} else {
-		endstream = true;
-	}
+	endstream = !_alac_next(block_size, frames != 0);
 
 	UNLOCK_S;
 
@@ -432,100 +680,26 @@ static decode_state alac_decode(void) {
 
 	// now point at the beginning of decoded samples
 	iptr = l->writebuf;
+	frames = _alac_trim(&iptr, frames);
 
-	if (l->skip) {
-		u32_t skip;
-		if (l->empty) {
-			l->empty = false;
-			l->skip -= frames;
-			LOG_DEBUG("gapless: first frame empty, skipped %u frames at start", frames);
-		}
-		skip = min(frames, l->skip);
-		LOG_DEBUG("gapless: skipping %u frames at start", skip);
-		frames -= skip;
-		l->skip -= skip;
-		iptr += skip * l->channels * l->sample_size;
+	written = _alac_output(iptr, frames);
+	if (written < frames) {
+		LOG_ERROR("no space for %u frames", frames - written);
 	}
 
-	if (l->samples) {
-		if (l->samples < frames) {
-			LOG_DEBUG("gapless: trimming %u frames from end", frames - l->samples);
-			frames = (u32_t) l->samples;
-		}
-		l->samples -= frames;
-	}
-
-	LOCK_O_direct;
-
-	while (frames > 0) {
-		size_t f, count;
-		ISAMPLE_T *optr;
-
-		IF_DIRECT(
-			f = min(frames, _buf_cont_write(outputbuf) / BYTES_PER_FRAME);
-			optr = (ISAMPLE_T *)outputbuf->writep;
-		);
-		IF_PROCESS(
-			f = min(frames, process.max_in_frames - process.in_frames);
-			optr = (ISAMPLE_T *)((u8_t *) process.inbuf + process.in_frames * BYTES_PER_FRAME);
-		);
-
-		f = min(f, frames);
-		count = f;
-
-		if (l->sample_size == 8) {
-			while (count--) {
-				*optr++ = ALIGN8(*iptr++);
-				*optr++ = ALIGN8(*iptr++);
-			}
-		} else if (l->sample_size == 16) {
-			u16_t *_iptr = (u16_t*) iptr;
-			iptr += count * 4;
-			while (count--) {
-				*optr++ = ALIGN16(*_iptr++);
-				*optr++ = ALIGN16(*_iptr++);
-			}
-		} else if (l->sample_size == 24) {
-			while (count--) {
-				*optr++ = ALIGN24(*(u32_t*) iptr);
-				*optr++ = ALIGN24(*(u32_t*) (iptr + 3));
-				iptr += 6;
-			}
-		} else if (l->sample_size == 32) {
-			u32_t *_iptr = (u32_t*) iptr;
-			iptr += count * 8;
-			while (count--) {
-				*optr++ = ALIGN32(*_iptr++);
-				*optr++ = ALIGN32(*_iptr++);
-			}
-		} else {
-			LOG_ERROR("unsupported bits per sample: %u", l->sample_size);
-		}
-		
-		frames -= f;
-
-		IF_DIRECT(
-			_buf_inc_writep(outputbuf, f * BYTES_PER_FRAME);
-		);
-		IF_PROCESS(
-			process.in_frames = f;
-			// called only if there is enough space in process buffer
-			if (frames) LOG_ERROR("unhandled case");
-		);
-	 }
-
-	UNLOCK_O_direct;
-
 	return DECODE_RUNNING;
 }
 
 static void alac_close(void) {
+	unsigned i;
+
+	_alac_drain();
+	for (i = 0; i < MAX_DECODE_WORKERS; ++i) {
+		if (l->workers[i]) alac_delete_decoder(l->workers[i]);
+	}
 	if (l->decoder) alac_delete_decoder(l->decoder);
-	if (l->writebuf) free(l->writebuf);	
-	if (l->chunkinfo) free(l->chunkinfo);
-	if (l->block_size) free(l->block_size);
-	if (l->stsc) free(l->stsc);
 	memset(l, 0, sizeof(struct alac));	
+	arena_reset(&arena);
 }
 
 static void alac_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
@@ -545,6 +719,13 @@ struct codec *register_alac(void) {
 	
 	l =  calloc(1, sizeof(struct alac));
 	if (!l) return NULL;
+
+	arena_init(&arena, ARENA_SIZE);
+	if (!arena.base) {
+		LOG_ERROR("unable to allocate %u byte arena", ARENA_SIZE);
+		free(l);
+		return NULL;
+	}
 		
 	LOG_INFO("using alac to decode alc");
 	return &ret;
@@ -25,13 +25,31 @@
 
 #include "squeezelite.h"
 
+#if LINUX || OSX || FREEBSD
+#include <sys/mman.h>
+#endif
+#if LINUX
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#endif
+#if OSX || FREEBSD
+#include <sys/param.h>
+#include <sys/mount.h>
+#endif
+
 // _* called with muxtex locked
 
+// readp is only moved by the consumer and writep only by the producer, each published with release semantics and
+// read with acquire semantics, so used/space/cont_*/inc_* need no mutex when there is a single producer and consumer
+// flush, adjust, resize and unwrap move both pointers and still need the mutex held by every party
+
 #if !WIN
 inline
 #endif
 unsigned _buf_used(struct buffer *buf) {
-	return buf->writep >= buf->readp ? buf->writep - buf->readp : buf->size - (buf->readp - buf->writep);
+	u8_t *readp  = atomic_load_p(buf->readp);
+	u8_t *writep = atomic_load_p(buf->writep);
+	return writep >= readp ? writep - readp : buf->size - (readp - writep);
 }
 
 unsigned _buf_space(struct buffer *buf) {
@@ -39,62 +57,418 @@ unsigned _buf_space(struct buffer *buf) {
 }
 
 unsigned _buf_cont_read(struct buffer *buf) {
-	return buf->writep >= buf->readp ? buf->writep - buf->readp : buf->wrap - buf->readp;
+	u8_t *readp, *writep;
+	// mirrored buffer - data past wrap is visible at the start of the buffer so all used bytes are contiguous
+	if (buf->flags & BUF_MIRROR) return _buf_used(buf);
+	readp  = atomic_load_p(buf->readp);
+	writep = atomic_load_p(buf->writep);
+	return writep >= readp ? writep - readp : buf->wrap - readp;
 }
 
 unsigned _buf_cont_write(struct buffer *buf) {
-	return buf->writep >= buf->readp ? buf->wrap - buf->writep : buf->readp - buf->writep;
+	u8_t *readp, *writep;
+	if (buf->flags & BUF_MIRROR) return _buf_space(buf);
+	readp  = atomic_load_p(buf->readp);
+	writep = atomic_load_p(buf->writep);
+	return writep >= readp ? buf->wrap - writep : readp - writep;
+}
+
+// reserve contiguous writable space for the producer to fill in place, NULL if bytes are not available without wrap
+// nothing is visible to the consumer until _buf_commit
+u8_t *_buf_reserve(struct buffer *buf, size_t bytes) {
+	if (min(_buf_space(buf), _buf_cont_write(buf)) < bytes) {
+		return NULL;
+	}
+	return buf->writep;
+}
+
+// reader side telemetry - time weighted fill histogram and low watermark, idle gaps are not counted
+#define BUF_STATS_IDLE_US 1000000
+
+static void _buf_stats_read(struct buffer *buf) {
+	struct bufstats *stats = &buf->stats;
+	unsigned used = _buf_used(buf);
+	u64_t now = gettime_us();
+	if (stats->last_us && now - stats->last_us < BUF_STATS_IDLE_US) {
+		stats->fill_us[stats->last_bin] += now - stats->last_us;
+	}
+	stats->last_us = now;
+	stats->last_bin = min(used * BUF_STATS_BINS / buf->size, BUF_STATS_BINS - 1);
+	if (used < stats->min_used) {
+		stats->min_used = used;
+	}
+}
+
+static void _buf_stats_reset(struct buffer *buf) {
+	memset(&buf->stats, 0, sizeof(buf->stats));
+	buf->stats.min_used = UINT_MAX;
 }
 
 void _buf_inc_readp(struct buffer *buf, unsigned by) {
-	buf->readp += by;
-	if (buf->readp >= buf->wrap) {
-		buf->readp -= buf->size;
+	u8_t *readp = buf->readp + by;
+	if (readp >= buf->wrap) {
+		readp -= buf->size;
+	}
+	atomic_store_p(buf->readp, readp);
+	_buf_stats_read(buf);
+	// wake writer if it is waiting for the space now available
+	if (buf->wake_writer) {
+		atomic_fence();
+		if (buf->write_want && _buf_space(buf) >= buf->write_want) {
+			buf->write_want = 0;
+			wake_signal((*buf->wake_writer));
+		}
 	}
 }
 
 void _buf_inc_writep(struct buffer *buf, unsigned by) {
-	buf->writep += by;
-	if (buf->writep >= buf->wrap) {
-		buf->writep -= buf->size;
+	u8_t *writep = buf->writep + by;
+	unsigned used;
+	if (writep >= buf->wrap) {
+		writep -= buf->size;
+	}
+	atomic_store_p(buf->writep, writep);
+	// writer side telemetry - high watermark
+	used = _buf_used(buf);
+	if (used > buf->stats.max_used) {
+		buf->stats.max_used = used;
+	}
+	// wake reader if it is waiting for the data now available
+	if (buf->wake_reader) {
+		atomic_fence();
+		if (buf->read_want && _buf_used(buf) >= buf->read_want) {
+			buf->read_want = 0;
+			wake_signal((*buf->wake_reader));
+		}
 	}
 }
 
-void buf_flush(struct buffer *buf) {
+// publish bytes written into space obtained from _buf_reserve
+void _buf_commit(struct buffer *buf, size_t bytes) {
+	_buf_inc_writep(buf, bytes);
+}
+
+// arm the reader/writer wake event for when bytes are available to read/write
+// returns true if already available in which case the caller should not wait on the event
+// the fence pairs with the one in _buf_inc_*, so either the level is seen here or the other side sees the want
+bool _buf_want_read(struct buffer *buf, size_t bytes) {
+	buf->read_want = min(bytes, buf->size - 1);
+	atomic_fence();
+	if (_buf_used(buf) >= buf->read_want) {
+		buf->read_want = 0;
+		return true;
+	}
+	buf->stats.starved++;
+	return false;
+}
+
+bool _buf_want_write(struct buffer *buf, size_t bytes) {
+	buf->write_want = min(bytes, buf->size - 1);
+	atomic_fence();
+	if (_buf_space(buf) >= buf->write_want) {
+		buf->write_want = 0;
+		return true;
+	}
+	buf->stats.blocked++;
+	return false;
+}
+
+// lock buffer mutex, accounting for time spent waiting when it is contended
+void buf_lock(struct buffer *buf) {
+	u64_t start;
+	if (mutex_trylock(buf->mutex)) return;
+	start = gettime_us();
 	mutex_lock(buf->mutex);
+	buf->stats.lock_waits++;
+	buf->stats.lock_wait_us += gettime_us() - start;
+}
+
+void buf_unlock(struct buffer *buf) {
+	mutex_unlock(buf->mutex);
+}
+
+// log telemetry collected since the last dump and reset it
+void buf_stats_dump(struct buffer *buf, const char *name) {
+	struct bufstats stats = buf->stats;
+	u64_t total = 0;
+	char hist[BUF_STATS_BINS * 12] = "";
+	int i;
+
+	_buf_stats_reset(buf);
+
+	for (i = 0; i < BUF_STATS_BINS; i++) {
+		total += stats.fill_us[i];
+	}
+	for (i = 0; total && i < BUF_STATS_BINS; i++) {
+		sprintf(hist + strlen(hist), " %u%%", (unsigned)(stats.fill_us[i] * 100 / total));
+	}
+
+	logprint("%s %s size: %u used: %u low: %u high: %u starved: %u blocked: %u lock waits: %u (%u ms)\n",
+			 logtime(), name, (unsigned)buf->size, _buf_used(buf), stats.min_used == UINT_MAX ? 0 : stats.min_used, stats.max_used,
+			 stats.starved, stats.blocked, stats.lock_waits, (unsigned)(stats.lock_wait_us / 1000));
+	logprint("%s %s time at fill 0-100%% in %u%% steps:%s\n", logtime(), name, 100 / BUF_STATS_BINS, total ? hist : " none");
+}
+
+#if LINUX && defined(SYS_memfd_create)
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+
+// map the same memfd pages twice back to back so reads and writes which cross wrap continue in the mirror
+// the reservation is aligned to align so hugetlb backed views can be mapped at a fixed address
+static u8_t *_mirror_alloc(size_t size, size_t align, unsigned memfd_flags) {
+	u8_t *res, *addr = NULL;
+	int fd = syscall(SYS_memfd_create, "squeezelite", memfd_flags);
+
+	if (fd < 0) return NULL;
+
+	if (ftruncate(fd, size) == 0) {
+		res = mmap(NULL, 2 * size + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (res != MAP_FAILED) {
+			addr = (u8_t *)(((uintptr_t)res + align - 1) / align * align);
+			if (addr > res) munmap(res, addr - res);
+			if (res + align > addr) munmap(addr + 2 * size, res + align - addr);
+			if (mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+				mmap(addr + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+				munmap(addr, 2 * size);
+				addr = NULL;
+			}
+		}
+	}
+
+	close(fd);
+	return addr;
+}
+#endif
+
+// allocate storage, mirroring if requested and possible, updates size and flags to those obtained
+// backing is from mem_alloc, or for mirrored storage follows mem_mode directly
+static u8_t *_buf_alloc(size_t *size, unsigned *flags, unsigned *mem) {
+	u8_t *ptr;
+	*mem = 0;
+#if LINUX && defined(SYS_memfd_create)
+	if (*flags & BUF_MIRROR) {
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t huge = mem_hugepage_size();
+		size_t mirror_size = (*size + page - 1) / page * page;
+		ptr = NULL;
+		if ((mem_mode & MEM_HUGE) && *size >= huge) {
+			size_t huge_size = (*size + huge - 1) / huge * huge;
+			if ((ptr = _mirror_alloc(huge_size, huge, MFD_HUGETLB)) != NULL) {
+				mirror_size = huge_size;
+				*mem |= MEM_HUGE;
+			}
+		}
+		if (!ptr) {
+			ptr = _mirror_alloc(mirror_size, page, 0);
+		}
+		if (ptr) {
+			// both views share the same pages so locking one locks the buffer
+			if ((mem_mode & MEM_LOCK) && mlock(ptr, mirror_size) == 0) {
+				*mem |= MEM_LOCK;
+			}
+			*size = mirror_size;
+			return ptr;
+		}
+	}
+#endif
+	*flags &= ~BUF_MIRROR;
+	ptr = mem_alloc(*size, mem);
+	if (!ptr) *size = 0;
+	return ptr;
+}
+
+static void _buf_free(u8_t *ptr, size_t size, unsigned flags) {
+#if LINUX && defined(SYS_memfd_create)
+	if (flags & BUF_MIRROR) {
+		munmap(ptr, 2 * size);
+		return;
+	}
+#endif
+	mem_free(ptr);
+}
+
+#if LINUX || OSX || FREEBSD
+// a mapping faults with SIGBUS if pages cannot be read, which network and user space filesystems can fail to do
+static bool _local_fs(int fd) {
+#if LINUX
+	struct statfs fs;
+	if (fstatfs(fd, &fs) != 0) return false;
+	switch ((unsigned)fs.f_type) {
+	case 0x6969:     // NFS_SUPER_MAGIC
+	case 0x517B:     // SMB_SUPER_MAGIC
+	case 0xFF534D42: // CIFS_SUPER_MAGIC
+	case 0xFE534D42: // SMB2_SUPER_MAGIC
+	case 0x65735546: // FUSE_SUPER_MAGIC
+		return false;
+	default:
+		return true;
+	}
+#else
+	struct statfs fs;
+	return fstatfs(fd, &fs) == 0 && (fs.f_flags & MNT_LOCAL);
+#endif
+}
+
+// use a private mapping of the first len bytes of fd as storage in place of buf, nothing is visible to the consumer
+// until the producer moves writep through it - called with mutex locked and the buffer empty
+// size exceeds len so the ring never wraps and the data is always contiguous, len must fit the unsigned used count
+// only files on local filesystems are mapped, others are left to be read
+bool _buf_map(struct buffer *buf, int fd, size_t len) {
+	u8_t *map;
+
+	if (!len || len >= UINT_MAX || (buf->flags & BUF_MAPPED) || !_local_fs(fd)) {
+		return false;
+	}
+
+	// writable as a private copy so a codec modifying data in place does not fault or change the file
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	madvise(map, len, MADV_SEQUENTIAL);
+
+	buf->readp  = map;
+	buf->writep = map;
+	buf->wrap   = map + len + 1;
+	buf->size   = len + 1;
+	buf->flags |= BUF_MAPPED;
+
+	return true;
+}
+
+// drop file mapping and return to the allocated storage - called with mutex locked
+static void _buf_unmap(struct buffer *buf) {
+	if (!(buf->flags & BUF_MAPPED)) return;
+	munmap(buf->wrap - buf->size, buf->size - 1);
+	buf->wrap   = buf->buf + buf->base_size;
+	buf->size   = buf->base_size;
+	buf->flags &= ~BUF_MAPPED;
+}
+#else
+#define _buf_unmap(buf)
+#endif
+
+void buf_flush(struct buffer *buf) {
+	buf_lock(buf);
+	_buf_unmap(buf);
 	buf->readp  = buf->buf;
 	buf->writep = buf->buf;
-	mutex_unlock(buf->mutex);
+	buf_unlock(buf);
+}
+
+static void _reverse(u8_t *from, u8_t *to) {
+	while (from < --to) {
+		u8_t t = *from;
+		*from++ = *to;
+		*to = t;
+	}
 }
 
 // adjust buffer to multiple of mod bytes so reading in multiple always wraps on frame boundary
+// mirrored and mapped buffers never split a read at wrap so keep their size, and any data already received as when
+// a codec is opened for a prefetched stream; other buffers holding data have it moved to the start of the storage
 void buf_adjust(struct buffer *buf, size_t mod) {
-	size_t size;
-	mutex_lock(buf->mutex);
-	size = ((unsigned)(buf->base_size / mod)) * mod;
+	size_t size, used;
+	buf_lock(buf);
+	used = _buf_used(buf);
+	if (used && (buf->flags & (BUF_MIRROR | BUF_MAPPED))) {
+		buf_unlock(buf);
+		return;
+	}
+	_buf_unmap(buf);
+	size = buf->flags & BUF_MIRROR ? buf->base_size : ((unsigned)(buf->base_size / mod)) * mod;
+	if (used >= size) {
+		// cannot be shortened without losing data, reads may split a frame at wrap
+		size = buf->size;
+	}
+	if (buf->writep >= buf->readp) {
+		memmove(buf->buf, buf->readp, used);
+	} else {
+		// wrapped, rotate the storage in place so readp is at its start
+		_reverse(buf->buf, buf->readp);
+		_reverse(buf->readp, buf->wrap);
+		_reverse(buf->buf, buf->wrap);
+	}
 	buf->readp  = buf->buf;
-	buf->writep = buf->buf;
+	buf->writep = buf->buf + used;
 	buf->wrap   = buf->buf + size;
 	buf->size   = size;
-	mutex_unlock(buf->mutex);
+	buf_unlock(buf);
 }
 
-// called with mutex locked to resize, does not retain contents, reverts to original size if fails
-void _buf_resize(struct buffer *buf, size_t size) {
-	free(buf->buf);
-	buf->buf = malloc(size);
-	if (!buf->buf) {
-		size    = buf->size;
-		buf->buf= malloc(size);
-		if (!buf->buf) {
-			size = 0;
-		}
+// storage for _buf_replace, obtained and touched without the mutex as this can take some time for large buffers
+bool buf_storage_alloc(struct buffer *buf, size_t size, struct buf_storage *st) {
+	st->size = size;
+	st->flags = buf->flags & BUF_MIRROR;
+	st->ptr = _buf_alloc(&st->size, &st->flags, &st->mem);
+	if (!st->ptr) {
+		return false;
+	}
+#if LINUX || FREEBSD
+	touch_memory(st->ptr, st->size);
+#endif
+	return true;
+}
+
+void buf_storage_free(struct buf_storage *st) {
+	if (st->ptr) {
+		_buf_free(st->ptr, st->size, st->flags);
+		st->ptr = NULL;
 	}
+}
+
+// called with mutex locked to move to new storage, retains buffered data which is copied to its start
+// fails leaving the buffer and storage unchanged if the data would not fit
+bool _buf_replace(struct buffer *buf, struct buf_storage *st) {
+	unsigned used = _buf_used(buf);
+
+	if (st->size <= used || (buf->flags & BUF_MAPPED)) {
+		return false;
+	}
+
+	if (buf->writep >= buf->readp || (buf->flags & BUF_MIRROR)) {
+		memcpy(st->ptr, buf->readp, used);
+	} else {
+		size_t cont = buf->wrap - buf->readp;
+		memcpy(st->ptr, buf->readp, cont);
+		memcpy(st->ptr + cont, buf->buf, used - cont);
+	}
+
+	_buf_free(buf->buf, buf->base_size, buf->flags);
+
+	buf->buf    = st->ptr;
+	buf->flags  = (buf->flags & ~BUF_MIRROR) | st->flags;
+	buf->mem    = st->mem;
 	buf->readp  = buf->buf;
-	buf->writep = buf->buf;
-	buf->wrap   = buf->buf + size;
-	buf->size   = size;
-	buf->base_size = size;
+	buf->writep = buf->buf + used;
+	buf->wrap   = buf->buf + st->size;
+	buf->size   = st->size;
+	buf->base_size = st->size;
+
+	st->ptr = NULL;
+	return true;
+}
+
+// called with mutex locked to grow or shrink, retains buffered data which is moved to the start of the new storage
+// fails leaving the buffer unchanged if the data would not fit or allocation fails
+bool _buf_resize(struct buffer *buf, size_t size) {
+	struct buf_storage st;
+
+	if (size <= _buf_used(buf) || (buf->flags & BUF_MAPPED)) {
+		return false;
+	}
+
+	if (!buf_storage_alloc(buf, size, &st)) {
+		return false;
+	}
+
+	if (!_buf_replace(buf, &st)) {
+		buf_storage_free(&st);
+		return false;
+	}
+
+	return true;
 }
 
 void _buf_unwrap(struct buffer *buf, size_t cont) {
@@ -102,8 +476,8 @@ void _buf_unwrap(struct buffer *buf, size_t cont) {
 	size_t size;
 	u8_t *scratch;
 
-	// do nothing if we have enough space
-	if (by <= 0 || cont >= buf->size) return;
+	// do nothing if we have enough space or data is always contiguous
+	if (by <= 0 || cont >= buf->size || (buf->flags & (BUF_MIRROR | BUF_MAPPED))) return;
 
 	// buffer already unwrapped, just move it up
 	if (buf->writep >= buf->readp) {
@@ -147,19 +521,38 @@ void _buf_unwrap(struct buffer *buf, size_t cont) {
 	}
 }
 
-void buf_init(struct buffer *buf, size_t size) {
-	buf->buf    = malloc(size);
+// exchange storage and contents of two buffers, each keeps its own mutex, wake events and stats
+// called with the mutex of a locked, the other buffer must not be in use by any thread
+void _buf_swap(struct buffer *a, struct buffer *b) {
+	struct buffer t = *a;
+	a->buf = b->buf; a->readp = b->readp; a->writep = b->writep; a->wrap = b->wrap;
+	a->size = b->size; a->base_size = b->base_size; a->flags = b->flags; a->mem = b->mem;
+	b->buf = t.buf; b->readp = t.readp; b->writep = t.writep; b->wrap = t.wrap;
+	b->size = t.size; b->base_size = t.base_size; b->flags = t.flags; b->mem = t.mem;
+	a->read_want = 0;
+	a->write_want = 0;
+}
+
+void buf_init(struct buffer *buf, size_t size, unsigned flags) {
+	buf->buf    = _buf_alloc(&size, &flags, &buf->mem);
+	buf->flags  = flags;
 	buf->readp  = buf->buf;
 	buf->writep = buf->buf;
 	buf->wrap   = buf->buf + size;
 	buf->size   = size;
 	buf->base_size = size;
+	buf->wake_reader = NULL;
+	buf->wake_writer = NULL;
+	buf->read_want = 0;
+	buf->write_want = 0;
+	_buf_stats_reset(buf);
 	mutex_create_p(buf->mutex);
 }
 
 void buf_destroy(struct buffer *buf) {
 	if (buf->buf) {
-		free(buf->buf);
+		_buf_unmap(buf);
+		_buf_free(buf->buf, buf->base_size, buf->flags);
 		buf->buf = NULL;
 		buf->size = 0;
 		buf->base_size = 0;
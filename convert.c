@@ -0,0 +1,469 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2023, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Sample conversion from decoder output to outputbuf format, shared by the codecs
+
+// Each conversion writes interleaved stereo ISAMPLE_T frames, mono input is duplicated to both channels.
+// Plain C versions are always available and used for 16 bit builds, SSE2/AVX2 versions are selected at startup
+// from the cpu features on x86 and NEON versions are used when the build targets it on arm.
+
+#include "squeezelite.h"
+
+#if BYTES_PER_FRAME == 8 && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONV_X86  1
+#include <immintrin.h>
+#else
+#define CONV_X86  0
+#endif
+
+#if BYTES_PER_FRAME == 8 && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define CONV_NEON 1
+#include <arm_neon.h>
+#else
+#define CONV_NEON 0
+#endif
+
+#define ISAMPLE_BITS (BYTES_PER_FRAME * 4)
+
+// plain C versions
+
+static void planar32_c(ISAMPLE_T *out, const s32_t *l, const s32_t *r, frames_t n, unsigned bits) {
+	if (bits <= ISAMPLE_BITS) {
+		unsigned shift = ISAMPLE_BITS - bits;
+		while (n--) {
+			*out++ = (ISAMPLE_T)((u32_t)*l++ << shift);
+			*out++ = (ISAMPLE_T)((u32_t)*r++ << shift);
+		}
+	} else {
+		unsigned shift = bits - ISAMPLE_BITS;
+		while (n--) {
+			*out++ = (ISAMPLE_T)(*l++ >> shift);
+			*out++ = (ISAMPLE_T)(*r++ >> shift);
+		}
+	}
+}
+
+// backwards so the samples can be expanded in place, out and in starting at the same address
+static void interleaved16_c(ISAMPLE_T *out, const s16_t *in, frames_t n, unsigned channels) {
+	const s16_t *iptr = in + n * channels;
+	ISAMPLE_T *optr = out + n * 2;
+
+	if (channels == 2) {
+#if BYTES_PER_FRAME == 4
+		if ((void *)out != (void *)in) memmove(out, in, n * BYTES_PER_FRAME);
+#else
+		frames_t count = n * 2;
+		while (count--) {
+			*--optr = (ISAMPLE_T)((u32_t)*--iptr << 16);
+		}
+#endif
+	} else {
+		while (n--) {
+			ISAMPLE_T s = (ISAMPLE_T)((u32_t)*--iptr << (ISAMPLE_BITS - 16));
+			*--optr = s;
+			*--optr = s;
+		}
+	}
+}
+
+static void planar_float_c(ISAMPLE_T *out, const float *l, const float *r, frames_t n) {
+	while (n--) {
+		double scaledl = *l++ * 2147483648.0;
+		double scaledr = *r++ * 2147483648.0;
+		if (scaledl > 2147483647.0) scaledl = 2147483647.0;
+		if (scaledl < -2147483648.0) scaledl = -2147483648.0;
+		if (scaledr > 2147483647.0) scaledr = 2147483647.0;
+		if (scaledr < -2147483648.0) scaledr = -2147483648.0;
+		*out++ = (ISAMPLE_T)((s32_t)scaledl >> (32 - ISAMPLE_BITS));
+		*out++ = (ISAMPLE_T)((s32_t)scaledr >> (32 - ISAMPLE_BITS));
+	}
+}
+
+// 24 bit little endian packed, the common hi-res pcm layout
+static void packed24le_c(ISAMPLE_T *out, const u8_t *in, frames_t n, unsigned channels) {
+	while (n--) {
+		ISAMPLE_T s = (ISAMPLE_T)((in[0] << 8 | in[1] << 16 | (u32_t)in[2] << 24) >> (32 - ISAMPLE_BITS));
+		*out++ = s;
+		if (channels == 2) {
+			in += 3;
+			s = (ISAMPLE_T)((in[0] << 8 | in[1] << 16 | (u32_t)in[2] << 24) >> (32 - ISAMPLE_BITS));
+		}
+		*out++ = s;
+		in += 3;
+	}
+}
+
+#if CONV_X86
+
+__attribute__((target("sse2")))
+static void planar32_sse2(ISAMPLE_T *out, const s32_t *l, const s32_t *r, frames_t n, unsigned bits) {
+	__m128i shift = _mm_cvtsi32_si128(ISAMPLE_BITS - bits);
+	frames_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i vl = _mm_sll_epi32(_mm_loadu_si128((const __m128i *)(l + i)), shift);
+		__m128i vr = _mm_sll_epi32(_mm_loadu_si128((const __m128i *)(r + i)), shift);
+		_mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi32(vl, vr));
+		_mm_storeu_si128((__m128i *)(out + 2 * i + 4), _mm_unpackhi_epi32(vl, vr));
+	}
+
+	planar32_c(out + 2 * i, l + i, r + i, n - i, bits);
+}
+
+__attribute__((target("sse2")))
+static void interleaved16_sse2(ISAMPLE_T *out, const s16_t *in, frames_t n, unsigned channels) {
+	frames_t i = n * 2;
+
+	if (channels != 2) {
+		interleaved16_c(out, in, n, channels);
+		return;
+	}
+
+	// each block is loaded before it is stored above its own input, so in place expansion is safe
+	while (i >= 8) {
+		__m128i v;
+		i -= 8;
+		v = _mm_loadu_si128((const __m128i *)(in + i));
+		_mm_storeu_si128((__m128i *)(out + i + 4), _mm_unpackhi_epi16(_mm_setzero_si128(), v));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi16(_mm_setzero_si128(), v));
+	}
+
+	interleaved16_c(out, in, i / 2, 2);
+}
+
+// float to s32 with saturation: the conversion gives 0x80000000 when out of range, flipped to 0x7fffffff if positive
+__attribute__((target("sse2")))
+static inline __m128i float_s32_sse2(__m128 v) {
+	__m128 limit = _mm_set1_ps(2147483648.0f);
+	v = _mm_mul_ps(v, limit);
+	return _mm_xor_si128(_mm_cvttps_epi32(v), _mm_castps_si128(_mm_cmpge_ps(v, limit)));
+}
+
+__attribute__((target("sse2")))
+static void planar_float_sse2(ISAMPLE_T *out, const float *l, const float *r, frames_t n) {
+	frames_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i vl = float_s32_sse2(_mm_loadu_ps(l + i));
+		__m128i vr = float_s32_sse2(_mm_loadu_ps(r + i));
+		_mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi32(vl, vr));
+		_mm_storeu_si128((__m128i *)(out + 2 * i + 4), _mm_unpackhi_epi32(vl, vr));
+	}
+
+	planar_float_c(out + 2 * i, l + i, r + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void planar32_avx2(ISAMPLE_T *out, const s32_t *l, const s32_t *r, frames_t n, unsigned bits) {
+	__m128i shift = _mm_cvtsi32_si128(ISAMPLE_BITS - bits);
+	frames_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256i vl = _mm256_sll_epi32(_mm256_loadu_si256((const __m256i *)(l + i)), shift);
+		__m256i vr = _mm256_sll_epi32(_mm256_loadu_si256((const __m256i *)(r + i)), shift);
+		__m256i lo = _mm256_unpacklo_epi32(vl, vr);
+		__m256i hi = _mm256_unpackhi_epi32(vl, vr);
+		_mm256_storeu_si256((__m256i *)(out + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(out + 2 * i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	planar32_c(out + 2 * i, l + i, r + i, n - i, bits);
+}
+
+__attribute__((target("avx2")))
+static void interleaved16_avx2(ISAMPLE_T *out, const s16_t *in, frames_t n, unsigned channels) {
+	frames_t i = n * 2;
+
+	if (channels != 2) {
+		interleaved16_c(out, in, n, channels);
+		return;
+	}
+
+	// each block is loaded before it is stored above its own input, so in place expansion is safe
+	while (i >= 8) {
+		__m256i v;
+		i -= 8;
+		v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i)));
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_slli_epi32(v, 16));
+	}
+
+	interleaved16_c(out, in, i / 2, 2);
+}
+
+__attribute__((target("avx2")))
+static void planar_float_avx2(ISAMPLE_T *out, const float *l, const float *r, frames_t n) {
+	__m256 limit = _mm256_set1_ps(2147483648.0f);
+	frames_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256 fl = _mm256_mul_ps(_mm256_loadu_ps(l + i), limit);
+		__m256 fr = _mm256_mul_ps(_mm256_loadu_ps(r + i), limit);
+		__m256i vl = _mm256_xor_si256(_mm256_cvttps_epi32(fl), _mm256_castps_si256(_mm256_cmp_ps(fl, limit, _CMP_GE_OQ)));
+		__m256i vr = _mm256_xor_si256(_mm256_cvttps_epi32(fr), _mm256_castps_si256(_mm256_cmp_ps(fr, limit, _CMP_GE_OQ)));
+		__m256i lo = _mm256_unpacklo_epi32(vl, vr);
+		__m256i hi = _mm256_unpackhi_epi32(vl, vr);
+		_mm256_storeu_si256((__m256i *)(out + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(out + 2 * i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	planar_float_c(out + 2 * i, l + i, r + i, n - i);
+}
+
+// byte shuffle needs ssse3 which every avx2 cpu has, 4 samples from each 16 byte load of which 12 are used
+__attribute__((target("avx2")))
+static void packed24le_avx2(ISAMPLE_T *out, const u8_t *in, frames_t n, unsigned channels) {
+	const __m128i shuffle = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	size_t samples = (size_t)n * channels, i = 0;
+
+	if (channels != 2) {
+		packed24le_c(out, in, n, channels);
+		return;
+	}
+
+	for (; i + 6 <= samples; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 3 * i));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_shuffle_epi8(v, shuffle));
+	}
+
+	packed24le_c(out + i, in + 3 * i, (samples - i) / 2, 2);
+}
+
+#endif
+
+#if CONV_NEON
+
+static void planar32_neon(ISAMPLE_T *out, const s32_t *l, const s32_t *r, frames_t n, unsigned bits) {
+	int32x4_t shift = vdupq_n_s32(ISAMPLE_BITS - bits);
+	frames_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		int32x4x2_t v;
+		v.val[0] = vshlq_s32(vld1q_s32(l + i), shift);
+		v.val[1] = vshlq_s32(vld1q_s32(r + i), shift);
+		vst2q_s32(out + 2 * i, v);
+	}
+
+	planar32_c(out + 2 * i, l + i, r + i, n - i, bits);
+}
+
+static void interleaved16_neon(ISAMPLE_T *out, const s16_t *in, frames_t n, unsigned channels) {
+	frames_t i = n * 2;
+
+	if (channels != 2) {
+		interleaved16_c(out, in, n, channels);
+		return;
+	}
+
+	// each block is loaded before it is stored above its own input, so in place expansion is safe
+	while (i >= 8) {
+		int16x8_t v;
+		i -= 8;
+		v = vld1q_s16(in + i);
+		vst1q_s32(out + i + 4, vshll_n_s16(vget_high_s16(v), 16));
+		vst1q_s32(out + i, vshll_n_s16(vget_low_s16(v), 16));
+	}
+
+	interleaved16_c(out, in, i / 2, 2);
+}
+
+// float to integer conversion saturates on arm
+static void planar_float_neon(ISAMPLE_T *out, const float *l, const float *r, frames_t n) {
+	frames_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		int32x4x2_t v;
+		v.val[0] = vcvtq_s32_f32(vmulq_n_f32(vld1q_f32(l + i), 2147483648.0f));
+		v.val[1] = vcvtq_s32_f32(vmulq_n_f32(vld1q_f32(r + i), 2147483648.0f));
+		vst2q_s32(out + 2 * i, v);
+	}
+
+	planar_float_c(out + 2 * i, l + i, r + i, n - i);
+}
+
+// 16 samples at a time, de-interleaved into their three bytes and zipped back as b0 << 8 | b1 << 16 | b2 << 24
+static void packed24le_neon(ISAMPLE_T *out, const u8_t *in, frames_t n, unsigned channels) {
+	size_t samples = (size_t)n * channels, i = 0;
+	uint8x16_t zero = vdupq_n_u8(0);
+
+	if (channels != 2) {
+		packed24le_c(out, in, n, channels);
+		return;
+	}
+
+	for (; i + 16 <= samples; i += 16) {
+		uint8x16x3_t b = vld3q_u8(in + 3 * i);
+		uint8x16x2_t lo = vzipq_u8(zero, b.val[0]);
+		uint8x16x2_t hi = vzipq_u8(b.val[1], b.val[2]);
+		uint16x8x2_t s0 = vzipq_u16(vreinterpretq_u16_u8(lo.val[0]), vreinterpretq_u16_u8(hi.val[0]));
+		uint16x8x2_t s1 = vzipq_u16(vreinterpretq_u16_u8(lo.val[1]), vreinterpretq_u16_u8(hi.val[1]));
+		vst1q_s32(out + i, vreinterpretq_s32_u16(s0.val[0]));
+		vst1q_s32(out + i + 4, vreinterpretq_s32_u16(s0.val[1]));
+		vst1q_s32(out + i + 8, vreinterpretq_s32_u16(s1.val[0]));
+		vst1q_s32(out + i + 12, vreinterpretq_s32_u16(s1.val[1]));
+	}
+
+	packed24le_c(out + i, in + 3 * i, (samples - i) / 2, 2);
+}
+
+#endif
+
+// selected implementations, plain C until conv_init is called
+static void (* planar32)(ISAMPLE_T *out, const s32_t *l, const s32_t *r, frames_t n, unsigned bits) = planar32_c;
+static void (* interleaved16)(ISAMPLE_T *out, const s16_t *in, frames_t n, unsigned channels) = interleaved16_c;
+static void (* planar_float)(ISAMPLE_T *out, const float *l, const float *r, frames_t n) = planar_float_c;
+static void (* packed24le)(ISAMPLE_T *out, const u8_t *in, frames_t n, unsigned channels) = packed24le_c;
+static const char *kernels = "c";
+
+const char *conv_init(void) {
+#if CONV_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		planar32 = planar32_avx2;
+		interleaved16 = interleaved16_avx2;
+		planar_float = planar_float_avx2;
+		packed24le = packed24le_avx2;
+		kernels = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		planar32 = planar32_sse2;
+		interleaved16 = interleaved16_sse2;
+		planar_float = planar_float_sse2;
+		kernels = "sse2";
+	}
+#endif
+#if CONV_NEON
+	planar32 = planar32_neon;
+	interleaved16 = interleaved16_neon;
+	planar_float = planar_float_neon;
+	packed24le = packed24le_neon;
+	kernels = "neon";
+#endif
+	return kernels;
+}
+
+// planar samples right justified in bits (8 to 32), pass r == l for mono
+void conv_planar32(ISAMPLE_T *out, const s32_t *l, const s32_t *r, frames_t n, unsigned bits) {
+	if (bits <= ISAMPLE_BITS) {
+		planar32(out, l, r, n, bits);
+	} else {
+		planar32_c(out, l, r, n, bits);
+	}
+}
+
+// interleaved samples right justified in bits (8 to 32)
+void conv_interleaved32(ISAMPLE_T *out, const s32_t *in, frames_t n, unsigned channels, unsigned bits) {
+	if (bits <= ISAMPLE_BITS) {
+		unsigned shift = ISAMPLE_BITS - bits;
+		if (channels == 2) {
+			frames_t count = n * 2;
+			while (count--) *out++ = (ISAMPLE_T)((u32_t)*in++ << shift);
+		} else {
+			while (n--) {
+				*out++ = (ISAMPLE_T)((u32_t)*in << shift);
+				*out++ = (ISAMPLE_T)((u32_t)*in++ << shift);
+			}
+		}
+	} else {
+		unsigned shift = bits - ISAMPLE_BITS;
+		if (channels == 2) {
+			frames_t count = n * 2;
+			while (count--) *out++ = (ISAMPLE_T)(*in++ >> shift);
+		} else {
+			while (n--) {
+				*out++ = (ISAMPLE_T)(*in >> shift);
+				*out++ = (ISAMPLE_T)(*in++ >> shift);
+			}
+		}
+	}
+}
+
+// interleaved native 16 bit samples, out may start at the same address as in to expand them in place
+void conv_interleaved16(ISAMPLE_T *out, const s16_t *in, frames_t n, unsigned channels) {
+	interleaved16(out, in, n, channels);
+}
+
+// planar native 16 bit samples, pass r == l for mono
+void conv_planar16(ISAMPLE_T *out, const s16_t *l, const s16_t *r, frames_t n) {
+	while (n--) {
+		*out++ = (ISAMPLE_T)((u32_t)*l++ << (ISAMPLE_BITS - 16));
+		*out++ = (ISAMPLE_T)((u32_t)*r++ << (ISAMPLE_BITS - 16));
+	}
+}
+
+// planar float samples of nominal range +/-1.0, saturated, pass r == l for mono
+void conv_planar_float(ISAMPLE_T *out, const float *l, const float *r, frames_t n) {
+	planar_float(out, l, r, n);
+}
+
+// planar fixed point samples with fracbits fractional bits (at least 24), rounded and saturated, pass r == l for mono
+void conv_planar_fixed(ISAMPLE_T *out, const s32_t *l, const s32_t *r, frames_t n, unsigned fracbits) {
+	s32_t one = 1L << fracbits;
+	s32_t round = 1L << (fracbits - 24);
+	unsigned shift = fracbits + 1 - 24;
+
+	while (n--) {
+		s32_t sl = *l++ + round;
+		s32_t sr = *r++ + round;
+		if (sl >= one) sl = one - 1; else if (sl < -one) sl = -one;
+		if (sr >= one) sr = one - 1; else if (sr < -one) sr = -one;
+#if BYTES_PER_FRAME == 4
+		*out++ = (ISAMPLE_T)((sl >> shift) >> 8);
+		*out++ = (ISAMPLE_T)((sr >> shift) >> 8);
+#else
+		*out++ = (ISAMPLE_T)((u32_t)(sl >> shift) << 8);
+		*out++ = (ISAMPLE_T)((u32_t)(sr >> shift) << 8);
+#endif
+	}
+}
+
+// packed integer samples of 1 to 4 bytes in either byte order, single byte samples are taken as signed
+void conv_packed(ISAMPLE_T *out, const u8_t *in, frames_t n, unsigned channels, unsigned bytes, bool bigendian) {
+	size_t count = (size_t)n * channels;
+	unsigned shift = 32 - ISAMPLE_BITS;
+
+	if (bytes == 3 && !bigendian) {
+		packed24le(out, in, n, channels);
+		return;
+	}
+
+#if SL_LITTLE_ENDIAN
+	if (bytes == 2 && !bigendian && channels == 2 && ((uintptr_t)in & 1) == 0) {
+#else
+	if (bytes == 2 && bigendian && channels == 2 && ((uintptr_t)in & 1) == 0) {
+#endif
+		// native 16 bit stereo, out and in never overlap here so the backwards conversion is fine
+		interleaved16(out, (const s16_t *)(const void *)in, n, 2);
+		return;
+	}
+
+	while (count--) {
+		u32_t s;
+		switch (bytes) {
+		case 1:  s = (u32_t)in[0] << 24; break;
+		case 2:  s = bigendian ? (u32_t)in[0] << 24 | in[1] << 16 : (u32_t)in[1] << 24 | in[0] << 16; break;
+		case 3:  s = (u32_t)in[0] << 24 | in[1] << 16 | in[2] << 8; break;
+		default: s = bigendian ? (u32_t)in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3]
+							   : (u32_t)in[3] << 24 | in[2] << 16 | in[1] << 8 | in[0]; break;
+		}
+		*out++ = (ISAMPLE_T)(s >> shift);
+		if (channels == 1) *out++ = (ISAMPLE_T)(s >> shift);
+		in += bytes;
+	}
+}
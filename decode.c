@@ -36,11 +36,29 @@ struct decodestate decode;
 struct codec *codecs[MAX_CODECS];
 struct codec *codec;
 static bool running = true;
+static event_event decode_wake;
+static frames_t pending;                 // frames written to outputbuf by the codec but not yet committed
+static u64_t stream_frames;              // frames decoded from the current stream at stream_rate
+static unsigned stream_rate;             // zero once streambuf sizing has been done for the stream
 
-#define LOCK_S   mutex_lock(streambuf->mutex)
-#define UNLOCK_S mutex_unlock(streambuf->mutex)
-#define LOCK_O   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(outputbuf->mutex)
+static struct {
+	bool pending;                        // codec is waiting on its workers or the stream, see decode_yield
+	size_t bytes;
+} yield;
+
+static struct {
+	bool pending;                        // codec to open when the current stream completes, see codec_prefetch
+	u8_t format, sample_size, sample_rate, channels, endianness;
+} next_codec;
+
+static void _codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness);
+
+#define SIZE_STREAM_SECS 10              // decoded audio used to measure stream byte rate
+
+#define LOCK_S   buf_lock(streambuf)
+#define UNLOCK_S buf_unlock(streambuf)
+#define LOCK_O   buf_lock(outputbuf)
+#define UNLOCK_O buf_unlock(outputbuf)
 #define LOCK_D   mutex_lock(decode.mutex);
 #define UNLOCK_D mutex_unlock(decode.mutex);
 
@@ -54,20 +72,43 @@ static bool running = true;
 #define MAY_PROCESS(x)
 #endif
 
+// make frames written by the codec visible to the output thread - one commit per codec decode call
+// called after each codec decode by the decode thread, or by tools/bench.c in its place
+void _decode_publish(void) {
+	if (pending) {
+		_buf_commit(outputbuf, pending * BYTES_PER_FRAME);
+		pending = 0;
+	}
+}
+
+// size streambuf once enough of the stream has been decoded to measure its byte rate
+static void _decode_measure(void) {
+	if (stream_rate && stream_frames >= (u64_t)stream_rate * SIZE_STREAM_SECS) {
+		u64_t ms = stream_frames * 1000 / stream_rate;
+		stream_rate = 0;
+		stream_autosize(ms);
+	}
+}
+
 static void *decode_thread() {
+#if LINUX
+	char placed[128];
+	LOG_INFO("thread %s", thread_place("decode", placed, sizeof(placed)));
+#endif
 
 	while (running) {
 		size_t bytes, space, min_space;
+		size_t want_space = 0, want_bytes = 0;
 		bool toend;
+		bool draining = false;
 		bool ran = false;
 
 		LOCK_S;
 		bytes = _buf_used(streambuf);
-		toend = (stream.state <= DISCONNECT);
+		toend = STREAM_ENDED;
 		UNLOCK_S;
-		LOCK_O;
+		// decode thread is the only producer for outputbuf so space can be read without LOCK_O
 		space = _buf_space(outputbuf);
-		UNLOCK_O;
 
 		LOCK_D;
 
@@ -88,19 +129,38 @@ static void *decode_thread() {
 			);
 			IF_PROCESS(
 				min_space = process.max_out_frames * BYTES_PER_FRAME;
+				draining = process.draining;
 			);
 			
-			if (space > min_space && (bytes > codec->min_read_bytes || toend)) {
+			if (space > min_space && (bytes > codec->min_read_bytes || toend || draining)) {
 				
-				decode.state = codec->decode();
+				yield.pending = false;
+
+				IF_DIRECT(
+					decode.state = codec->decode();
+					_decode_publish();
+					_decode_measure();
+				);
 
 				IF_PROCESS(
-					if (process.in_frames) {
-						process_samples();
+					if (!process.draining) {
+
+						decode.state = codec->decode();
+						_decode_publish();
+						_decode_measure();
+
+						if (process.in_frames) {
+							process_samples();
+						}
+
+						if (decode.state == DECODE_COMPLETE) {
+							process.draining = true;
+						}
 					}
 
-					if (decode.state == DECODE_COMPLETE) {
-						process_drain();
+					// completion is held back until the processing tail has been written to outputbuf
+					if (process.draining) {
+						decode.state = process_drain() ? DECODE_COMPLETE : DECODE_RUNNING;
 					}
 				);
 
@@ -112,23 +172,195 @@ static void *decode_thread() {
 					if (output.fade_mode) _checkfade(false);
 					UNLOCK_O;
 
+					// continue straight into a prefetched stream, slimproto sees it as a newly opened one
+					if (decode.state == DECODE_COMPLETE && next_codec.pending) {
+						next_codec.pending = false;
+						stream_prefetch_switch();
+						if (next_codec.format != '?') {
+							_codec_open(next_codec.format, next_codec.sample_size, next_codec.sample_rate,
+										next_codec.channels, next_codec.endianness);
+						} else {
+							// codec is opened once the server has sent codc for it
+							decode.state = DECODE_STOPPED;
+						}
+					}
+
 					wake_controller();
 				}
 
-				ran = true;
+				if (yield.pending) {
+					want_bytes = yield.bytes;
+				} else {
+					ran = true;
+				}
+
+			} else if (space <= min_space) {
+				want_space = min_space + 1;
+			} else {
+				want_bytes = codec->min_read_bytes + 1;
 			}
 		}
 		
 		UNLOCK_D;
 
 		if (!ran) {
-			usleep(100000);
+			// sleep until outputbuf space or streambuf data is available, or decode/stream state changes
+			// each of which signals decode_wake, timeout is only a safety net
+			if ((want_space && _buf_want_write(outputbuf, want_space)) || (want_bytes && _buf_want_read(streambuf, want_bytes))) {
+				continue;
+			}
+			wait_wake(decode_wake, 1000);
+		}
+	}
+
+	return 0;
+}
+
+// worker threads for codecs which decode independent frames in parallel, started on first use
+// jobs run in the order submitted on whichever worker is free, the worker index lets a codec keep state per worker
+static struct {
+	thread_type thread;
+	event_event wake;
+} workers[MAX_DECODE_WORKERS];
+static int num_workers = -1;       // -1 until started
+static bool workers_running;
+static mutex_type jobs_mutex;
+static struct decode_job *jobs_head, *jobs_tail;
+static event_event jobs_done;
+
+static void *worker_thread(void *arg) {
+	unsigned id = (uintptr_t)arg;
+#if LINUX
+	char placed[128];
+	LOG_INFO("thread %s", thread_place("worker", placed, sizeof(placed)));
+#endif
+
+	while (workers_running) {
+		struct decode_job *job;
+
+		mutex_lock(jobs_mutex);
+		if ((job = jobs_head) != NULL) {
+			jobs_head = job->next;
+			if (!jobs_head) jobs_tail = NULL;
+		}
+		mutex_unlock(jobs_mutex);
+
+		if (!job) {
+			wait_wake(workers[id].wake, 1000);
+			continue;
 		}
+
+		job->run(job, id);
+
+		atomic_fence();
+		job->done = true;
+		wake_signal(jobs_done);
+		wake_signal(decode_wake);
 	}
 
 	return 0;
 }
 
+// number of workers available, starting them if not yet done - none on a single core
+unsigned decode_workers(void) {
+	int cpus, i;
+
+	if (num_workers >= 0) return num_workers;
+
+#if WIN
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	cpus = info.dwNumberOfProcessors;
+#else
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	// the decode thread scans and commits while the workers decode
+	num_workers = min(cpus - 1, MAX_DECODE_WORKERS);
+	if (num_workers <= 0) {
+		num_workers = 0;
+		return 0;
+	}
+
+	mutex_create(jobs_mutex);
+	wake_create(jobs_done);
+	workers_running = true;
+
+	for (i = 0; i < num_workers; ++i) {
+		wake_create(workers[i].wake);
+#if LINUX || OSX || FREEBSD
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+#ifdef PTHREAD_STACK_MIN
+		pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + DECODE_THREAD_STACK_SIZE);
+#endif
+		pthread_create(&workers[i].thread, &attr, worker_thread, (void *)(uintptr_t)i);
+		pthread_attr_destroy(&attr);
+#endif
+#if WIN
+		workers[i].thread = CreateThread(NULL, DECODE_THREAD_STACK_SIZE, (LPTHREAD_START_ROUTINE)&worker_thread,
+										 (void *)(uintptr_t)i, 0, NULL);
+#endif
+	}
+
+	LOG_INFO("started %d decode workers", num_workers);
+	return num_workers;
+}
+
+void decode_submit(struct decode_job *job) {
+	int i;
+
+	job->done = false;
+	job->next = NULL;
+
+	mutex_lock(jobs_mutex);
+	if (jobs_tail) {
+		jobs_tail->next = job;
+	} else {
+		jobs_head = job;
+	}
+	jobs_tail = job;
+	mutex_unlock(jobs_mutex);
+
+	for (i = 0; i < num_workers; ++i) {
+		wake_signal(workers[i].wake);
+	}
+}
+
+// called with LOCK_D by a codec which can make no progress until one of its jobs completes, or until streambuf
+// holds bytes if not zero - the decode thread waits for either after releasing LOCK_D rather than calling it again
+void decode_yield(size_t bytes) {
+	yield.pending = true;
+	yield.bytes = bytes;
+}
+
+// wait up to timeout ms for a submitted job to complete, returns true if it has
+bool decode_wait(struct decode_job *job, int timeout) {
+	if (!job->done) {
+		wait_wake(jobs_done, timeout);
+	}
+	atomic_fence();
+	return job->done;
+}
+
+static void workers_close(void) {
+	int i;
+
+	if (num_workers <= 0) return;
+
+	workers_running = false;
+	for (i = 0; i < num_workers; ++i) {
+		wake_signal(workers[i].wake);
+#if LINUX || OSX || FREEBSD
+		pthread_join(workers[i].thread, NULL);
+#endif
+		wake_close(workers[i].wake);
+	}
+	wake_close(jobs_done);
+	mutex_destroy(jobs_mutex);
+	num_workers = -1;
+}
+
 static void sort_codecs(int pry, struct codec* ptr) {
 	static int priority[MAX_CODECS];
 	int i, tpry;
@@ -161,6 +393,8 @@ void decode_init(log_level level, const char *include_codecs, const char *exclud
 
 	LOG_INFO("init decode");
 
+	LOG_INFO("sample conversion using %s", conv_init());
+
 	// register codecs
 	// dsf,dff,alc,wma,wmap,wmal,aac,spt,ogg,ogf,flc,aif,pcm,mp3
 	i = 0;
@@ -212,6 +446,10 @@ void decode_init(log_level level, const char *include_codecs, const char *exclud
 
 	mutex_create(decode.mutex);
 
+	wake_create(decode_wake);
+	streambuf->wake_reader = &decode_wake;
+	outputbuf->wake_writer = &decode_wake;
+
 #if LINUX || OSX || FREEBSD
 	pthread_attr_t attr;
 	pthread_attr_init(&attr);
@@ -244,9 +482,14 @@ void decode_close(void) {
 	}
 	running = false;
 	UNLOCK_D;
+	wake_decode();
 #if LINUX || OSX || FREEBSD
 	pthread_join(thread, NULL);
 #endif
+	workers_close();
+	streambuf->wake_reader = NULL;
+	outputbuf->wake_writer = NULL;
+	wake_close(decode_wake);
 	mutex_destroy(decode.mutex);
 }
 
@@ -254,6 +497,8 @@ void decode_flush(void) {
 	LOG_INFO("decode flush");
 	LOCK_D;
 	decode.state = DECODE_STOPPED;
+	next_codec.pending = false;
+	pending = 0;
 	IF_PROCESS(
 		process_flush();
 	);
@@ -265,6 +510,9 @@ unsigned decode_newstream(unsigned sample_rate, unsigned supported_rates[]) {
 	// called with O locked to get sample rate for potentially processed output stream
 	// release O mutex during process_newstream as it can take some time
 
+	stream_frames = 0;
+	stream_rate = sample_rate;
+
 	MAY_PROCESS(
 		if (decode.process) {
 			UNLOCK_O;
@@ -273,18 +521,68 @@ unsigned decode_newstream(unsigned sample_rate, unsigned supported_rates[]) {
 		}
 	);
 
+	_output_autosize(sample_rate);
+
 	return sample_rate;
 }
 
-void codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness) {
+// codec output api - called with decode mutex set, from within codec decode functions
+// decode_reserve returns the frames which can be written contiguously at *ptr, either in outputbuf or process.inbuf
+// decode_commit records frames written, outputbuf writes are batched and published once the codec decode call returns
+// a zero reserve with frames pending is because the batch has reached the outputbuf wrap point, so publish and retry
+// outputbuf is only written by the decode thread so no LOCK_O is needed
+frames_t decode_reserve(u8_t **ptr) {
+	frames_t space, cont;
+
+	IF_PROCESS(
+		*ptr = process.inbuf + process.in_frames * BYTES_PER_FRAME;
+		return process.max_in_frames - process.in_frames;
+	);
+
+	space = _buf_space(outputbuf) / BYTES_PER_FRAME - pending;
+	cont = _buf_cont_write(outputbuf) / BYTES_PER_FRAME - pending;
+
+	if (cont == 0 && pending) {
+		_decode_publish();
+		space = _buf_space(outputbuf) / BYTES_PER_FRAME;
+		cont = _buf_cont_write(outputbuf) / BYTES_PER_FRAME;
+	}
+
+	*ptr = outputbuf->writep + pending * BYTES_PER_FRAME;
+	return min(space, cont);
+}
+
+// total frames which can be written, possibly across more than one reserve
+frames_t decode_space(void) {
+	IF_PROCESS(
+		return process.max_in_frames - process.in_frames;
+	);
+	return _buf_space(outputbuf) / BYTES_PER_FRAME - pending;
+}
+
+void decode_commit(frames_t frames) {
+	stream_frames += frames;
+	IF_PROCESS(
+		process.in_frames += frames;
+		return;
+	);
+	pending += frames;
+}
+
+// called from other threads when decode may now be able to run
+void wake_decode(void) {
+	wake_signal(decode_wake);
+}
+
+// called with decode mutex locked
+static void _codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness) {
 	int i;
 
 	LOG_INFO("codec open: '%c'", format);
 
-	LOCK_D;
-
 	decode.new_stream = true;
 	decode.state = DECODE_STOPPED;
+	stream_rate = 0;
 
 	MAY_PROCESS(
 		decode.direct = true; // potentially changed within codec when processing enabled
@@ -306,13 +604,40 @@ void codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels,
 
 			decode.state = DECODE_READY;
 
-			UNLOCK_D;
 			return;
 		}
 	}
 
+	LOG_ERROR("codec not found");
+}
+
+void codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness) {
+	LOCK_D;
+	next_codec.pending = false;
+	_codec_open(format, sample_size, sample_rate, channels, endianness);
 	UNLOCK_D;
+}
 
-	LOG_ERROR("codec not found");
+// open the next stream into a second buffer while the current one is still being decoded
+// the codec is opened by the decode thread once the current stream completes, returns false if not possible
+// an unknown format '?' is replaced by that of codc when it arrives before the switch, which calls this again
+bool codec_prefetch(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness) {
+	bool ok = false;
+
+	LOCK_D;
+
+	if (decode.state == DECODE_RUNNING && codec && (next_codec.pending || stream_prefetch())) {
+		next_codec.format = format;
+		next_codec.sample_size = sample_size;
+		next_codec.sample_rate = sample_rate;
+		next_codec.channels = channels;
+		next_codec.endianness = endianness;
+		next_codec.pending = true;
+		ok = true;
+	}
+
+	UNLOCK_D;
+
+	return ok;
 }
 
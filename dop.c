@@ -27,8 +27,8 @@
 extern struct buffer *outputbuf;
 extern struct outputstate output;
 
-#define LOCK_O   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(outputbuf->mutex)
+#define LOCK_O   buf_lock(outputbuf)
+#define UNLOCK_O buf_unlock(outputbuf)
 
 // check for 32 dop marker frames to see if this is a dop stream
 // dop is always encoded in 24 bit samples with markers 0x05 or 0xFA in MSB
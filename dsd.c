@@ -35,26 +35,21 @@ extern struct buffer *outputbuf;
 extern struct streamstate stream;
 extern struct outputstate output;
 extern struct decodestate decode;
-extern struct processstate process;
 
-#define LOCK_S   mutex_lock(streambuf->mutex)
-#define UNLOCK_S mutex_unlock(streambuf->mutex)
-#define LOCK_O   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(outputbuf->mutex)
+#define LOCK_S   buf_lock(streambuf)
+#define UNLOCK_S buf_unlock(streambuf)
+#define LOCK_O   buf_lock(outputbuf)
+#define UNLOCK_O buf_unlock(outputbuf)
 #if PROCESS
-#define LOCK_O_direct   if (decode.direct) mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct if (decode.direct) mutex_unlock(outputbuf->mutex)
-#define LOCK_O_not_direct   if (!decode.direct) mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_not_direct if (!decode.direct) mutex_unlock(outputbuf->mutex)
-#define IF_DIRECT(x)    if (decode.direct) { x }
-#define IF_PROCESS(x)   if (!decode.direct) { x }
+#define LOCK_O_direct   if (decode.direct) buf_lock(outputbuf)
+#define UNLOCK_O_direct if (decode.direct) buf_unlock(outputbuf)
+#define LOCK_O_not_direct   if (!decode.direct) buf_lock(outputbuf)
+#define UNLOCK_O_not_direct if (!decode.direct) buf_unlock(outputbuf)
 #else
-#define LOCK_O_direct   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct mutex_unlock(outputbuf->mutex)
+#define LOCK_O_direct   buf_lock(outputbuf)
+#define UNLOCK_O_direct buf_unlock(outputbuf)
 #define LOCK_O_not_direct
 #define UNLOCK_O_not_direct
-#define IF_DIRECT(x)    { x }
-#define IF_PROCESS(x)
 #endif
 
 #define BLOCK 4096 // expected size of dsd block
@@ -236,10 +231,6 @@ static decode_state _decode_dsf(void) {
 		return DECODE_COMPLETE;
 	}
 	
-	IF_PROCESS(
-		process.in_frames = 0;
-	);
-
 	while (block_left) {
 		
 		frames_t frames, out, count;
@@ -248,6 +239,7 @@ static decode_state _decode_dsf(void) {
 		u8_t *iptrl = (u8_t *)streambuf->readp;
 		u8_t *iptrr = (u8_t *)streambuf->readp + d->block_size;
 		u32_t *optr;
+		u8_t *wptr;
 		
 		if (iptrr >= streambuf->wrap) {
 			iptrr -= streambuf->size;
@@ -271,14 +263,8 @@ static decode_state _decode_dsf(void) {
 
 		bytes = min(block_left, min(streambuf->wrap - iptrl, streambuf->wrap - iptrr));
 
-		IF_DIRECT(
-			out = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
-			optr = (u32_t *)outputbuf->writep;
-		);
-		IF_PROCESS(
-			out = process.max_in_frames - process.in_frames;
-			optr = (u32_t *)(process.inbuf + process.in_frames * BYTES_PER_FRAME);
-		);
+		out = decode_reserve(&wptr);
+		optr = (u32_t *)wptr;
 
 		frames = min(bytes, d->sample_bytes) / bytes_per_frame;
 		if (frames == 0) {
@@ -500,12 +486,7 @@ static decode_state _decode_dsf(void) {
 			d->sample_bytes = 0;
 		}
 		
-		IF_DIRECT(
-			_buf_inc_writep(outputbuf, frames * BYTES_PER_FRAME);
-		);
-		IF_PROCESS(
-			process.in_frames += frames;
-		);
+		decode_commit(frames);
 
 		LOG_SDEBUG("write %u frames", frames);
 	}
@@ -534,18 +515,13 @@ static decode_state _decode_dsdiff(void) {
 
 	unsigned bytes_per_frame, bytes_read;
 	frames_t out, frames, count;
-	u8_t *iptr;
+	u8_t *iptr, *wptr;
 	u32_t *optr;
 	u8_t tmp[WRAP_BUF_SIZE];
 	
 	unsigned bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
 	
-	IF_DIRECT(
-		out = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
-	);
-	IF_PROCESS(
-		out = process.max_in_frames;
-	);
+	out = decode_reserve(&wptr);
 	
 	switch (outfmt) {
 	case DSD_U32_LE:
@@ -569,12 +545,7 @@ static decode_state _decode_dsdiff(void) {
 	
 	iptr = (u8_t *)streambuf->readp;
 	
-	IF_DIRECT(
-		optr = (u32_t *)outputbuf->writep;
-	);
-	IF_PROCESS(
-		optr = (u32_t *)process.inbuf;
-	);
+	optr = (u32_t *)wptr;
 	
 	// handle wrap around end of streambuf and partial dsd frame at end of stream
 	if (!frames && bytes < bytes_per_frame) {
@@ -714,12 +685,7 @@ static decode_state _decode_dsdiff(void) {
 		d->sample_bytes = 0;
 	}
 	
-	IF_DIRECT(
-		_buf_inc_writep(outputbuf, frames * BYTES_PER_FRAME);
-			  );
-	IF_PROCESS(
-		process.in_frames = frames;
-	);
+	decode_commit(frames);
 	
 	LOG_SDEBUG("write %u frames", frames);
 
@@ -735,7 +701,7 @@ static decode_state dsd_decode(void) {
 
 	LOCK_S;
 
-	if ((stream.state <= DISCONNECT && !_buf_used(streambuf)) || (!decode.new_stream && d->sample_bytes == 0)) {
+	if ((STREAM_ENDED && !_buf_used(streambuf)) || (!decode.new_stream && d->sample_bytes == 0)) {
 		UNLOCK_S;
 		return DECODE_COMPLETE;
 	}
@@ -819,6 +785,7 @@ static decode_state dsd_decode(void) {
 			if (output.fade_mode) _checkfade(true);
 		} else {
 			LOG_INFO("DSD%u stream, format: %s, rate: %uHz\n", d->sample_rate / 44100, fmtstr, output.next_sample_rate);
+			_output_autosize(output.next_sample_rate);
 			output.fade = FADE_INACTIVE;
 		}
 
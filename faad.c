@@ -23,14 +23,12 @@
 
 #include <neaacdec.h>
 
-#if BYTES_PER_FRAME == 4		
-#define ALIGN(n) 	(n)
-#else
-#define ALIGN(n) 	(n << 8)		
-#endif
-
 #define WRAPBUF_LEN 2048
 
+// all per stream allocations are from the arena, reset when a stream is opened, with sample tables of long tracks
+// which do not fit placed on the heap and released with it
+#define ARENA_SIZE (512 * 1024)
+
 struct chunk_table {
 	u32_t sample, offset;
 };
@@ -49,6 +47,7 @@ struct faad {
 	u64_t sttssamples;
 	bool  empty;
 	struct chunk_table *chunkinfo;
+	u8_t *wrapbuf;           // frames which may wrap round the end of streambuf are copied here
 	// faad symbols to be dynamically loaded
 #if !LINKALL
 	NeAACDecConfigurationPtr (* NeAACDecGetCurrentConfiguration)(NeAACDecHandle);
@@ -63,6 +62,7 @@ struct faad {
 };
 
 static struct faad *a;
+static struct arena arena;
 
 extern log_level loglevel;
 
@@ -71,22 +71,17 @@ extern struct buffer *outputbuf;
 extern struct streamstate stream;
 extern struct outputstate output;
 extern struct decodestate decode;
-extern struct processstate process;
 
-#define LOCK_S   mutex_lock(streambuf->mutex)
-#define UNLOCK_S mutex_unlock(streambuf->mutex)
-#define LOCK_O   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(outputbuf->mutex)
+#define LOCK_S   buf_lock(streambuf)
+#define UNLOCK_S buf_unlock(streambuf)
+#define LOCK_O   buf_lock(outputbuf)
+#define UNLOCK_O buf_unlock(outputbuf)
 #if PROCESS
-#define LOCK_O_direct   if (decode.direct) mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct if (decode.direct) mutex_unlock(outputbuf->mutex)
-#define IF_DIRECT(x)    if (decode.direct) { x }
-#define IF_PROCESS(x)   if (!decode.direct) { x }
+#define LOCK_O_direct   if (decode.direct) buf_lock(outputbuf)
+#define UNLOCK_O_direct if (decode.direct) buf_unlock(outputbuf)
 #else
-#define LOCK_O_direct   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct mutex_unlock(outputbuf->mutex)
-#define IF_DIRECT(x)    { x }
-#define IF_PROCESS(x)
+#define LOCK_O_direct   buf_lock(outputbuf)
+#define UNLOCK_O_direct buf_unlock(outputbuf)
 #endif
 
 #if LINKALL
@@ -113,6 +108,19 @@ u32_t mp4_desc_length(u8_t **buf) {
 	return length;
 }
 
+// header allocations fall back to the heap rather than refusing a valid file
+static void *_faad_alloc(size_t len, const char *what) {
+	void *ptr = arena_alloc(&arena, len);
+	if (!ptr) {
+		LOG_INFO("%s of %u bytes exceeds arena, using heap", what, (unsigned)len);
+		ptr = arena_spill(&arena, len);
+	}
+	if (!ptr) {
+		LOG_ERROR("unable to allocate %s", what);
+	}
+	return ptr;
+}
+
 // read mp4 header to extract config data
 static int read_mp4_header(unsigned long *samplerate_p, unsigned char *channels_p) {
 	size_t bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
@@ -176,9 +184,8 @@ static int read_mp4_header(unsigned long *samplerate_p, unsigned char *channels_
 
 		// stash sample to chunk info, assume it comes before stco
 		if (!strcmp(type, "stsc") && bytes > len && !a->chunkinfo) {
-			a->stsc = malloc(len - 12);
+			a->stsc = _faad_alloc(len - 12, "stsc");
 			if (a->stsc == NULL) {
-				LOG_WARN("malloc fail");
 				return -1;
 			}
 			memcpy(a->stsc, streambuf->readp + 12, len - 12);
@@ -191,9 +198,8 @@ static int read_mp4_header(unsigned long *samplerate_p, unsigned char *channels_
 			u8_t *ptr = streambuf->readp + 12;
 			u32_t entries = unpackN((u32_t *)ptr);
 			ptr += 4;
-			a->chunkinfo = malloc(sizeof(struct chunk_table) * (entries + 1));
+			a->chunkinfo = _faad_alloc(sizeof(struct chunk_table) * (entries + 1), "stco");
 			if (a->chunkinfo == NULL) {
-				LOG_WARN("malloc fail");
 				return -1;
 			}
 			for (i = 0; i < entries; ++i) {
@@ -228,7 +234,6 @@ static int read_mp4_header(unsigned long *samplerate_p, unsigned char *channels_
 					last_samples = samples;
 					ptr += 12;
 				}
-				free(a->stsc);
 				a->stsc = NULL;
 			}
 		}
@@ -335,7 +340,7 @@ static decode_state faad_decode(void) {
 	bytes_total = _buf_used(streambuf);
 	bytes_wrap  = min(bytes_total, _buf_cont_read(streambuf));
 
-	if (stream.state <= DISCONNECT && !bytes_total) {
+	if (STREAM_ENDED && !bytes_total) {
 		UNLOCK_S;
 		return DECODE_COMPLETE;
 	}
@@ -412,11 +417,10 @@ static decode_state faad_decode(void) {
 	if (bytes_wrap < WRAPBUF_LEN && bytes_total > WRAPBUF_LEN) {
 
 		// make a local copy of frames which may have wrapped round the end of streambuf
-		static u8_t buf[WRAPBUF_LEN];
-		memcpy(buf, streambuf->readp, bytes_wrap);
-		memcpy(buf + bytes_wrap, streambuf->buf, WRAPBUF_LEN - bytes_wrap);
+		memcpy(a->wrapbuf, streambuf->readp, bytes_wrap);
+		memcpy(a->wrapbuf + bytes_wrap, streambuf->buf, WRAPBUF_LEN - bytes_wrap);
 
-		iptr = NEAAC(a, Decode, a->hAac, &info, buf, WRAPBUF_LEN);
+		iptr = NEAAC(a, Decode, a->hAac, &info, a->wrapbuf, WRAPBUF_LEN);
 
 	} else {
 
@@ -502,49 +506,29 @@ static decode_state faad_decode(void) {
 
 	while (frames > 0) {
 		frames_t f;
-		frames_t count;
-		ISAMPLE_T *optr;
-
-		IF_DIRECT(
-			f = _buf_cont_write(outputbuf) / BYTES_PER_FRAME;
-			optr = (ISAMPLE_T *)outputbuf->writep;
-		);
-		IF_PROCESS(
-			f = process.max_in_frames;
-			optr = (ISAMPLE_T *)process.inbuf;
-		);
-
-		f = min(f, frames);
-		count = f;
-		
-		if (info.channels == 2) {
-#if BYTES_PER_FRAME == 4			
-			memcpy(optr, iptr, count * BYTES_PER_FRAME);
-			iptr += count * 2;
-#else 			
-			while (count--) {
-				*optr++ = ALIGN(*iptr++);
-				*optr++ = ALIGN(*iptr++);
-			}
-#endif			
-		} else if (info.channels == 1) {
-			while (count--) {
-				*optr++ = ALIGN(*iptr);
-				*optr++ = ALIGN(*iptr++);
-			}
+		u8_t *wptr;
+
+		f = min(decode_reserve(&wptr), frames);
+		if (f == 0) {
+			LOG_ERROR("no space for %u frames", frames);
+			break;
+		}
+
+		if (info.channels == 1 || info.channels == 2) {
+			// decoder output is configured as 16 bit or 24 bit to match ISAMPLE_T
+#if BYTES_PER_FRAME == 4
+			conv_interleaved16((ISAMPLE_T *)wptr, (const s16_t *)iptr, f, info.channels);
+#else
+			conv_interleaved32((ISAMPLE_T *)wptr, (const s32_t *)iptr, f, info.channels, 24);
+#endif
+			iptr += f * info.channels;
 		} else {
 			LOG_WARN("unsupported number of channels");
 		}
 
 		frames -= f;
 
-		IF_DIRECT(
-			_buf_inc_writep(outputbuf, f * BYTES_PER_FRAME);
-		);
-		IF_PROCESS(
-			process.in_frames = f;
-			if (frames) LOG_ERROR("unhandled case");
-		);
+		decode_commit(f);
 	}
 
 	UNLOCK_O_direct;
@@ -560,14 +544,10 @@ static void faad_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 	a->type = size;
 	a->pos = a->consume = a->sample = a->nextchunk = 0;
 
-	if (a->chunkinfo) {
-		free(a->chunkinfo);
-	}
-	if (a->stsc) {
-		free(a->stsc);
-	}
+	arena_reset(&arena);
 	a->chunkinfo = NULL;
 	a->stsc = NULL;
+	a->wrapbuf = arena_alloc(&arena, WRAPBUF_LEN);
 	a->skip = 0;
 	a->samples = 0;
 	a->sttssamples = 0;
@@ -596,14 +576,10 @@ static void faad_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 static void faad_close(void) {
 	NEAAC(a, Close, a->hAac);
 	a->hAac = NULL;
-	if (a->chunkinfo) {
-		free(a->chunkinfo);
-		a->chunkinfo = NULL;
-	}
-	if (a->stsc) {
-		free(a->stsc);
-		a->stsc = NULL;
-	}
+	a->chunkinfo = NULL;
+	a->stsc = NULL;
+	a->wrapbuf = NULL;
+	arena_reset(&arena);
 }
 
 static bool load_faad() {
@@ -655,6 +631,14 @@ struct codec *register_faad(void) {
 	a->hAac = NULL;
 	a->chunkinfo = NULL;
 	a->stsc = NULL;
+	a->wrapbuf = NULL;
+
+	// sized for the wrap buffer and sample tables, always large enough for the former
+	arena_init(&arena, ARENA_SIZE);
+	if (!arena.base) {
+		LOG_ERROR("unable to allocate %u byte arena", ARENA_SIZE);
+		return NULL;
+	}
 
 	if (!load_faad()) {
 		return NULL;
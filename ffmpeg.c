@@ -98,22 +98,17 @@ extern struct buffer *outputbuf;
 extern struct streamstate stream;
 extern struct outputstate output;
 extern struct decodestate decode;
-extern struct processstate process;
 
-#define LOCK_S   mutex_lock(streambuf->mutex)
-#define UNLOCK_S mutex_unlock(streambuf->mutex)
-#define LOCK_O   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(outputbuf->mutex)
+#define LOCK_S   buf_lock(streambuf)
+#define UNLOCK_S buf_unlock(streambuf)
+#define LOCK_O   buf_lock(outputbuf)
+#define UNLOCK_O buf_unlock(outputbuf)
 #if PROCESS
-#define LOCK_O_direct   if (decode.direct) mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct if (decode.direct) mutex_unlock(outputbuf->mutex)
-#define IF_DIRECT(x)    if (decode.direct) { x }
-#define IF_PROCESS(x)   if (!decode.direct) { x }
+#define LOCK_O_direct   if (decode.direct) buf_lock(outputbuf)
+#define UNLOCK_O_direct if (decode.direct) buf_unlock(outputbuf)
 #else
-#define LOCK_O_direct   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct mutex_unlock(outputbuf->mutex)
-#define IF_DIRECT(x)    { x }
-#define IF_PROCESS(x)
+#define LOCK_O_direct   buf_lock(outputbuf)
+#define UNLOCK_O_direct buf_unlock(outputbuf)
 #endif
 
 #if LINKALL
@@ -173,7 +168,7 @@ static int _read_data(void *opaque, u8_t *buffer, int buf_size) {
 	LOCK_S;
 
 	bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
-	ff->end_of_stream = (stream.state <= DISCONNECT && bytes == 0);
+	ff->end_of_stream = (STREAM_ENDED && bytes == 0);
 	bytes = min(bytes, buf_size);
 
 	// for chunked wma extract asf header and data frames from framing structure
@@ -382,11 +377,6 @@ static decode_state ff_decode(void) {
 		return DECODE_RUNNING;
 	}
 
-	IF_PROCESS(
-		optr = (s32_t *)process.inbuf;
-		process.in_frames = 0;
-	);
-
 	if ((r = AVCODEC(ff, send_packet, ff->codecC, ff->avpkt)) < 0) {
 		AV(ff, packet_unref, ff->avpkt);
 
@@ -423,89 +413,37 @@ static decode_state ff_decode(void) {
 			LOCK_O_direct;
 
 			while (frames > 0) {
-				frames_t count;
 				frames_t f;
-				
-				IF_DIRECT(
-					optr = (s32_t *)outputbuf->writep;
-					f = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
-					f = min(f, frames);
-				);
-
-				IF_PROCESS(
-					if (process.in_frames + frames > process.max_in_frames) {
-						LOG_WARN("exceeded process buffer size - dropping frames");
-						break;
-					}
-					f = frames;	   
-				);
+				u8_t *wptr;
 
-				count = f;
-				
-				if (ff->codecC->channels == 2) {
-					if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S16) {
-						while (count--) {
-							*optr++ = *iptr16++ << 16;
-							*optr++ = *iptr16++ << 16;
-						}
-					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S32) {
-						while (count--) {
-							*optr++ = *iptr32++;
-							*optr++ = *iptr32++;
-						}
-					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S16P) {
-						while (count--) {
-							*optr++ = *iptr16l++ << 16;
-							*optr++ = *iptr16r++ << 16;
-						}
-					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S32P) {
-						while (count--) {
-							*optr++ = *iptr32l++;
-							*optr++ = *iptr32r++;
-						}
-					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_FLTP) {
-						while (count--) {
-							double scaledl = *iptrfl++ * 0x7fffffff;
-							double scaledr = *iptrfr++ * 0x7fffffff;
-							if (scaledl > 2147483647.0) scaledl = 2147483647.0;
-							if (scaledl < -2147483648.0) scaledl = -2147483648.0;
-							if (scaledr > 2147483647.0) scaledr = 2147483647.0;
-							if (scaledr < -2147483648.0) scaledr = -2147483648.0;
-							*optr++ = (s32_t)scaledl;
-							*optr++ = (s32_t)scaledr;
-						}
-					} else {
-						LOG_WARN("unsupported sample format: %u", ff->codecC->sample_fmt);
-					}
-				} else if (ff->codecC->channels == 1) {
+				f = min(decode_reserve(&wptr), frames);
+				if (f == 0) {
+					LOG_WARN("exceeded output space - dropping frames");
+					break;
+				}
+
+				optr = (s32_t *)wptr;
+
+				if (ff->codecC->channels == 1 || ff->codecC->channels == 2) {
+					unsigned channels = ff->codecC->channels;
 					if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S16) {
-						while (count--) {
-							*optr++ = *iptr16   << 16;
-							*optr++ = *iptr16++ << 16;
-						}
+						conv_interleaved16((ISAMPLE_T *)optr, iptr16, f, channels);
+						iptr16 += f * channels;
 					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S32) {
-						while (count--) {
-							*optr++ = *iptr32;
-							*optr++ = *iptr32++;						
-						}
+						conv_interleaved32((ISAMPLE_T *)optr, iptr32, f, channels, 32);
+						iptr32 += f * channels;
 					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S16P) {
-						while (count--) {
-							*optr++ = *iptr16l << 16;
-							*optr++ = *iptr16l++ << 16;
-						}
+						conv_planar16((ISAMPLE_T *)optr, iptr16l, channels == 2 ? iptr16r : iptr16l, f);
+						iptr16l += f;
+						if (channels == 2) iptr16r += f;
 					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_S32P) {
-						while (count--) {
-							*optr++ = *iptr32l;
-							*optr++ = *iptr32l++;
-						}
+						conv_planar32((ISAMPLE_T *)optr, iptr32l, channels == 2 ? iptr32r : iptr32l, f, 32);
+						iptr32l += f;
+						if (channels == 2) iptr32r += f;
 					} else if (ff->codecC->sample_fmt == AV_SAMPLE_FMT_FLTP) {
-						while (count--) {
-							double scaled = *iptrfl++ * 0x7fffffff;
-							if (scaled > 2147483647.0) scaled = 2147483647.0;
-							if (scaled < -2147483648.0) scaled = -2147483648.0;
-							*optr++ = (s32_t)scaled;
-							*optr++ = (s32_t)scaled;
-						}
+						conv_planar_float((ISAMPLE_T *)optr, iptrfl, channels == 2 ? iptrfr : iptrfl, f);
+						iptrfl += f;
+						if (channels == 2) iptrfr += f;
 					} else {
 						LOG_WARN("unsupported sample format: %u", ff->codecC->sample_fmt);
 					}
@@ -514,14 +452,8 @@ static decode_state ff_decode(void) {
 				}
 				
 				frames -= f;
-				
-				IF_DIRECT(
-					_buf_inc_writep(outputbuf, f * BYTES_PER_FRAME);
-				);
 
-				IF_PROCESS(
-					process.in_frames += f;
-				);
+				decode_commit(f);
 			}
 			
 			UNLOCK_O_direct;
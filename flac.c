@@ -22,21 +22,43 @@
 
 #include <FLAC/stream_decoder.h>
 
-#if BYTES_PER_FRAME == 4		
-#define ALIGN8(n) 	(n << 8)		
-#define ALIGN16(n) 	(n)
-#define ALIGN24(n)	(n >> 8) 
-#define ALIGN32(n)	(n >> 16)
-#else
-#define ALIGN8(n) 	(n << 24)		
-#define ALIGN16(n) 	(n << 16)
-#define ALIGN24(n)	(n << 8) 
-#define ALIGN32(n)	(n)
-#endif
+// frame parallel decoding of hi-res native flac: the decode thread splits streambuf into jobs of whole frames which
+// workers decode concurrently, each with its own decoder, and output is committed to outputbuf in stream order
+#define PARALLEL_BITRATE (96000 * 2 * 24) // streams above this are decoded in parallel if workers are available
+#define JOB_BYTES        (32 * 1024)      // frames gathered into each job
+#define MAX_JOBS         8
+#define HEADER_MAX       16               // longest frame header
+#define FRAME_MAX        (1024 * 1024)    // search distance after which frame numbers are not checked if not known
+
+struct flac_job {
+	struct decode_job job;
+	u8_t *in;                // whole frames copied from streambuf
+	size_t in_len, in_size;
+	size_t pos;              // read position, counting the streaminfo header fed ahead of in
+	u8_t *out;               // frames decoded and converted to outputbuf format
+	frames_t out_frames, out_size, committed;
+	bool first;              // submitted before the start of the stream reached the output, checked for dop
+	bool dop;
+	unsigned sample_rate;
+};
 
 struct flac {
 	FLAC__StreamDecoder *decoder;
 	u8_t container;
+	bool probed;             // parallel or serial decoding decided for this stream
+	bool parallel;
+	// parallel state, offsets are from streambuf readp
+	u8_t header[42];         // "fLaC" and streaminfo flagged as the last metadata block, fed to workers ahead of each job
+	unsigned channels;
+	size_t max_frame;
+	u8_t sync, codes;        // blocking strategy of the first frame and its sample rate and size codes
+	u64_t next_number;       // frame number expected next, or sample number for variable block size
+	size_t frame_at;         // start of the last frame found, complete frames are ahead of it
+	size_t search;           // where the search for the next frame continues
+	struct flac_job jobs[MAX_JOBS];
+	unsigned jobs_head, jobs_count;
+	FLAC__StreamDecoder *workers[MAX_DECODE_WORKERS];
+	struct flac_job *current[MAX_DECODE_WORKERS];
 #if !LINKALL
 	// FLAC symbols to be dynamically loaded
 	const char **FLAC__StreamDecoderErrorStatusString;
@@ -69,6 +91,7 @@ struct flac {
 		void *client_data
 	);
 	FLAC__bool (* FLAC__stream_decoder_process_single)(FLAC__StreamDecoder *decoder);
+	FLAC__bool (* FLAC__stream_decoder_process_until_end_of_stream)(FLAC__StreamDecoder *decoder);
 	FLAC__StreamDecoderState (* FLAC__stream_decoder_get_state)(const FLAC__StreamDecoder *decoder);
 #endif
 };
@@ -82,23 +105,11 @@ extern struct buffer *outputbuf;
 extern struct streamstate stream;
 extern struct outputstate output;
 extern struct decodestate decode;
-extern struct processstate process;
-
-#define LOCK_S   mutex_lock(streambuf->mutex)
-#define UNLOCK_S mutex_unlock(streambuf->mutex)
-#define LOCK_O   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(outputbuf->mutex)
-#if PROCESS
-#define LOCK_O_direct   if (decode.direct) mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct if (decode.direct) mutex_unlock(outputbuf->mutex)
-#define IF_DIRECT(x)    if (decode.direct) { x }
-#define IF_PROCESS(x)   if (!decode.direct) { x }
-#else
-#define LOCK_O_direct   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct mutex_unlock(outputbuf->mutex)
-#define IF_DIRECT(x)    { x }
-#define IF_PROCESS(x)
-#endif
+
+#define LOCK_S   buf_lock(streambuf)
+#define UNLOCK_S buf_unlock(streambuf)
+#define LOCK_O   buf_lock(outputbuf)
+#define UNLOCK_O buf_unlock(outputbuf)
 
 #if LINKALL
 #define FLAC(h, fn, ...) (FLAC__ ## fn)(__VA_ARGS__)
@@ -115,7 +126,7 @@ static FLAC__StreamDecoderReadStatus read_cb(const FLAC__StreamDecoder *decoder,
 	LOCK_S;
 	bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
 	bytes = min(bytes, *want);
-	end = (stream.state <= DISCONNECT && bytes == 0);
+	end = (STREAM_ENDED && bytes == 0);
 
 	memcpy(buffer, streambuf->readp, bytes);
 	_buf_inc_readp(streambuf, bytes);
@@ -130,6 +141,51 @@ static FLAC__StreamDecoderReadStatus read_cb(const FLAC__StreamDecoder *decoder,
 	return end ? FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM : FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
 }
 
+#if DSD
+#if SL_LITTLE_ENDIAN
+#define MARKER_OFFSET 2
+#else
+#define MARKER_OFFSET 1
+#endif
+#endif
+
+// dop is carried as 24 bit samples with marker bytes in the most significant byte
+static bool _flac_dop(const FLAC__Frame *frame, const FLAC__int32 *lptr, const FLAC__int32 *rptr) {
+#if DSD
+	return frame->header.bits_per_sample == 24 &&
+		is_stream_dop(((u8_t *)lptr) + MARKER_OFFSET, ((u8_t *)rptr) + MARKER_OFFSET, 4, frame->header.blocksize);
+#else
+	return false;
+#endif
+}
+
+// start of a new stream reached the output - called with LOCK_O
+static void _flac_newstream(unsigned sample_rate, bool dop) {
+	LOG_INFO("setting track_start");
+	output.track_start = outputbuf->writep;
+	decode.new_stream = false;
+
+#if DSD
+	if (dop) {
+		LOG_INFO("file contains DOP");
+		if (output.dsdfmt == DOP_S24_LE || output.dsdfmt == DOP_S24_3LE)
+			output.next_fmt = output.dsdfmt;
+		else
+			output.next_fmt = DOP;
+		output.next_sample_rate = sample_rate;
+		_output_autosize(output.next_sample_rate);
+		output.fade = FADE_INACTIVE;
+	} else {
+		output.next_sample_rate = decode_newstream(sample_rate, output.supported_rates);
+		output.next_fmt = PCM;
+		if (output.fade_mode) _checkfade(true);
+	}
+#else
+	output.next_sample_rate = decode_newstream(sample_rate, output.supported_rates);
+	if (output.fade_mode) _checkfade(true);
+#endif
+}
+
 static FLAC__StreamDecoderWriteStatus write_cb(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
 											   const FLAC__int32 *const buffer[], void *client_data) {
 
@@ -142,94 +198,31 @@ static FLAC__StreamDecoderWriteStatus write_cb(const FLAC__StreamDecoder *decode
 	
 	if (decode.new_stream) {
 		LOCK_O;
-		LOG_INFO("setting track_start");
-		output.track_start = outputbuf->writep;
-		decode.new_stream = false;
-
-#if DSD
-#if SL_LITTLE_ENDIAN
-#define MARKER_OFFSET 2
-#else
-#define MARKER_OFFSET 1
-#endif		
-		if (bits_per_sample == 24 && is_stream_dop(((u8_t *)lptr) + MARKER_OFFSET, ((u8_t *)rptr) + MARKER_OFFSET, 4, frames)) {
-			LOG_INFO("file contains DOP");
-			if (output.dsdfmt == DOP_S24_LE || output.dsdfmt == DOP_S24_3LE)
-				output.next_fmt = output.dsdfmt;
-			else
-				output.next_fmt = DOP;
-			output.next_sample_rate = frame->header.sample_rate;
-			output.fade = FADE_INACTIVE;
-		} else {
-			output.next_sample_rate = decode_newstream(frame->header.sample_rate, output.supported_rates);
-			output.next_fmt = PCM;
-			if (output.fade_mode) _checkfade(true);
-		}
-#else
-		output.next_sample_rate = decode_newstream(frame->header.sample_rate, output.supported_rates);
-		if (output.fade_mode) _checkfade(true);
-#endif
-
+		_flac_newstream(frame->header.sample_rate, _flac_dop(frame, lptr, rptr));
 		UNLOCK_O;
 	}
 
-	LOCK_O_direct;
+	// no LOCK_O while converting - decode thread is the single producer for outputbuf and flush is serialised by LOCK_D
 
 	while (frames > 0) {
 		frames_t f;
-		frames_t count;
-		ISAMPLE_T *optr;
-
-		IF_DIRECT( 
-			optr = (ISAMPLE_T *)outputbuf->writep; 
-			f = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME; 
-		);
-		IF_PROCESS(
-			optr = (ISAMPLE_T *)process.inbuf;
-			f = process.max_in_frames;
-		);
-
-		f = min(f, frames);
-
-		count = f;
-
-		if (bits_per_sample == 8) {
-			while (count--) {
-				*optr++ = ALIGN8(*lptr++);
-				*optr++ = ALIGN8(*rptr++);
-			}
-		} else if (bits_per_sample == 16) {
-			while (count--) {
-				*optr++ = ALIGN16(*lptr++);
-				*optr++ = ALIGN16(*rptr++);
-			}
-		} else if (bits_per_sample == 24) {
-			while (count--) {
-				*optr++ = ALIGN24(*lptr++);
-				*optr++ = ALIGN24(*rptr++);
-			}
-		} else if (bits_per_sample == 32) {
-			while (count--) {
-				*optr++ = ALIGN32(*lptr++);
-				*optr++ = ALIGN32(*rptr++);
-			}
-		} else {
-			LOG_ERROR("unsupported bits per sample: %u", bits_per_sample);
+		u8_t *wptr;
+
+		f = min(decode_reserve(&wptr), frames);
+		if (f == 0) {
+			LOG_ERROR("no space for %u frames", frames);
+			break;
 		}
 
+		conv_planar32((ISAMPLE_T *)wptr, lptr, rptr, f, bits_per_sample);
+
+		lptr += f;
+		rptr += f;
 		frames -= f;
 
-		IF_DIRECT(
-			_buf_inc_writep(outputbuf, f * BYTES_PER_FRAME);
-		);
-		IF_PROCESS(
-			process.in_frames = f;
-			if (frames) LOG_ERROR("unhandled case");
-		);
+		decode_commit(f);
 	}
 
-	UNLOCK_O_direct;
-
 	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
 }
 
@@ -237,7 +230,347 @@ static void error_cb(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErro
 	LOG_INFO("flac error: %s", FLAC_A(f, StreamDecoderErrorStatusString)[status]);
 }
 
+// worker decoder callbacks, client data is the worker's slot for its current job
+static FLAC__StreamDecoderReadStatus job_read_cb(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], size_t *want,
+												 void *client_data) {
+	struct flac_job *j = *(struct flac_job **)client_data;
+	size_t bytes = 0;
+
+	if (j->pos < sizeof(f->header)) {
+		bytes = min(*want, sizeof(f->header) - j->pos);
+		memcpy(buffer, f->header + j->pos, bytes);
+	} else if (j->pos < sizeof(f->header) + j->in_len) {
+		bytes = min(*want, sizeof(f->header) + j->in_len - j->pos);
+		memcpy(buffer, j->in + j->pos - sizeof(f->header), bytes);
+	}
+
+	j->pos += bytes;
+	*want = bytes;
+
+	return bytes ? FLAC__STREAM_DECODER_READ_STATUS_CONTINUE : FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+}
+
+static FLAC__StreamDecoderWriteStatus job_write_cb(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
+												   const FLAC__int32 *const buffer[], void *client_data) {
+	struct flac_job *j = *(struct flac_job **)client_data;
+	frames_t frames = frame->header.blocksize;
+	FLAC__int32 *lptr = (FLAC__int32 *)buffer[0];
+	FLAC__int32 *rptr = (FLAC__int32 *)buffer[frame->header.channels > 1 ? 1 : 0];
+
+	// output storage is kept with the job and only grows
+	if (j->out_frames + frames > j->out_size) {
+		frames_t size = j->out_frames + frames;
+		u8_t *out = realloc(j->out, size * BYTES_PER_FRAME);
+		if (!out) {
+			LOG_ERROR("unable to allocate %u frames", size);
+			return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+		}
+		j->out = out;
+		j->out_size = size;
+	}
+
+	if (j->first && !j->out_frames) {
+		j->sample_rate = frame->header.sample_rate;
+		j->dop = _flac_dop(frame, lptr, rptr);
+	}
+
+	conv_planar32((ISAMPLE_T *)(j->out + j->out_frames * BYTES_PER_FRAME), lptr, rptr, frames, frame->header.bits_per_sample);
+	j->out_frames += frames;
+
+	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void job_error_cb(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *client_data) {
+	LOG_INFO("flac worker error: %s", FLAC_A(f, StreamDecoderErrorStatusString)[status]);
+}
+
+// decode one job on a worker, its decoder reads the streaminfo header and then the job's frames
+static void _flac_job_run(struct decode_job *job, unsigned worker) {
+	struct flac_job *j = (struct flac_job *)job;
+
+	j->pos = 0;
+	j->out_frames = 0;
+	f->current[worker] = j;
+
+	if (!f->workers[worker]) {
+		f->workers[worker] = FLAC(f, stream_decoder_new);
+		if (!f->workers[worker]) {
+			LOG_ERROR("unable to create worker decoder");
+			return;
+		}
+		FLAC(f, stream_decoder_init_stream, f->workers[worker], &job_read_cb, NULL, NULL, NULL, NULL, &job_write_cb, NULL,
+			 &job_error_cb, &f->current[worker]);
+	} else {
+		FLAC(f, stream_decoder_reset, f->workers[worker]);
+	}
+
+	FLAC(f, stream_decoder_process_until_end_of_stream, f->workers[worker]);
+}
+
+// streambuf byte at offset from readp - called with LOCK_S
+static inline u8_t _peek(size_t offset) {
+	u8_t *p = streambuf->readp + offset;
+	if (p >= streambuf->wrap) p -= streambuf->size;
+	return *p;
+}
+
+static void _copy(u8_t *dst, size_t offset, size_t len) {
+	while (len--) *dst++ = _peek(offset++);
+}
+
+// length of a valid frame header at offset, 0 if there is not one - called with LOCK_S and HEADER_MAX bytes available
+// once the stream's first frame is known, later ones must match it and, unless check is false, follow on from the last
+static unsigned _flac_header(size_t offset, bool check) {
+	u8_t h[HEADER_MAX];
+	unsigned len, n, i, blocksize;
+	u64_t number;
+	u8_t crc = 0;
+
+	_copy(h, offset, 4);
+
+	if (h[0] != 0xFF || (h[1] & 0xFE) != 0xF8 || (h[2] >> 4) == 0 || (h[2] & 0x0F) == 0x0F ||
+		(h[3] >> 4) > 10 || ((h[3] >> 1) & 0x07) == 3 || (h[3] & 0x01)) {
+		return 0;
+	}
+
+	if (f->sync && (h[1] != f->sync || ((h[2] & 0x0F) << 4 | (h[3] & 0x0E)) != f->codes ||
+					((h[3] >> 4) < 8 ? (h[3] >> 4) + 1 : 2) != f->channels)) {
+		return 0;
+	}
+
+	_copy(h + 4, offset + 4, HEADER_MAX - 4);
+
+	// utf-8 style coded frame or sample number
+	if (!(h[4] & 0x80)) { number = h[4]; n = 0; }
+	else if ((h[4] & 0xE0) == 0xC0) { number = h[4] & 0x1F; n = 1; }
+	else if ((h[4] & 0xF0) == 0xE0) { number = h[4] & 0x0F; n = 2; }
+	else if ((h[4] & 0xF8) == 0xF0) { number = h[4] & 0x07; n = 3; }
+	else if ((h[4] & 0xFC) == 0xF8) { number = h[4] & 0x03; n = 4; }
+	else if ((h[4] & 0xFE) == 0xFC) { number = h[4] & 0x01; n = 5; }
+	else if (h[4] == 0xFE && (h[1] & 0x01)) { number = 0; n = 6; }
+	else return 0;
+
+	for (i = 5; i < 5 + n; ++i) {
+		if ((h[i] & 0xC0) != 0x80) return 0;
+		number = number << 6 | (h[i] & 0x3F);
+	}
+	len = 5 + n;
+
+	switch (h[2] >> 4) {
+	case 1:  blocksize = 192; break;
+	case 6:  blocksize = h[len] + 1; len += 1; break;
+	case 7:  blocksize = (h[len] << 8 | h[len + 1]) + 1; len += 2; break;
+	default: blocksize = (h[2] >> 4) < 8 ? 576 << ((h[2] >> 4) - 2) : 256 << ((h[2] >> 4) - 8); break;
+	}
+
+	switch (h[2] & 0x0F) {
+	case 12: len += 1; break;
+	case 13:
+	case 14: len += 2; break;
+	}
+
+	// crc-8 with polynomial x^8 + x^2 + x^1 + x^0
+	for (i = 0; i < len; ++i) {
+		int b;
+		crc ^= h[i];
+		for (b = 0; b < 8; ++b) crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+	if (crc != h[len]) return 0;
+
+	if (f->sync && check && number != f->next_number) return 0;
+
+	f->next_number = number + ((h[1] & 0x01) ? blocksize : 1);
+
+	return len + 1;
+}
+
+// length of whole frames from readp to cut into the next job, 0 if more of the stream is needed - called with LOCK_S
+static size_t _flac_gather(size_t used, bool end) {
+	while (f->frame_at < JOB_BYTES) {
+		bool found = false;
+
+		for (; f->search + HEADER_MAX <= used; ++f->search) {
+			if (_peek(f->search) == 0xFF && (_peek(f->search + 1) & 0xFE) == 0xF8 &&
+				_flac_header(f->search, f->search - f->frame_at < f->max_frame)) {
+				found = true;
+				break;
+			}
+		}
+
+		if (!found) {
+			return end ? used : 0;
+		}
+
+		f->frame_at = f->search;
+		f->search += 2;
+	}
+
+	return f->frame_at;
+}
+
+// wait for jobs in flight and drop them
+static void _flac_drain(void) {
+	while (f->jobs_count) {
+		struct flac_job *j = &f->jobs[f->jobs_head];
+		while (!decode_wait(&j->job, 100));
+		f->jobs_head = (f->jobs_head + 1) % MAX_JOBS;
+		f->jobs_count--;
+	}
+}
+
+// read the stream header to decide on parallel decoding, the stream is left untouched unless that is chosen
+// returns false while more of the stream is needed to decide - called with LOCK_S
+static bool _flac_probe(void) {
+	size_t used = _buf_used(streambuf);
+	size_t offset = 4;
+	unsigned rate = 0, bps = 0;
+	bool last = false;
+
+	// wait for the header unless it is not going to fit, then decode serially
+	bool give_up = STREAM_ENDED || used >= streambuf->size / 2;
+
+	if (used < 4) return give_up;
+
+	if (_peek(0) != 'f' || _peek(1) != 'L' || _peek(2) != 'a' || _peek(3) != 'C') return true;
+
+	while (!last) {
+		size_t len;
+
+		if (offset + 4 > used) break;
+		last = _peek(offset) & 0x80;
+		len = _peek(offset + 1) << 16 | _peek(offset + 2) << 8 | _peek(offset + 3);
+
+		if ((_peek(offset) & 0x7F) == 0 && len == 34) {
+			u8_t *si = f->header + 8;
+			if (offset + 4 + len > used) break;
+			_copy(si, offset + 4, 34);
+			f->max_frame = si[7] << 16 | si[8] << 8 | si[9];
+			rate = si[10] << 12 | si[11] << 4 | si[12] >> 4;
+			f->channels = ((si[12] >> 1) & 0x07) + 1;
+			bps = ((si[12] & 0x01) << 4 | si[13] >> 4) + 1;
+		}
+
+		offset += 4 + len;
+	}
+
+	if (offset + HEADER_MAX > used || !last) {
+		return give_up;
+	}
+
+	if (!rate || rate * f->channels * bps <= PARALLEL_BITRATE || !_flac_header(offset, false)) {
+		return true;
+	}
+
+	memcpy(f->header, "fLaC", 4);
+	f->header[4] = 0x80; // last metadata block, streaminfo
+	f->header[5] = 0;
+	f->header[6] = 0;
+	f->header[7] = 34;
+
+	f->sync = _peek(offset + 1);
+	f->codes = (_peek(offset + 2) & 0x0F) << 4 | (_peek(offset + 3) & 0x0E);
+	f->max_frame = f->max_frame ? f->max_frame + HEADER_MAX : FRAME_MAX;
+	f->frame_at = 0;
+	f->search = 2;
+	f->parallel = true;
+
+	_buf_inc_readp(streambuf, offset);
+
+	LOG_INFO("parallel decode: %u Hz %u bits %u channels", rate, bps, f->channels);
+
+	return true;
+}
+
+static decode_state _flac_parallel_decode(void) {
+	unsigned max_jobs = min(2 * decode_workers(), MAX_JOBS);
+	bool progress = false;
+	size_t used;
+	bool ended;
+
+	// commit decoded jobs in stream order, as far as there is space for them
+	while (f->jobs_count) {
+		struct flac_job *j = &f->jobs[f->jobs_head];
+
+		if (!decode_wait(&j->job, 0)) break;
+
+		if (j->first && j->out_frames && decode.new_stream) {
+			LOCK_O;
+			_flac_newstream(j->sample_rate, j->dop);
+			UNLOCK_O;
+		}
+
+		while (j->committed < j->out_frames) {
+			u8_t *wptr;
+			frames_t n = min(decode_reserve(&wptr), j->out_frames - j->committed);
+			if (!n) break;
+			memcpy(wptr, j->out + j->committed * BYTES_PER_FRAME, n * BYTES_PER_FRAME);
+			j->committed += n;
+			decode_commit(n);
+			progress = true;
+		}
+
+		if (j->committed < j->out_frames) break;
+
+		f->jobs_head = (f->jobs_head + 1) % MAX_JOBS;
+		f->jobs_count--;
+		progress = true;
+	}
+
+	// cut whole frames from streambuf into jobs for the workers
+	LOCK_S;
+
+	while (f->jobs_count < max_jobs) {
+		struct flac_job *j = &f->jobs[(f->jobs_head + f->jobs_count) % MAX_JOBS];
+		size_t used = _buf_used(streambuf);
+		size_t len = _flac_gather(used, STREAM_ENDED);
+
+		if (!len) break;
+
+		if (len > j->in_size) {
+			u8_t *in = realloc(j->in, len);
+			if (!in) {
+				LOG_ERROR("unable to allocate %u bytes", (unsigned)len);
+				break;
+			}
+			j->in = in;
+			j->in_size = len;
+		}
+
+		_copy(j->in, 0, len);
+		_buf_inc_readp(streambuf, len);
+
+		f->frame_at -= min(f->frame_at, len);
+		f->search = f->search > len ? f->search - len : 2;
+
+		j->in_len = len;
+		j->committed = 0;
+		j->first = decode.new_stream;
+		j->job.run = _flac_job_run;
+		decode_submit(&j->job);
+
+		f->jobs_count++;
+		progress = true;
+	}
+
+	used = _buf_used(streambuf);
+	ended = STREAM_ENDED;
+
+	UNLOCK_S;
+
+	if (ended && !used && !f->jobs_count) {
+		return DECODE_COMPLETE;
+	}
+
+	if (!progress) {
+		// wait for the next job in order, or for more of the stream if there is room for another job
+		decode_yield(f->jobs_count < max_jobs && !ended ? used + 1 : 0);
+	}
+
+	return DECODE_RUNNING;
+}
+
 static void flac_close(void) {
+	_flac_drain();
 	FLAC(f, stream_decoder_delete, f->decoder);
 	f->decoder = NULL;
 }
@@ -261,11 +594,37 @@ static void flac_open(u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t en
 	} else {
 		FLAC(f, stream_decoder_init_stream, f->decoder, &read_cb, NULL, NULL, NULL, NULL, &write_cb, NULL, &error_cb, NULL);
 	}
+
+	// native flac streams may be decoded in parallel, decided by flac_decode once the stream header is available
+	_flac_drain();
+	f->parallel = false;
+	f->sync = 0;
+	f->probed = f->container == 'o' || !decode_workers();
 }
 
 static decode_state flac_decode(void) {
-	bool ok = FLAC(f, stream_decoder_process_single, f->decoder);
-	FLAC__StreamDecoderState state = FLAC(f, stream_decoder_get_state, f->decoder);
+	bool ok;
+	FLAC__StreamDecoderState state;
+
+	if (!f->probed) {
+		size_t used;
+		LOCK_S;
+		f->probed = _flac_probe();
+		used = _buf_used(streambuf);
+		UNLOCK_S;
+		if (!f->probed) {
+			// the header is incomplete, wait for more of it
+			decode_yield(used + 1);
+			return DECODE_RUNNING;
+		}
+	}
+
+	if (f->parallel) {
+		return _flac_parallel_decode();
+	}
+
+	ok = FLAC(f, stream_decoder_process_single, f->decoder);
+	state = FLAC(f, stream_decoder_get_state, f->decoder);
 	
 	if (!ok && state != FLAC__STREAM_DECODER_END_OF_STREAM) {
 		LOG_INFO("flac error: %s", FLAC_A(f, StreamDecoderStateString)[state]);
@@ -303,6 +662,7 @@ static bool load_flac() {
 	f->FLAC__stream_decoder_init_stream = dlsym(handle, "FLAC__stream_decoder_init_stream");
 	f->FLAC__stream_decoder_init_ogg_stream = dlsym(handle, "FLAC__stream_decoder_init_ogg_stream");
 	f->FLAC__stream_decoder_process_single = dlsym(handle, "FLAC__stream_decoder_process_single");
+	f->FLAC__stream_decoder_process_until_end_of_stream = dlsym(handle, "FLAC__stream_decoder_process_until_end_of_stream");
 	f->FLAC__stream_decoder_get_state = dlsym(handle, "FLAC__stream_decoder_get_state");
 
 	if ((err = dlerror()) != NULL) {
@@ -332,7 +692,7 @@ struct codec *register_flac(void) {
 		return NULL;
 	}
 
-	f->decoder = NULL;
+	memset(f, 0, sizeof(struct flac));
 
 	if (!load_flac()) {
 		return NULL;
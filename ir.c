@@ -168,7 +168,12 @@ static u32_t ir_key_map(const char *c, const char *r) {
 
 static void *ir_thread() {
 	char *code;
-	
+
+#if LINUX
+	char placed[128];
+	LOG_INFO("thread %s", thread_place("ir", placed, sizeof(placed)));
+#endif
+
 #if LINUX
 		const char* threadname = "ir\0";
 		if (prctl(PR_SET_NAME, (unsigned long) threadname) != 0) {
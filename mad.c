@@ -63,22 +63,17 @@ extern struct buffer *outputbuf;
 extern struct streamstate stream;
 extern struct outputstate output;
 extern struct decodestate decode;
-extern struct processstate process;
 
-#define LOCK_S   mutex_lock(streambuf->mutex)
-#define UNLOCK_S mutex_unlock(streambuf->mutex)
-#define LOCK_O   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(outputbuf->mutex)
+#define LOCK_S   buf_lock(streambuf)
+#define UNLOCK_S buf_unlock(streambuf)
+#define LOCK_O   buf_lock(outputbuf)
+#define UNLOCK_O buf_unlock(outputbuf)
 #if PROCESS
-#define LOCK_O_direct   if (decode.direct) mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct if (decode.direct) mutex_unlock(outputbuf->mutex)
-#define IF_DIRECT(x)    if (decode.direct) { x }
-#define IF_PROCESS(x)   if (!decode.direct) { x }
+#define LOCK_O_direct   if (decode.direct) buf_lock(outputbuf)
+#define UNLOCK_O_direct if (decode.direct) buf_unlock(outputbuf)
 #else
-#define LOCK_O_direct   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct mutex_unlock(outputbuf->mutex)
-#define IF_DIRECT(x)    { x }
-#define IF_PROCESS(x)
+#define LOCK_O_direct   buf_lock(outputbuf)
+#define UNLOCK_O_direct buf_unlock(outputbuf)
 #endif
 
 #if LINKALL
@@ -87,21 +82,6 @@ extern struct processstate process;
 #define MAD(h, fn, ...) (h)->mad_##fn(__VA_ARGS__)
 #endif
 
-// based on libmad minimad.c scale
-static inline ISAMPLE_T scale(mad_fixed_t sample) {
-	sample += (1L << (MAD_F_FRACBITS - 24));
-	
-	if (sample >= MAD_F_ONE)
-		sample = MAD_F_ONE - 1;
-	else if (sample < -MAD_F_ONE)
-		sample = -MAD_F_ONE;
-#if BYTES_PER_FRAME == 4	
-	return (ISAMPLE_T)((sample >> (MAD_F_FRACBITS + 1 - 24)) >> 8);
-#else	
-	return (ISAMPLE_T)((sample >> (MAD_F_FRACBITS + 1 - 24)) << 8);
-#endif	
-}
-
 // check for id3.2 tag at start of file - http://id3.org/id3v2.4.0-structure, return length
 static unsigned _check_id3_tag(size_t bytes) {
 	u8_t *ptr = streambuf->readp;
@@ -202,7 +182,7 @@ static decode_state mad_decode(void) {
 	m->readbuf_len += bytes;
 	_buf_inc_readp(streambuf, bytes);
 
-	if (stream.state <= DISCONNECT && _buf_used(streambuf) == 0) {
+	if (STREAM_ENDED && _buf_used(streambuf) == 0) {
 		eos = true;
 		LOG_DEBUG("end of stream");
 		memset(m->readbuf + m->readbuf_len, 0, MAD_BUFFER_GUARD);
@@ -255,12 +235,7 @@ static decode_state mad_decode(void) {
 
 		LOCK_O_direct;
 
-		IF_DIRECT(
-			max_frames = _buf_space(outputbuf) / BYTES_PER_FRAME;
-		);
-		IF_PROCESS(
-			max_frames = process.max_in_frames - process.in_frames;
-		);
+		max_frames = decode_space();
 		
 		if (m->synth.pcm.length > max_frames) {
 			LOG_WARN("too many samples - dropping samples");
@@ -302,33 +277,19 @@ static decode_state mad_decode(void) {
 		LOG_SDEBUG("write %u frames", frames);
 
 		while (frames > 0) {
-			size_t f, count;
-			ISAMPLE_T *optr;
-
-			IF_DIRECT(
-				f = min(frames, _buf_cont_write(outputbuf) / BYTES_PER_FRAME);
-				optr = (ISAMPLE_T *)outputbuf->writep;
-			);
-			IF_PROCESS(
-				f = min(frames, process.max_in_frames - process.in_frames);
-				optr = (ISAMPLE_T *)((u8_t *)process.inbuf + process.in_frames * BYTES_PER_FRAME);
-			);
-
-			count = f;
-
-			while (count--) {
-				*optr++ = scale(*iptrl++);
-				*optr++ = scale(*iptrr++);
-			}
+			size_t f;
+			u8_t *wptr;
+
+			f = min(frames, decode_reserve(&wptr));
+
+			// rounded and clipped as libmad minimad.c scale
+			conv_planar_fixed((ISAMPLE_T *)wptr, (const s32_t *)iptrl, (const s32_t *)iptrr, f, MAD_F_FRACBITS);
+			iptrl += f;
+			iptrr += f;
 
 			frames -= f;
 
-			IF_DIRECT(
-				_buf_inc_writep(outputbuf, f * BYTES_PER_FRAME);
-			);
-			IF_PROCESS(
-				process.in_frames += f;
-			);
+			decode_commit(f);
 		}
 
 		UNLOCK_O_direct;
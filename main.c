@@ -87,7 +87,8 @@ static void usage(const char *argv0) {
 #endif
 #endif
 		   "  -a <f>\t\tSpecify sample format (16|24|32) of output file when using -o - to output samples to stdout (interleaved little endian only)\n"
-		   "  -b <stream>:<output>\tSpecify internal Stream and Output buffer sizes in Kbytes\n"
+		   "  -b <stream>:<output>\tSpecify internal Stream and Output buffer sizes in Kbytes, or in ms of audio with a ms suffix\n"
+		   "  -B huge,lock\t\tBack buffers with huge pages (Linux) and/or lock them into memory, falls back to normal pages if unavailable\n"
 		   "  -c <codec1>,<codec2>\tRestrict codecs to those specified, otherwise load all available codecs; known codecs: " CODECS "\n"
 		   "  \t\t\tCodecs reported to LMS in order listed, allowing codec priority refinement.\n"
 		   "  -C <timeout>\t\tClose output device when idle after timeout seconds, default is to keep it open while player is 'on'\n"
@@ -114,6 +115,10 @@ static void usage(const char *argv0) {
 #endif
 #if LINUX || FREEBSD || SUN
 		   "  -P <filename>\t\tStore the process id (PID) in filename\n"
+#endif
+#if LINUX
+		   "  -T <thread>:<policy>[:<priority>[:<cpus>]],...\n"
+		   "  \t\t\tSet scheduling of stream, decode, worker, slimproto, output or ir thread; policy fifo|rr|other, priority is nice level for other, cpus as 0-1+3\n"
 #endif
 		   "  -r <rates>[:<delay>]\tSample rates supported, allows output to be off when squeezelite is started; rates = <maxrate>|<minrate>-<maxrate>|<rate1>,<rate2>,<rate3>; delay = optional delay switching rates in ms\n"
 #if GPIO
@@ -220,6 +225,12 @@ static void usage(const char *argv0) {
 #if IR
 		   " IR"
 #endif
+#if IOURING
+		   " IOURING"
+#endif
+#if GZIP
+		   " GZIP"
+#endif
 #if GPIO
 		   " GPIO"
 #endif
@@ -305,6 +316,12 @@ static void sighandler(int signum) {
 	signal(signum, SIG_DFL);
 }
 
+#if defined(SIGUSR1)
+static void statshandler(int signum) {
+	slimproto_stats();
+}
+#endif
+
 int main(int argc, char **argv) {
 	char *server = NULL;
 	char *output_device = "default";
@@ -315,6 +332,7 @@ int main(int argc, char **argv) {
 	char *modelname = NULL;
 	extern bool pcm_check_header;
 	extern bool user_rates;
+	extern unsigned output_buf_ms;
 	char *logfile = NULL;
 	u8_t mac[6];
 	unsigned stream_buf_size = STREAMBUF_SIZE;
@@ -375,9 +393,12 @@ int main(int argc, char **argv) {
 
 	while (optind < argc && strlen(argv[optind]) >= 2 && argv[optind][0] == '-') {
 		char *opt = argv[optind] + 1;
-		if (strstr("oabcCdefmMnNpPrsZ"
+		if (strstr("oabBcCdefmMnNpPrsZ"
 #if ALSA
 				   "UVO"
+#endif
+#if LINUX
+				   "T"
 #endif
 				   , opt) && optind < argc - 1) {
 			optarg = argv[optind + 1];
@@ -428,8 +449,27 @@ int main(int argc, char **argv) {
 			{
 				char *s = next_param(optarg, ':');
 				char *o = next_param(NULL, ':');
-				if (s) stream_buf_size = atoi(s) * 1024;
-				if (o) output_buf_size = atoi(o) * 1024;
+				extern unsigned stream_buf_ms;
+				// sizes ending in ms are milliseconds of audio, otherwise Kbytes
+				if (s && strstr(s, "ms")) stream_buf_ms = atoi(s);
+				else if (s) stream_buf_size = atoi(s) * 1024;
+				if (o && strstr(o, "ms")) output_buf_ms = atoi(o);
+				else if (o) output_buf_size = atoi(o) * 1024;
+			}
+			break;
+		case 'B':
+			{
+				char *m = strtok(optarg, ",");
+				while (m) {
+					if (!strcmp(m, "huge")) mem_mode |= MEM_HUGE;
+					else if (!strcmp(m, "lock")) mem_mode |= MEM_LOCK;
+					else {
+						fprintf(stderr, "\nError: invalid buffer backing: %s\n\n", m);
+						usage(argv[0]);
+						exit(1);
+					}
+					m = strtok(NULL, ",");
+				}
 			}
 			break;
 		case 'c':
@@ -550,6 +590,15 @@ int main(int argc, char **argv) {
 		case 'W':
 			pcm_check_header = true;
 			break;
+#if LINUX
+		case 'T':
+			if (!thread_placement(optarg)) {
+				fprintf(stderr, "\nError: invalid thread placement: %s\n\n", optarg);
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+#endif
 #if ALSA
 		case 'p':
 			rt_priority = atoi(optarg);
@@ -738,12 +787,20 @@ int main(int argc, char **argv) {
 #if defined(SIGHUP)
 	signal(SIGHUP, sighandler);
 #endif
+#if defined(SIGUSR1)
+	signal(SIGUSR1, statshandler);
+#endif
 
 #if USE_SSL && !LINKALL && !NO_SSLSYM
 	ssl_loaded = load_ssl_symbols();
 #endif
 
 	// set the output buffer size if not specified on the command line, take account of resampling
+	// when specified in ms start with the size for 44.1kHz, resized once the stream rate is known
+	if (!output_buf_size && output_buf_ms) {
+		output_buf_size = (u64_t)output_buf_ms * 44100 * BYTES_PER_FRAME / 1000;
+		if (output_buf_size < OUTPUTBUF_MIN) output_buf_size = OUTPUTBUF_MIN;
+	}
 	if (!output_buf_size) {
 		output_buf_size = OUTPUTBUF_SIZE;
 		if (resample) {
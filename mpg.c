@@ -54,26 +54,21 @@ extern struct buffer *outputbuf;
 extern struct streamstate stream;
 extern struct outputstate output;
 extern struct decodestate decode;
-extern struct processstate process;
 
-#define LOCK_S   mutex_lock(streambuf->mutex)
-#define UNLOCK_S mutex_unlock(streambuf->mutex)
-#define LOCK_O   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(outputbuf->mutex)
+#define LOCK_S   buf_lock(streambuf)
+#define UNLOCK_S buf_unlock(streambuf)
+#define LOCK_O   buf_lock(outputbuf)
+#define UNLOCK_O buf_unlock(outputbuf)
 #if PROCESS
-#define LOCK_O_direct   if (decode.direct) mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct if (decode.direct) mutex_unlock(outputbuf->mutex)
-#define LOCK_O_not_direct   if (!decode.direct) mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_not_direct if (!decode.direct) mutex_unlock(outputbuf->mutex)
-#define IF_DIRECT(x)    if (decode.direct) { x }
-#define IF_PROCESS(x)   if (!decode.direct) { x }
+#define LOCK_O_direct   if (decode.direct) buf_lock(outputbuf)
+#define UNLOCK_O_direct if (decode.direct) buf_unlock(outputbuf)
+#define LOCK_O_not_direct   if (!decode.direct) buf_lock(outputbuf)
+#define UNLOCK_O_not_direct if (!decode.direct) buf_unlock(outputbuf)
 #else
-#define LOCK_O_direct   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct mutex_unlock(outputbuf->mutex)
+#define LOCK_O_direct   buf_lock(outputbuf)
+#define UNLOCK_O_direct buf_unlock(outputbuf)
 #define LOCK_O_not_direct
 #define UNLOCK_O_not_direct
-#define IF_DIRECT(x)    { x }
-#define IF_PROCESS(x)
 #endif
 
 #if LINKALL
@@ -91,14 +86,7 @@ static decode_state mpg_decode(void) {
 	LOCK_O_direct;
 	bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
 
-	IF_DIRECT(
-		space = min(_buf_space(outputbuf), _buf_cont_write(outputbuf));
-		write_buf = outputbuf->writep;
-	);
-	IF_PROCESS(
-		space = process.max_in_frames;
-		write_buf = process.inbuf;
-	);
+	space = decode_reserve(&write_buf) * BYTES_PER_FRAME;
 
 	bytes = min(bytes, READ_SIZE);
 	space = min(space, WRITE_SIZE);
@@ -138,31 +126,20 @@ static decode_state mpg_decode(void) {
 
 	// expand 16bit output to 32bit samples
 	if (m->use16bit) {
-		s16_t *iptr;
-		s32_t *optr;
-		size_t count = size / 2;
-		size = count * 4;
-		iptr = (s16_t *)write_buf + count;
-		optr = (s32_t *)write_buf + count;
-		while (count--) {
-			*--optr = *--iptr << 16;
-		}
+		frames_t frames = size / 4;
+		conv_interleaved16((ISAMPLE_T *)write_buf, (s16_t *)write_buf, frames, 2);
+		size = frames * BYTES_PER_FRAME;
 	}
 
 	_buf_inc_readp(streambuf, bytes);
 
-	IF_DIRECT(
-		_buf_inc_writep(outputbuf, size);
-	);
-	IF_PROCESS(
-		process.in_frames = size / BYTES_PER_FRAME;
-	);
+	decode_commit(size / BYTES_PER_FRAME);
 
 	UNLOCK_O_direct;
 
 	LOG_SDEBUG("write %u frames", size / BYTES_PER_FRAME);
 
-	if (ret == MPG123_DONE || (bytes == 0 && size == 0 && stream.state <= DISCONNECT)) {
+	if (ret == MPG123_DONE || (bytes == 0 && size == 0 && STREAM_ENDED)) {
 		UNLOCK_S;
 		LOG_INFO("stream complete");
 		return DECODE_COMPLETE;
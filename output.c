@@ -38,8 +38,10 @@ u8_t *silencebuf_dsd;
 
 bool user_rates = false;
 
-#define LOCK   mutex_lock(outputbuf->mutex)
-#define UNLOCK mutex_unlock(outputbuf->mutex)
+unsigned output_buf_ms = 0;   // outputbuf sized in ms of audio per rate if set, else fixed size
+
+#define LOCK   buf_lock(outputbuf)
+#define UNLOCK buf_unlock(outputbuf)
 
 // functions starting _* are called with mutex locked
 
@@ -47,6 +49,7 @@ frames_t _output_frames(frames_t avail) {
 
 	frames_t frames, size;
 	bool silence;
+	static bool starved = false;
 	u8_t flags = output.channels;
 	
 	s32_t cross_gain_in = 0, cross_gain_out = 0; s32_t *cross_ptr = NULL;
@@ -108,6 +111,14 @@ frames_t _output_frames(frames_t avail) {
 		}
 	}
 	
+	// count each underrun while running as the reader being starved of data
+	if (output.state == OUTPUT_RUNNING && frames == 0) {
+		if (!starved) outputbuf->stats.starved++;
+		starved = true;
+	} else {
+		starved = false;
+	}
+
 	// play silence if buffering or no frames
 	if (output.state <= OUTPUT_BUFFER || frames == 0) {
 		silence = true;
@@ -324,6 +335,11 @@ void _checkfade(bool start) {
 	}
 
 	if (start && output.fade_mode == FADE_CROSSFADE) {
+		if (!output_buf_ms && outputbuf->size == OUTPUTBUF_SIZE) {
+			// if default setting used attempt to resize to provide full crossfade support, buffered audio is retained
+			LOG_INFO("resize outputbuf for crossfade");
+			_output_resize(OUTPUTBUF_SIZE_CROSSFADE);
+		}
 		if (_buf_used(outputbuf) != 0) {
 			if (output.next_sample_rate != output.current_sample_rate) {
 				LOG_INFO("crossfade disabled as sample rates differ");
@@ -340,40 +356,108 @@ void _checkfade(bool start) {
 			}
 			output.fade_end = outputbuf->writep;
 			output.track_start = output.fade_start;
-		} else if (outputbuf->size == OUTPUTBUF_SIZE && outputbuf->readp == outputbuf->buf) {
-			// if default setting used and nothing in buffer attempt to resize to provide full crossfade support
-			LOG_INFO("resize outputbuf for crossfade");
-			_buf_resize(outputbuf, OUTPUTBUF_SIZE_CROSSFADE);
-#if LINUX || FREEBSD
-			touch_memory(outputbuf->buf, outputbuf->size);
-#endif			
 		}
 	}
 }
 
+// rebase a pointer into outputbuf across a resize, pointers between readp and writep keep their offset from readp
+// others (e.g. fade_start of an active fade) are behind readp and keep their distance behind it
+static u8_t *_rebase(u8_t *ptr, u8_t *old_readp, size_t old_size, unsigned used) {
+	size_t offset = ptr >= old_readp ? ptr - old_readp : ptr + old_size - old_readp;
+	if (offset <= used) {
+		return outputbuf->readp + offset;
+	}
+	return outputbuf->wrap - (old_size - offset);
+}
+
+// resize outputbuf retaining buffered audio and rebasing track and fade pointers - called with mutex locked
+// the mutex is released while the new storage is obtained so the output thread only waits for the copy
+bool _output_resize(size_t size) {
+	struct buf_storage st;
+	u8_t *old_readp;
+	size_t old_size;
+	unsigned used;
+	bool ok;
+
+	size -= size % BYTES_PER_FRAME;
+
+	UNLOCK;
+	ok = buf_storage_alloc(outputbuf, size, &st);
+	LOCK;
+
+	// the output thread may have consumed or flushed meanwhile, so buffered audio is measured once relocked
+	old_readp = outputbuf->readp;
+	old_size = outputbuf->size;
+	used = _buf_used(outputbuf);
+
+	if (!ok || !_buf_replace(outputbuf, &st)) {
+		if (ok) buf_storage_free(&st);
+		LOG_WARN("unable to resize outputbuf to %u with %u bytes buffered", (unsigned)size, used);
+		return false;
+	}
+
+	if (output.track_start) {
+		output.track_start = _rebase(output.track_start, old_readp, old_size, used);
+	}
+	if (output.fade != FADE_INACTIVE) {
+		output.fade_start = _rebase(output.fade_start, old_readp, old_size, used);
+		output.fade_end = _rebase(output.fade_end, old_readp, old_size, used);
+	}
+
+	LOG_INFO("outputbuf resized from %u to %u with %u bytes retained", (unsigned)old_size, (unsigned)outputbuf->size, used);
+	return true;
+}
+
+// size outputbuf to hold output_buf_ms of audio at the higher of the playing and next rate - called with mutex locked
+// grows when needed, shrinks only if well oversized and the buffered audio fits
+void _output_autosize(unsigned rate) {
+	size_t size;
+
+	if (!output_buf_ms) return;
+
+	if (output.current_sample_rate > rate) {
+		rate = output.current_sample_rate;
+	}
+
+	size = (u64_t)rate * BYTES_PER_FRAME * output_buf_ms / 1000;
+	if (output.fade_mode == FADE_CROSSFADE) {
+		size = size * 12 / 10;
+	}
+	if (size < OUTPUTBUF_MIN) {
+		size = OUTPUTBUF_MIN;
+	}
+
+	if (size > outputbuf->size || (size < outputbuf->size * 3 / 4 && _buf_used(outputbuf) < size)) {
+		LOG_INFO("outputbuf %ums at %u", output_buf_ms, rate);
+		_output_resize(size);
+	}
+}
+
 void output_init_common(log_level level, const char *device, unsigned output_buf_size, unsigned rates[], unsigned idle) {
-	unsigned i;
+	unsigned i, got;
 
 	loglevel = level;
 
 	output_buf_size = output_buf_size - (output_buf_size % BYTES_PER_FRAME);
 	LOG_DEBUG("outputbuf size: %u", output_buf_size);
 
-	buf_init(outputbuf, output_buf_size);
+	buf_init(outputbuf, output_buf_size, 0);
 	if (!outputbuf->buf) {
 		LOG_ERROR("unable to malloc output buffer");
 		exit(0);
 	}
+	LOG_INFO("outputbuf backing: %s", mem_backing(outputbuf->mem));
 
-	silencebuf = malloc(MAX_SILENCE_FRAMES * BYTES_PER_FRAME);
+	silencebuf = mem_alloc(MAX_SILENCE_FRAMES * BYTES_PER_FRAME, &got);
 	if (!silencebuf) {
 		LOG_ERROR("unable to malloc silence buffer");
 		exit(0);
 	}
 	memset(silencebuf, 0, MAX_SILENCE_FRAMES * BYTES_PER_FRAME);
+	LOG_DEBUG("silencebuf backing: %s", mem_backing(got));
 
 	IF_DSD(
-		silencebuf_dsd = malloc(MAX_SILENCE_FRAMES * BYTES_PER_FRAME);
+		silencebuf_dsd = mem_alloc(MAX_SILENCE_FRAMES * BYTES_PER_FRAME, &got);
 		if (!silencebuf_dsd) {
 			LOG_ERROR("unable to malloc silence dsd buffer");
 			exit(0);
@@ -429,9 +513,9 @@ void output_init_common(log_level level, const char *device, unsigned output_buf
 
 void output_close_common(void) {
 	buf_destroy(outputbuf);
-	free(silencebuf);
+	mem_free(silencebuf);
 	IF_DSD(
-		free(silencebuf_dsd);
+		mem_free(silencebuf_dsd);
 	)
 }
 
@@ -94,8 +94,8 @@ static bool running = true;
 extern struct outputstate output;
 extern struct buffer *outputbuf;
 
-#define LOCK   mutex_lock(outputbuf->mutex)
-#define UNLOCK mutex_unlock(outputbuf->mutex)
+#define LOCK   buf_lock(outputbuf)
+#define UNLOCK buf_unlock(outputbuf)
 
 static char *ctl4device(const char *device) {
 	char *ctl = NULL;
@@ -758,6 +758,9 @@ static void *output_thread(void *arg) {
 	bool probe_device = (arg != NULL);
 	int err;
 	const char* threadname = "output_alsa\0";
+	char placed[128];
+
+	LOG_INFO("thread %s", thread_place("output", placed, sizeof(placed)));
 
 	
 	while (running) {
@@ -1035,7 +1038,6 @@ void output_init_alsa(log_level level, const char *device, unsigned output_buf_s
 	char *alsa_sample_fmt = NULL;
 	bool alsa_mmap = true;
 	bool alsa_reopen = false;
-	int err; 
 
 	char *volume_mixer_name = next_param(volume_mixer, ',');
 	char *volume_mixer_index = next_param(NULL, ',');
@@ -1137,64 +1139,16 @@ void output_init_alsa(log_level level, const char *device, unsigned output_buf_s
 	touch_memory(outputbuf->buf, outputbuf->size);
 #endif
 
+	// output thread defaults to real-time scheduler class, only works as root or if user has permission,
+	// optionally on the last cpu - either can be overridden with -T output:...
+	thread_placement_default("output", SCHED_FIFO, rt_priority, alsa.output_affinity ? sysconf(_SC_NPROCESSORS_CONF) - 1 : -1);
+
 	// start output thread
 	pthread_attr_t attr;
 	pthread_attr_init(&attr);
 	pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + OUTPUT_THREAD_STACK_SIZE);
 	pthread_create(&thread, &attr, output_thread, rates[0] ? "probe" : NULL);
 	pthread_attr_destroy(&attr);
-
-	// try to set this thread to real-time scheduler class, only works as root or if user has permission
-	int policy = SCHED_FIFO;
-	struct sched_param param;
-	param.sched_priority = rt_priority;
-
-	if ((err = pthread_setschedparam(thread, policy, &param)) < 0) {
-		LOG_DEBUG("unable to set sched params %s", strerror(errno));
-	}
-	
-	if (alsa.output_affinity) {
-	
-		cpu_set_t mask;
-		ulong ncores = sysconf(_SC_NPROCESSORS_CONF);
-
-		LOG_DEBUG("number of processors %d", ncores);
-
-		//clears the actual mask
-		CPU_ZERO(&mask);
-
-		// assign output thread to last CPU = ncores - 1
-		CPU_SET( ncores - 1 , &mask);
-
-		LOG_DEBUG("affinity assigned to processor %d", ncores - 1);
-
-	
-		if ((err = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &mask)) < 0) {
-			LOG_DEBUG("unable to set thread affinity %s", strerror(errno));
-			
-		CPU_FREE(&mask);
-		}
-	}
-
-
-
-#ifdef LOG_DEBUG
-
-	const char* threadname = "output_alsa";
-
-	if ((err = pthread_getschedparam(thread, &policy, &param)) < 0) { 
-		LOG_DEBUG("unable to get sched params %s", strerror(errno));
-	}
-
-	LOG_DEBUG("%s: pthread: sched - policy: %s, priority: %u", threadname,
-										(policy == SCHED_FIFO)  ? "SCHED_FIFO" :
-										(policy == SCHED_RR)    ? "SCHED_RR" :
-										(policy == SCHED_OTHER) ? "SCHED_OTHER" :
-										"???",
-										param.sched_priority);
-
-#endif
-
 }
 
 void output_close_alsa(void) {
@@ -72,8 +72,8 @@ static bool running = true;
 extern struct outputstate output;
 extern struct buffer *outputbuf;
 
-#define LOCK   mutex_lock(outputbuf->mutex)
-#define UNLOCK mutex_unlock(outputbuf->mutex)
+#define LOCK   buf_lock(outputbuf)
+#define UNLOCK buf_unlock(outputbuf)
 
 extern u8_t *silencebuf;
 #if DSD
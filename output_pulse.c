@@ -74,8 +74,8 @@ extern struct buffer *outputbuf;
 
 #define OUTPUT_STATE_TIMER_INTERVAL_USEC   100000
 
-#define LOCK   mutex_lock(outputbuf->mutex)
-#define UNLOCK mutex_unlock(outputbuf->mutex)
+#define LOCK   buf_lock(outputbuf)
+#define UNLOCK buf_unlock(outputbuf)
 
 extern u8_t *silencebuf;
 
@@ -419,6 +419,11 @@ static void * output_thread(void *arg) {
 	bool output_off = (output.state == OUTPUT_OFF);
 	pa_time_event *output_state_timer = NULL;
 
+#if LINUX
+	char placed[128];
+	LOG_INFO("thread %s", thread_place("output", placed, sizeof(placed)));
+#endif
+
 	while (pulse.running) {
 		if (output_off) {
 			if (pulse.stream != NULL) {
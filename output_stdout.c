@@ -32,8 +32,8 @@ static bool running = true;
 extern struct outputstate output;
 extern struct buffer *outputbuf;
 
-#define LOCK   mutex_lock(outputbuf->mutex)
-#define UNLOCK mutex_unlock(outputbuf->mutex)
+#define LOCK   buf_lock(outputbuf)
+#define UNLOCK buf_unlock(outputbuf)
 
 extern u8_t *silencebuf;
 #if DSD
@@ -83,6 +83,10 @@ static int _stdout_write_frames(frames_t out_frames, bool silence, s32_t gainL,
 }
 
 static void *output_thread() {
+#if LINUX
+	char placed[128];
+	LOG_INFO("thread %s", thread_place("output", placed, sizeof(placed)));
+#endif
 
 	LOCK;
 
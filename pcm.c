@@ -21,14 +21,6 @@
 
 #include "squeezelite.h"
 
-#if BYTES_PER_FRAME == 4
-#define SHIFT 16
-#define OPTR_T	u16_t
-#else
-#define OPTR_T	u32_t	
-#define SHIFT 0
-#endif
-
 extern log_level loglevel;
 
 extern struct buffer *streambuf;
@@ -36,28 +28,23 @@ extern struct buffer *outputbuf;
 extern struct streamstate stream;
 extern struct outputstate output;
 extern struct decodestate decode;
-extern struct processstate process;
 
 bool pcm_check_header = false;
 
-#define LOCK_S   mutex_lock(streambuf->mutex)
-#define UNLOCK_S mutex_unlock(streambuf->mutex)
-#define LOCK_O   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(outputbuf->mutex)
+#define LOCK_S   buf_lock(streambuf)
+#define UNLOCK_S buf_unlock(streambuf)
+#define LOCK_O   buf_lock(outputbuf)
+#define UNLOCK_O buf_unlock(outputbuf)
 #if PROCESS
-#define LOCK_O_direct   if (decode.direct) mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct if (decode.direct) mutex_unlock(outputbuf->mutex)
-#define LOCK_O_not_direct   if (!decode.direct) mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_not_direct if (!decode.direct) mutex_unlock(outputbuf->mutex)
-#define IF_DIRECT(x)    if (decode.direct) { x }
-#define IF_PROCESS(x)   if (!decode.direct) { x }
+#define LOCK_O_direct   if (decode.direct) buf_lock(outputbuf)
+#define UNLOCK_O_direct if (decode.direct) buf_unlock(outputbuf)
+#define LOCK_O_not_direct   if (!decode.direct) buf_lock(outputbuf)
+#define UNLOCK_O_not_direct if (!decode.direct) buf_unlock(outputbuf)
 #else
-#define LOCK_O_direct   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct mutex_unlock(outputbuf->mutex)
+#define LOCK_O_direct   buf_lock(outputbuf)
+#define UNLOCK_O_direct buf_unlock(outputbuf)
 #define LOCK_O_not_direct
 #define UNLOCK_O_not_direct
-#define IF_DIRECT(x)    { x }
-#define IF_PROCESS(x)
 #endif
 
 #define MAX_DECODE_FRAMES 4096
@@ -182,9 +169,8 @@ static void _check_header(void) {
 
 static decode_state pcm_decode(void) {
 	unsigned bytes, in, out;
-	frames_t frames, count;
-	OPTR_T *optr;
-	u8_t  *iptr;
+	frames_t frames;
+	u8_t  *iptr, *wptr;
 	u8_t tmp[3*8];
 	
 	LOCK_S;
@@ -197,14 +183,7 @@ static decode_state pcm_decode(void) {
 
 	bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
 
-	IF_DIRECT(
-		out = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
-	);
-	IF_PROCESS(
-		out = process.max_in_frames;
-	);
-
-	if ((stream.state <= DISCONNECT && bytes < bytes_per_frame) || (limit && audio_left == 0)) {
+	if ((STREAM_ENDED && bytes < bytes_per_frame) || (limit && audio_left == 0)) {
 		UNLOCK_O_direct;
 		UNLOCK_S;
 		return DECODE_COMPLETE;
@@ -226,6 +205,7 @@ static decode_state pcm_decode(void) {
 			else
 				output.next_fmt = DOP;
 			output.next_sample_rate = sample_rate;
+			_output_autosize(output.next_sample_rate);
 			output.fade = FADE_INACTIVE;
 		} else {
 			output.next_sample_rate = decode_newstream(sample_rate, output.supported_rates);
@@ -237,24 +217,16 @@ static decode_state pcm_decode(void) {
 		if (output.fade_mode) _checkfade(true);
 #endif
 		UNLOCK_O_not_direct;
-		IF_PROCESS(
-			out = process.max_in_frames;
-		);
 		bytes_per_frame = channels * sample_size;
 	}
 
-	IF_DIRECT(
-		optr = (OPTR_T *)outputbuf->writep;
-	);
-	IF_PROCESS(
-		optr = (OPTR_T *)process.inbuf;
-	);
+	out = decode_reserve(&wptr);
 	iptr = (u8_t *)streambuf->readp;
 
 	in = bytes / bytes_per_frame;
 
 	//  handle frame wrapping round end of streambuf
-	//  - only need if resizing of streambuf does not avoid this, could occur in localfile case
+	//  - only need if resizing of streambuf does not avoid this, could occur in localfile case when streambuf not mirrored
 	if (in == 0 && bytes > 0 && _buf_used(streambuf) >= bytes_per_frame) {
 		memcpy(tmp, iptr, bytes);
 		memcpy(tmp + bytes, streambuf->buf, bytes_per_frame - bytes);
@@ -270,148 +242,8 @@ static decode_state pcm_decode(void) {
 		frames = audio_left / bytes_per_frame;
 	}
 
-	count = frames * channels;
-
-	if (channels == 2) {
-		if (sample_size == 1) {
-			while (count--) {
-				*optr++ = *iptr++ << (24-SHIFT);
-			}
-		} else if (sample_size == 2) {
-			if (bigendian) {
-#if BYTES_PER_FRAME == 4 && !SL_LITTLE_ENDIAN			
-				// while loop below works as is, but memcpy is a win for that 16/16 typical case
-				memcpy(optr, iptr, count * BYTES_PER_FRAME / 2);
-#else				
-				while (count--) {
-					*optr++ = *(iptr) << (24-SHIFT) | *(iptr+1) << (16-SHIFT);
-					iptr += 2;
-				}
-#endif				
-			} else {
-#if BYTES_PER_FRAME == 4 && SL_LITTLE_ENDIAN			
-				// while loop below works as is, but memcpy is a win for that 16/16 typical case
-				memcpy(optr, iptr, count * BYTES_PER_FRAME / 2);
-#else
-				while (count--) {
-					*optr++ = *(iptr) << (16-SHIFT) | *(iptr+1) << (24-SHIFT);
-					iptr += 2;
-				}
-#endif	
-			}
-		} else if (sample_size == 3) {
-			if (bigendian) {
-				while (count--) {
-#if BYTES_PER_FRAME == 4				
-					*optr++ = *(iptr) << 8 | *(iptr+1);
-#else					
-					*optr++ = *(iptr) << 24 | *(iptr+1) << 16 | *(iptr+2) << 8;
-#endif	
-					iptr += 3;
-				}
-			} else {
-				while (count--) {
-#if BYTES_PER_FRAME == 4									
-					*optr++ = *(iptr+1) | *(iptr+2) << 8;
-#else
-					*optr++ = *(iptr) << 8 | *(iptr+1) << 16 | *(iptr+2) << 24;
-#endif	
-					iptr += 3;
-				}
-			}
-		} else if (sample_size == 4) {
-			if (bigendian) {
-				while (count--) {
-#if BYTES_PER_FRAME == 4														
-					*optr++ = *(iptr) << 8 | *(iptr+1);
-#else
-					*optr++ = *(iptr) << 24 | *(iptr+1) << 16 | *(iptr+2) << 8 | *(iptr+3);
-#endif	
-					iptr += 4;
-				}
-			} else {
-				while (count--) {
-#if BYTES_PER_FRAME == 4																			
-					*optr++ = *(iptr+2) | *(iptr+3) << 8;
-#else
-					*optr++ = *(iptr) | *(iptr+1) << 8 | *(iptr+2) << 16 | *(iptr+3) << 24;
-#endif	
-					iptr += 4;
-				}
-			}
-		}
-	} else if (channels == 1) {
-		if (sample_size == 1) {
-			while (count--) {
-				*optr = *iptr++ << (24-SHIFT);
-				*(optr+1) = *optr;
-				optr += 2;
-			}
-		} else if (sample_size == 2) {
-			if (bigendian) {
-				while (count--) {
-					*optr = *(iptr) << (24-SHIFT) | *(iptr+1) << (16-SHIFT);
-					*(optr+1) = *optr;
-					iptr += 2;
-					optr += 2;
-				}
-			} else {
-				while (count--) {
-					*optr = *(iptr) << (16-SHIFT) | *(iptr+1) << (24-SHIFT);
-					*(optr+1) = *optr;
-					iptr += 2;
-					optr += 2;
-				}
-			}
-		} else if (sample_size == 3) {
-			if (bigendian) {
-				while (count--) {
-#if BYTES_PER_FRAME == 4				
-					*optr++ = *(iptr) << 8 | *(iptr+1);
-#else					
-					*optr = *(iptr) << 24 | *(iptr+1) << 16 | *(iptr+2) << 8;
-#endif				
-					*(optr+1) = *optr;
-					iptr += 3;
-					optr += 2;
-				}
-			} else {
-				while (count--) {
-#if BYTES_PER_FRAME == 4														
-					*optr++ = *(iptr+1) | *(iptr+2) << 8;
-#else					
-					*optr = *(iptr) << 8 | *(iptr+1) << 16 | *(iptr+2) << 24;
-#endif				
-					*(optr+1) = *optr;
-					iptr += 3;
-					optr += 2;
-				}
-			}
-		} else if (sample_size == 4) {
-			if (bigendian) {
-				while (count--) {
-#if BYTES_PER_FRAME == 4														
-					*optr++ = *(iptr) << 8 | *(iptr+1);
-#else					
-					*optr++ = *(iptr) << 24 | *(iptr+1) << 16 | *(iptr+2) << 8 | *(iptr+3);
-#endif				
-					*(optr+1) = *optr;
-					iptr += 4;
-					optr += 2;
-				}
-			} else {
-				while (count--) {
-#if BYTES_PER_FRAME == 4																			
-					*optr++ = *(iptr+2) | *(iptr+3) << 8;
-#else					
-					*optr++ = *(iptr) | *(iptr+1) << 8 | *(iptr+2) << 16 | *(iptr+3) << 24;
-#endif				
-					*(optr+1) = *optr;
-					iptr += 4;
-					optr += 2;
-				}
-			}
-		}
+	if (channels == 1 || channels == 2) {
+		conv_packed((ISAMPLE_T *)wptr, iptr, frames, channels, sample_size, bigendian);
 	} else {
 		LOG_ERROR("unsupported channels");
 	}
@@ -424,12 +256,7 @@ static decode_state pcm_decode(void) {
 		audio_left -= frames * bytes_per_frame;
 	}
 
-	IF_DIRECT(
-		_buf_inc_writep(outputbuf, frames * BYTES_PER_FRAME);
-	);
-	IF_PROCESS(
-		process.in_frames = frames;
-	);
+	decode_commit(frames);
 
 	UNLOCK_O_direct;
 	UNLOCK_S;
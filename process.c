@@ -34,8 +34,8 @@ extern struct codec *codec;
 
 #define LOCK_D   mutex_lock(decode.mutex);
 #define UNLOCK_D mutex_unlock(decode.mutex);
-#define LOCK_O   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(outputbuf->mutex)
+#define LOCK_O   buf_lock(outputbuf)
+#define UNLOCK_O buf_unlock(outputbuf)
 
 // macros to map to processing functions - currently only resample.c
 // this can be made more generic when multiple processing mechanisms get added
@@ -48,52 +48,52 @@ extern struct codec *codec;
 #endif
 
 
-// transfer all processed frames to the output buf
+// select where processing writes - in place in outputbuf when a whole block fits without wrap, else process.outbuf
+// decode thread is the single producer for outputbuf so space is reserved without LOCK_O
+static void _reserve_out(void) {
+	u8_t *ptr = _buf_reserve(outputbuf, process.max_out_frames * BYTES_PER_FRAME);
+	process.out = ptr ? ptr : process.outbuf;
+	process.out_frames = 0;
+}
+
+// make processed frames visible to the output thread
+// decode thread only processes a block once outputbuf has space for max_out_frames so no wait is needed
 static void _write_samples(void) {
 	frames_t frames = process.out_frames;
 	u32_t *iptr   = (u32_t *)process.outbuf;
-	unsigned cnt  = 10;
 
-	LOCK_O;
+	if (process.out != process.outbuf) {
+		_buf_commit(outputbuf, frames * BYTES_PER_FRAME);
+		return;
+	}
 
+	// block straddles the wrap point - copy in up to two parts
 	while (frames > 0) {
 
 		frames_t f = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
 		u32_t *optr = (u32_t *)outputbuf->writep;
 
-		if (f > 0) {
-
-			f = min(f, frames);
-			
-			memcpy(optr, iptr, f * BYTES_PER_FRAME);
-			
-			frames -= f;
-			
-			_buf_inc_writep(outputbuf, f * BYTES_PER_FRAME);
-			iptr += f * BYTES_PER_FRAME / sizeof(*iptr);
+		if (f == 0) {
+			LOG_ERROR("no space in output buffer - dropping %u frames", frames);
+			return;
+		}
 
-		} else if (cnt--) {
+		f = min(f, frames);
 
-			// there should normally be space in the output buffer, but may need to wait during drain phase
-			UNLOCK_O;
-			usleep(10000);
-			LOCK_O;
+		memcpy(optr, iptr, f * BYTES_PER_FRAME);
 
-		} else {
+		frames -= f;
 
-			// bail out if no space found after 100ms to avoid locking
-			LOG_ERROR("unable to get space in output buffer");
-			UNLOCK_O;
-			return;
-		}
+		_buf_inc_writep(outputbuf, f * BYTES_PER_FRAME);
+		iptr += f * BYTES_PER_FRAME / sizeof(*iptr);
 	}
-
-	UNLOCK_O;
 }
 
 // process samples - called with decode mutex set
 void process_samples(void) {
 
+	_reserve_out();
+
 	SAMPLES_FUNC(&process);
 
 	_write_samples();
@@ -101,19 +101,23 @@ void process_samples(void) {
 	process.in_frames = 0;
 }
 
-// drain at end of track - called with decode mutex set
-void process_drain(void) {
+// drain at end of track, one block per call so the decode thread can wait for space between blocks
+// returns true once complete - called with decode mutex set
+bool process_drain(void) {
 	bool done;
 
-	do {
+	_reserve_out();
 
-		done = DRAIN_FUNC(&process);
+	done = DRAIN_FUNC(&process);
 
-		_write_samples();
+	_write_samples();
 
-	} while (!done);
+	if (done) {
+		process.draining = false;
+		LOG_DEBUG("processing track complete - frames in: %lu out: %lu", process.total_in, process.total_out);
+	}
 
-	LOG_DEBUG("processing track complete - frames in: %lu out: %lu", process.total_in, process.total_out);
+	return done;
 }	
 
 // new stream - called with decode mutex set
@@ -127,10 +131,11 @@ unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supp
 
 	if (active) {
 
-		unsigned max_in_frames, max_out_frames;
+		unsigned max_in_frames, max_out_frames, got;
 
 		process.in_frames = process.out_frames = 0;
 		process.total_in = process.total_out = 0;
+		process.draining = false;
 
 		max_in_frames = codec->min_space / BYTES_PER_FRAME ;
 
@@ -143,15 +148,17 @@ unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supp
 
 		if (process.max_in_frames != max_in_frames) {
 			LOG_DEBUG("creating process buf in frames: %u", max_in_frames);
-			if (process.inbuf) free(process.inbuf);
-			process.inbuf = malloc(max_in_frames * BYTES_PER_FRAME);
+			if (process.inbuf) mem_free(process.inbuf);
+			process.inbuf = mem_alloc(max_in_frames * BYTES_PER_FRAME, &got);
+			LOG_DEBUG("process buf in backing: %s", mem_backing(got));
 			process.max_in_frames = max_in_frames;
 		}
 		
 		if (process.max_out_frames != max_out_frames) {
 			LOG_DEBUG("creating process buf out frames: %u", max_out_frames);
-			if (process.outbuf) free(process.outbuf);
-			process.outbuf = malloc(max_out_frames * BYTES_PER_FRAME);
+			if (process.outbuf) mem_free(process.outbuf);
+			process.outbuf = mem_alloc(max_out_frames * BYTES_PER_FRAME, &got);
+			LOG_DEBUG("process buf out backing: %s", mem_backing(got));
 			process.max_out_frames = max_out_frames;
 		}
 		
@@ -175,6 +182,7 @@ void process_flush(void) {
 	FLUSH_FUNC();
 
 	process.in_frames = 0;
+	process.draining = false;
 }
 
 // init - called with no mutex
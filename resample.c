@@ -72,7 +72,7 @@ void resample_samples(struct processstate *process) {
 	size_t clip_cnt;
 	
 	soxr_error_t error =
-		SOXR(r, process, r->resampler, process->inbuf, process->in_frames, &idone, process->outbuf, process->max_out_frames, &odone);
+		SOXR(r, process, r->resampler, process->inbuf, process->in_frames, &idone, process->out, process->max_out_frames, &odone);
 	if (error) {
 		LOG_INFO("soxr_process error: %s", soxr_strerror(error));
 		return;
@@ -99,7 +99,7 @@ bool resample_drain(struct processstate *process) {
 	size_t odone;
 	size_t clip_cnt;
 		
-	soxr_error_t error = SOXR(r, process, r->resampler, NULL, 0, NULL, process->outbuf, process->max_out_frames, &odone);
+	soxr_error_t error = SOXR(r, process, r->resampler, NULL, 0, NULL, process->out, process->max_out_frames, &odone);
 	if (error) {
 		LOG_INFO("soxr_process error: %s", soxr_strerror(error));
 		return true;
@@ -45,6 +45,7 @@ static sockfd sock = -1;
 static in_addr_t slimproto_ip = 0;
 
 extern struct buffer *streambuf;
+extern struct buffer *fillbuf;
 extern struct buffer *outputbuf;
 
 extern struct streamstate stream;
@@ -58,10 +59,10 @@ extern struct irstate ir;
 
 event_event wake_e;
 
-#define LOCK_S   mutex_lock(streambuf->mutex)
-#define UNLOCK_S mutex_unlock(streambuf->mutex)
-#define LOCK_O   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(outputbuf->mutex)
+#define LOCK_S   buf_lock(streambuf)
+#define UNLOCK_S buf_unlock(streambuf)
+#define LOCK_O   buf_lock(outputbuf)
+#define UNLOCK_O buf_unlock(outputbuf)
 #define LOCK_D   mutex_lock(decode.mutex)
 #define UNLOCK_D mutex_unlock(decode.mutex)
 #if IR
@@ -86,6 +87,9 @@ static struct {
 
 int autostart;
 bool sentSTMu, sentSTMo, sentSTMl;
+static bool earlySTMd;  // STMd sent once the stream was fully received so the server sends the next one while decoding
+static bool prefetched; // decoder continues into the stream opened by codec_prefetch, which may have ended already
+static bool noEarlySTMd; // prefetch buffer could not be allocated, STMd waits for the current stream to be decoded
 u32_t new_server;
 char *new_server_cap;
 #define PLAYER_NAME_LEN 64
@@ -284,6 +288,7 @@ static void process_strm(u8_t *pkt, int len) {
 		sendSTAT("STMt", strm->replay_gain); // STMt replay_gain is no longer used to track latency, but support it
 		break;
 	case 'q':
+		earlySTMd = noEarlySTMd = prefetched = false;
 		decode_flush();
 		output_flush();
 		status.frames_played = 0;
@@ -292,6 +297,7 @@ static void process_strm(u8_t *pkt, int len) {
 		buf_flush(streambuf);
 		break;
 	case 'f':
+		earlySTMd = noEarlySTMd = prefetched = false;
 		decode_flush();
 		output_flush();
 		status.frames_played = 0;
@@ -344,26 +350,35 @@ static void process_strm(u8_t *pkt, int len) {
 			char *header = (char *)(pkt + sizeof(struct strm_packet));
 			in_addr_t ip = (in_addr_t)strm->server_ip; // keep in network byte order
 			u16_t port = strm->server_port; // keep in network byte order
+			bool prefetch = earlySTMd;      // decoder is still running the stream STMd was sent early for
 			if (ip == 0) ip = slimproto_ip; 
 
 			LOG_DEBUG("strm s autostart: %c transition period: %u transition type: %u codec: %c", 
 					  strm->autostart, strm->transition_period, strm->transition_type - '0', strm->format);
 			
 			autostart = strm->autostart - '0';
+			earlySTMd = noEarlySTMd = prefetched = false;
 
 			sendSTAT("STMf", 0);
 			if (header_len > MAX_HEADER -1) {
 				LOG_WARN("header too long: %u", header_len);
 				break;
 			}
-			if (strm->format != '?') {
+			if (strm->format == '?' && autostart < 2) {
+				LOG_WARN("unknown codec requires autostart >= 2");
+				break;
+			}
+			// a prefetch buffer was reserved before STMd was sent early, so this only fails once decoding has stopped
+			// and the codec can be opened and streambuf flushed without cutting short the previous stream
+			if (prefetch && codec_prefetch(strm->format, strm->pcm_sample_size, strm->pcm_sample_rate, strm->pcm_channels, strm->pcm_endianness)) {
+				// decoder continues into this stream when the current one completes
+				LOG_DEBUG("prefetching next stream");
+				prefetched = true;
+			} else if (strm->format != '?') {
 				codec_open(strm->format, strm->pcm_sample_size, strm->pcm_sample_rate, strm->pcm_channels, strm->pcm_endianness);
-			} else if (autostart >= 2) {
+			} else {
 				// extension to slimproto to allow server to detect codec from response header and send back in codc message
 				LOG_DEBUG("streaming unknown codec");
-			} else {
-				LOG_WARN("unknown codec requires autostart >= 2");
-				break;
 			}
 			if (ip == LOCAL_PLAYER_IP && port == LOCAL_PLAYER_PORT) {
 				// extension to slimproto for LocalPlayer - header is filename not http header, don't expect cont
@@ -405,6 +420,7 @@ static void process_cont(u8_t *pkt, int len) {
 			stream.meta_interval = stream.meta_next = cont->metaint;
 		}
 		UNLOCK_S;
+		wake_stream();
 		wake_controller();
 	}
 }
@@ -413,6 +429,10 @@ static void process_codc(u8_t *pkt, int len) {
 	struct codc_packet *codc = (struct codc_packet *)pkt;
 
 	LOG_DEBUG("codc: %c", codc->format);
+	// a prefetched stream of unknown format has its codec opened when the decoder switches to it
+	if (prefetched && codec_prefetch(codc->format, codc->pcm_sample_size, codc->pcm_sample_rate, codc->pcm_channels, codc->pcm_endianness)) {
+		return;
+	}
 	codec_open(codc->format, codc->pcm_sample_size, codc->pcm_sample_rate, codc->pcm_channels, codc->pcm_endianness);
 }
 
@@ -534,6 +554,7 @@ static void process(u8_t *pack, int len) {
 }
 
 static bool running;
+static volatile bool dump_stats = false;
 
 static void slimproto_run() {
 	static u8_t buffer[MAXBUF];
@@ -608,6 +629,13 @@ static void slimproto_run() {
 			return;
 		}
 
+		// buffer telemetry requested by signal
+		if (dump_stats) {
+			dump_stats = false;
+			buf_stats_dump(streambuf, "streambuf");
+			buf_stats_dump(outputbuf, "outputbuf");
+		}
+
 		// update playback state when woken or every 100ms
 		now = gettime_ms();
 
@@ -624,6 +652,8 @@ static void slimproto_run() {
 			bool _sendSTMn = false;
 			bool _stream_disconnect = false;
 			bool _start_output = false;
+			bool _prefetch;
+			bool _earlySTMd = false;
 			decode_state _decode_state;
 			disconnect_code disconnect_code;
 			static char header[MAX_HEADER];
@@ -636,10 +666,11 @@ static void slimproto_run() {
 
 
 			LOCK_S;
-			status.stream_full = _buf_used(streambuf);
-			status.stream_size = streambuf->size;
+			status.stream_full = _buf_used(fillbuf);
+			status.stream_size = fillbuf->size;
 			status.stream_bytes = stream.bytes;
 			status.stream_state = stream.state;
+			_prefetch = stream.prefetch;
 						
 			if (stream.state == DISCONNECT) {
 				disconnect_code = stream.disconnect;
@@ -663,20 +694,31 @@ static void slimproto_run() {
 
 			LOCK_D;
 			if ((status.stream_state == STREAMING_HTTP || status.stream_state == STREAMING_FILE ||
-				(status.stream_state == DISCONNECT && stream.disconnect == DISCONNECT_OK)) &&
+				(status.stream_state == DISCONNECT && stream.disconnect == DISCONNECT_OK) ||
+				(prefetched && status.stream_state <= DISCONNECT && stream.disconnect == DISCONNECT_OK)) &&
 				!sentSTMl && decode.state == DECODE_READY) {
+				prefetched = false;
 				if (autostart == 0) {
 					decode.state = DECODE_RUNNING;
 					_sendSTMl = true;
 					sentSTMl = true;
+					wake_decode();
 				} else if (autostart == 1) {
 					decode.state = DECODE_RUNNING;
 					_start_output = true;
+					wake_decode();
 				}
 				// autostart 2 and 3 require cont to be received first
 			}
+			// stream fully received while still decoding, report decode complete so the server sends the next track
+			// now and it can be received into a second buffer - see codec_prefetch
+			if (decode.state == DECODE_RUNNING && !earlySTMd && !noEarlySTMd && !_prefetch &&
+				status.stream_state <= DISCONNECT && stream.disconnect == DISCONNECT_OK) {
+				_earlySTMd = true;
+			}
 			if (decode.state == DECODE_COMPLETE || decode.state == DECODE_ERROR) {
-				if (decode.state == DECODE_COMPLETE) _sendSTMd = true;
+				if (decode.state == DECODE_COMPLETE && !earlySTMd) _sendSTMd = true;
+				earlySTMd = noEarlySTMd = false;
 				if (decode.state == DECODE_ERROR)    _sendSTMn = true;
 				decode.state = DECODE_STOPPED;
 				if (status.stream_state == STREAMING_HTTP || status.stream_state == STREAMING_FILE) {
@@ -685,6 +727,16 @@ static void slimproto_run() {
 			}
 			_decode_state = decode.state;
 			UNLOCK_D;
+
+			// only sent early if the next stream can be received into a second buffer, see stream_prefetch_reserve
+			if (_earlySTMd) {
+				if (stream_prefetch_reserve()) {
+					_sendSTMd = true;
+					earlySTMd = true;
+				} else {
+					noEarlySTMd = true;
+				}
+			}
 			
 			LOCK_O;
 			status.output_full = _buf_used(outputbuf);
@@ -836,6 +888,11 @@ void slimproto(log_level level, char *server, u8_t mac[6], const char *name, con
 	loglevel = level;
 	running = true;
 
+#if LINUX
+	char placed[128];
+	LOG_INFO("thread %s", thread_place("slimproto", placed, sizeof(placed)));
+#endif
+
 	if (server) {
 		server_addr(server, &slimproto_ip, &slimproto_port);
 	}
@@ -977,3 +1034,9 @@ void slimproto_stop(void) {
 	LOG_INFO("slimproto stop");
 	running = false;
 }
+
+// called from signal handler - buffer telemetry is logged by the slimproto loop
+void slimproto_stats(void) {
+	dump_stats = true;
+	wake_controller();
+}
@@ -155,6 +155,20 @@
 #define IR 0
 #endif
 
+#if LINUX && defined(IOURING)
+#undef IOURING
+#define IOURING 1 // io_uring reads for the stream thread, requires liburing at build and run time
+#else
+#define IOURING 0
+#endif
+
+#if defined(GZIP)
+#undef GZIP
+#define GZIP 1 // inflate gzip and deflate content encoded http streams, requires zlib
+#else
+#define GZIP 0
+#endif
+
 #if defined(DSD)
 #undef DSD
 #define DSD       1
@@ -256,6 +270,11 @@
 #define OUTPUTBUF_SIZE (44100 * 8 * 10)
 #define OUTPUTBUF_SIZE_CROSSFADE (OUTPUTBUF_SIZE * 12 / 10)
 
+// limits when buffers are sized in milliseconds of audio
+#define STREAMBUF_MIN (256 * 1024)
+#define STREAMBUF_MAX (64 * 1024 * 1024)
+#define OUTPUTBUF_MIN (512 * 1024)
+
 #define MAX_HEADER 4096 // do not reduce as icy-meta max is 4080
 
 #if ALSA
@@ -326,9 +345,14 @@ typedef int64_t   s64_t;
 #define mutex_create_p(m) pthread_mutexattr_t attr; pthread_mutexattr_init(&attr); pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT); pthread_mutex_init(&m, &attr); pthread_mutexattr_destroy(&attr)
 #define mutex_lock(m) pthread_mutex_lock(&m)
 #define mutex_unlock(m) pthread_mutex_unlock(&m)
+#define mutex_trylock(m) (pthread_mutex_trylock(&m) == 0)
 #define mutex_destroy(m) pthread_mutex_destroy(&m)
 #define thread_type pthread_t
 
+#define atomic_load_p(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define atomic_store_p(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
 #endif
 
 #if WIN
@@ -360,9 +384,14 @@ typedef BOOL bool;
 #define mutex_create_p mutex_create
 #define mutex_lock(m) WaitForSingleObject(m, INFINITE)
 #define mutex_unlock(m) ReleaseMutex(m)
+#define mutex_trylock(m) (WaitForSingleObject(m, 0) == WAIT_OBJECT_0)
 #define mutex_destroy(m) CloseHandle(m)
 #define thread_type HANDLE
 
+#define atomic_load_p(p) ((void *)InterlockedCompareExchangePointer((PVOID volatile *)&(p), NULL, NULL))
+#define atomic_store_p(p, v) InterlockedExchangePointer((PVOID volatile *)&(p), (v))
+#define atomic_fence() MemoryBarrier()
+
 #define usleep(x) Sleep(x/1000)
 #define sleep(x) Sleep(x*1000)
 #define last_error() WSAGetLastError()
@@ -465,13 +494,19 @@ char* strcasestr(const char *haystack, const char *needle);
 
 char *next_param(char *src, char c);
 u32_t gettime_ms(void);
+u64_t gettime_us(void);
 void get_mac(u8_t *mac);
 void set_nonblock(sockfd s);
 void set_recvbufsize(sockfd s);
+#if !WIN
+int set_recvbufmin(sockfd s, int bytes);
+void set_recvlowat(sockfd s, int bytes);
+#endif
 int connect_timeout(sockfd sock, const struct sockaddr *addr, socklen_t addrlen, int timeout);
 void server_addr(char *server, in_addr_t *ip_ptr, unsigned *port_ptr);
 void set_readwake_handles(event_handle handles[], sockfd s, event_event e);
 event_type wait_readwake(event_handle handles[], int timeout);
+bool wait_wake(event_event e, int timeout);
 void packN(u32_t *dest, u32_t val);
 void packn(u16_t *dest, u16_t val);
 u32_t unpackN(u32_t *src);
@@ -496,8 +531,46 @@ int poll(struct pollfd *fds, unsigned long numfds, int timeout);
 #if LINUX || FREEBSD
 void touch_memory(u8_t *buf, size_t size);
 #endif
+#define MEM_HUGE  0x01   // huge pages requested / obtained
+#define MEM_LOCK  0x02   // locked into memory requested / obtained
+#define MEM_THP   0x04   // obtained transparent huge page hint only
+#define MEM_ALIGN 64     // cache line
+extern unsigned mem_mode; // MEM_HUGE and MEM_LOCK requested for buffers, see mem_alloc
+void *mem_alloc(size_t size, unsigned *got);
+void mem_free(void *ptr);
+const char *mem_backing(unsigned got);
+struct arena {
+	u8_t *base;
+	size_t size, used;
+	unsigned mem;
+	void *spill;         // chain of arena_spill blocks, freed by arena_reset
+};
+void arena_init(struct arena *a, size_t size);
+void *arena_alloc(struct arena *a, size_t len);
+void *arena_spill(struct arena *a, size_t len);
+void arena_reset(struct arena *a);
+#if LINUX
+size_t mem_hugepage_size(void);
+bool thread_placement(char *spec);
+void thread_placement_default(const char *name, int policy, int prio, int cpu);
+const char *thread_place(const char *name, char *buf, size_t len);
+#endif
 
 // buffer.c
+#define BUF_STATS_BINS 10
+
+struct bufstats {
+	unsigned min_used;               // low watermark seen by reader after reading
+	unsigned max_used;               // high watermark seen by writer after writing
+	u64_t fill_us[BUF_STATS_BINS];   // time spent in each fill band as seen by reader
+	u64_t last_us;
+	unsigned last_bin;
+	unsigned starved;                // reader had to wait for data
+	unsigned blocked;                // writer had to wait for space
+	unsigned lock_waits;             // contended mutex acquisitions
+	u64_t lock_wait_us;              // time spent waiting for them
+};
+
 struct buffer {
 	u8_t *buf;
 	u8_t *readp;
@@ -505,31 +578,64 @@ struct buffer {
 	u8_t *wrap;
 	size_t size;
 	size_t base_size;
+	unsigned flags;
+	unsigned mem;                    // backing obtained from allocator
+	event_event *wake_reader;        // signalled when used reaches read_want
+	event_event *wake_writer;        // signalled when space reaches write_want
+	size_t read_want, write_want;
+	struct bufstats stats;
 	mutex_type mutex;
 };
 
+#define BUF_MIRROR 0x01 // map storage twice back to back so data is contiguous across wrap, falls back to malloc
+#define BUF_MAPPED 0x02 // storage temporarily replaced by a file mapping, see _buf_map
+
+// storage obtained ahead of a resize, see buf_storage_alloc
+struct buf_storage {
+	u8_t *ptr;
+	size_t size;
+	unsigned flags;
+	unsigned mem;
+};
+
 // _* called with mutex locked
+// used, space, cont_* and inc_* may also be called without the mutex by a single producer and single consumer
 unsigned _buf_used(struct buffer *buf);
 unsigned _buf_space(struct buffer *buf);
 unsigned _buf_cont_read(struct buffer *buf);
 unsigned _buf_cont_write(struct buffer *buf);
 void _buf_inc_readp(struct buffer *buf, unsigned by);
 void _buf_inc_writep(struct buffer *buf, unsigned by);
+u8_t *_buf_reserve(struct buffer *buf, size_t bytes);
+void _buf_commit(struct buffer *buf, size_t bytes);
+bool _buf_want_read(struct buffer *buf, size_t bytes);
+bool _buf_want_write(struct buffer *buf, size_t bytes);
+void buf_lock(struct buffer *buf);
+void buf_unlock(struct buffer *buf);
+void buf_stats_dump(struct buffer *buf, const char *name);
 void buf_flush(struct buffer *buf);
 void _buf_unwrap(struct buffer *buf, size_t cont);
 void buf_adjust(struct buffer *buf, size_t mod);
-void _buf_resize(struct buffer *buf, size_t size);
-void buf_init(struct buffer *buf, size_t size);
+bool _buf_resize(struct buffer *buf, size_t size);
+bool buf_storage_alloc(struct buffer *buf, size_t size, struct buf_storage *st);
+void buf_storage_free(struct buf_storage *st);
+bool _buf_replace(struct buffer *buf, struct buf_storage *st);
+#if LINUX || OSX || FREEBSD
+bool _buf_map(struct buffer *buf, int fd, size_t len);
+#endif
+void _buf_swap(struct buffer *a, struct buffer *b);
+void buf_init(struct buffer *buf, size_t size, unsigned flags);
 void buf_destroy(struct buffer *buf);
 
 // slimproto.c
 void slimproto(log_level level, char *server, u8_t mac[6], const char *name, const char *namefile, const char *modelname, int maxSampleRate);
 void slimproto_stop(void);
+void slimproto_stats(void);
 void wake_controller(void);
 
 // stream.c
 typedef enum { STOPPED = 0, DISCONNECT, STREAMING_WAIT,
-			   STREAMING_BUFFERING, STREAMING_FILE, STREAMING_HTTP, SEND_HEADERS, RECV_HEADERS } stream_state;
+			   STREAMING_BUFFERING, STREAMING_FILE, STREAMING_HTTP, TLS_HANDSHAKE, SEND_HEADERS, RECV_HEADERS } stream_state;
 typedef enum { DISCONNECT_OK = 0, LOCAL_DISCONNECT = 1, REMOTE_DISCONNECT = 2, UNREACHABLE = 3, TIMEOUT = 4 } disconnect_code;
 
 struct streamstate {
@@ -545,13 +651,22 @@ struct streamstate {
 	u32_t meta_next;
 	u32_t meta_left;
 	bool  meta_send;
+	bool  prefetch;    // next stream is being received into a second buffer while streambuf drains
 };
 
+// all data for the stream being decoded is in streambuf - test with streambuf mutex locked
+#define STREAM_ENDED (stream.state <= DISCONNECT || stream.prefetch)
+
 void stream_init(log_level level, unsigned stream_buf_size);
 void stream_close(void);
 void stream_file(const char *header, size_t header_len, unsigned threshold);
 void stream_sock(u32_t ip, u16_t port, bool use_ssl, const char *header, size_t header_len, unsigned threshold, bool cont_wait);
 bool stream_disconnect(void);
+bool stream_prefetch_reserve(void);
+bool stream_prefetch(void);
+void stream_prefetch_switch(void);
+void wake_stream(void);
+void stream_autosize(u64_t decoded_ms);
 
 // decode.c
 typedef enum { DECODE_STOPPED = 0, DECODE_READY, DECODE_RUNNING, DECODE_COMPLETE, DECODE_ERROR } decode_state;
@@ -569,6 +684,8 @@ struct decodestate {
 #if PROCESS
 struct processstate {
 	u8_t *inbuf, *outbuf;
+	u8_t *out;                       // output for this block - outputbuf space reserved in place or outbuf
+	bool draining;
 	unsigned max_in_frames, max_out_frames;
 	unsigned in_frames, out_frames;
 	unsigned in_sample_rate, out_sample_rate;
@@ -586,16 +703,35 @@ struct codec {
 	decode_state (*decode)(void);
 };
 
+#define MAX_DECODE_WORKERS 4
+
+// unit of work for decode_submit, run on a worker thread with done set once complete
+struct decode_job {
+	void (*run)(struct decode_job *job, unsigned worker);
+	volatile bool done;
+	struct decode_job *next;
+};
+
 void decode_init(log_level level, const char *include_codecs, const char *exclude_codecs);
 void decode_close(void);
 void decode_flush(void);
 unsigned decode_newstream(unsigned sample_rate, unsigned supported_rates[]);
+frames_t decode_reserve(u8_t **ptr);
+frames_t decode_space(void);
+void decode_commit(frames_t frames);
+void _decode_publish(void);
 void codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness);
+bool codec_prefetch(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness);
+void wake_decode(void);
+unsigned decode_workers(void);
+void decode_submit(struct decode_job *job);
+bool decode_wait(struct decode_job *job, int timeout);
+void decode_yield(size_t bytes);
 
 #if PROCESS
 // process.c
 void process_samples(void);
-void process_drain(void);
+bool process_drain(void);
 void process_flush(void);
 unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supported_rates[]);
 void process_init(char *opt);
@@ -693,6 +829,8 @@ void output_flush(void);
 // _* called with mutex locked
 frames_t _output_frames(frames_t avail);
 void _checkfade(bool);
+bool _output_resize(size_t size);
+void _output_autosize(unsigned rate);
 
 // output_alsa.c
 #if ALSA
@@ -735,6 +873,16 @@ void _apply_gain(struct buffer *outputbuf, frames_t count, s32_t gainL, s32_t ga
 s32_t gain(s32_t gain, s32_t sample);
 s32_t to_gain(float f);
 
+// convert.c - codec output to interleaved stereo ISAMPLE_T, mono duplicated to both channels
+const char *conv_init(void);
+void conv_planar32(ISAMPLE_T *out, const s32_t *l, const s32_t *r, frames_t n, unsigned bits);
+void conv_interleaved32(ISAMPLE_T *out, const s32_t *in, frames_t n, unsigned channels, unsigned bits);
+void conv_interleaved16(ISAMPLE_T *out, const s16_t *in, frames_t n, unsigned channels);
+void conv_planar16(ISAMPLE_T *out, const s16_t *l, const s16_t *r, frames_t n);
+void conv_planar_float(ISAMPLE_T *out, const float *l, const float *r, frames_t n);
+void conv_planar_fixed(ISAMPLE_T *out, const s32_t *l, const s32_t *r, frames_t n, unsigned fracbits);
+void conv_packed(ISAMPLE_T *out, const u8_t *in, frames_t n, unsigned channels, unsigned bytes, bool bigendian);
+
 // output_vis.c
 #if VISEXPORT
 void _vis_export(struct buffer *outputbuf, struct outputstate *output, frames_t out_frames, bool silence);
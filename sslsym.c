@@ -113,6 +113,12 @@ SYMDECL(SSL_set_fd, int, 2, SSL*, s, int, fd);
 SYMDECL(SSL_get_error, int, 2, const SSL*, s, int, ret_code);
 SYMDECL(SSL_ctrl, long, 4, SSL*, ssl, int, cmd, long, larg, void*, parg);
 SYMDECL(SSL_pending, int, 1, const SSL*, s);
+SYMDECL(SSL_get1_session, SSL_SESSION*, 1, SSL*, s);
+SYMDECL(SSL_set_session, int, 2, SSL*, s, SSL_SESSION*, session);
+SYMDECLVOID(SSL_SESSION_free, 1, SSL_SESSION*, session);
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+SYMDECL(SSL_session_reused, int, 1, const SSL*, s);
+#endif
 SYMDECLVOID(SSL_free, 1, SSL*, s);
 SYMDECLVOID(SSL_CTX_free, 1, SSL_CTX *, ctx);
 SYMDECL(ERR_get_error, unsigned long, 0);
@@ -150,6 +156,12 @@ bool load_ssl_symbols(void) {
 	SYMLOAD(SSLhandle, SSL_read);
 	SYMLOAD(SSLhandle, SSL_write);
 	SYMLOAD(SSLhandle, SSL_pending);
+	SYMLOAD(SSLhandle, SSL_get1_session);
+	SYMLOAD(SSLhandle, SSL_set_session);
+	SYMLOAD(SSLhandle, SSL_SESSION_free);
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+	SYMLOAD(SSLhandle, SSL_session_reused);
+#endif
 #if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
 	SYMLOAD(SSLhandle, TLS_client_method);
 	SYMLOAD(SSLhandle, OPENSSL_init_ssl);
@@ -26,12 +26,24 @@
 #include "squeezelite.h"
 
 #include <fcntl.h>
+#if LINUX || OSX || FREEBSD
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 
 #if USE_SSL
 #include "openssl/ssl.h"
 #include "openssl/err.h"
 #endif
 
+#if IOURING
+#include <liburing.h>
+#endif
+
+#if GZIP
+#include <zlib.h>
+#endif
+
 #if SUN
 #include <signal.h>
 #endif
@@ -40,14 +52,100 @@ static log_level loglevel;
 static struct buffer buf;
 struct buffer *streambuf = &buf;
 
-#define LOCK   mutex_lock(streambuf->mutex)
-#define UNLOCK mutex_unlock(streambuf->mutex)
+// buffer the stream thread writes to - a second buffer holds the next stream while the decoder drains streambuf
+static struct buffer nextbuf;
+static bool prefetch_armed;
+static bool prefetch_reserved;           // nextbuf allocated ahead of the stream it is for, see stream_prefetch_reserve
+struct buffer *fillbuf = &buf;
+
+#define LOCK   buf_lock(streambuf)
+#define UNLOCK buf_unlock(streambuf)
+
+#define STREAM_WAKE_SPACE (64 * 1024) // streambuf space to wait for once full before reading again
+
+unsigned stream_buf_ms = 0;           // streambuf sized in ms of audio at the measured byte rate if set
 
 static sockfd fd;
+static event_event stream_wake;
+
+// staging area for socket reads which cannot go straight into streambuf: body bytes received with the response
+// headers while waiting for cont (the icy meta interval is not known until then) and icy streams, which are read
+// in large chunks and split into audio and meta data here rather than with a recv per meta block
+#define STAGE_SIZE (32 * 1024) // must be at least MAX_HEADER
+static u8_t stage_buf[STAGE_SIZE];
+static unsigned stage_len, stage_pos;
 static struct sockaddr_in addr;
 static char host[256];
 static int header_mlen;
 
+// resume of an interrupted http body with a range request for the remainder, stream.state is left unchanged
+// while reconnecting so neither the decoder nor the server see the interruption
+#define RESUME_TRIES   3
+#define RESUME_BACKOFF 500 // ms, doubled for each further try
+#define RESUME_CONNECT_TIMEOUT 10000 // ms
+
+static enum { RESUME_NONE = 0, RESUME_WAIT, RESUME_CONNECT, RESUME_SEND, RESUME_RECV } resume;
+static char *resume_req;           // GET request without any range header, NULL when the stream cannot be resumed
+static unsigned resume_req_len;
+static u64_t resume_base;          // offset of the first body byte as requested by the server
+static u64_t resume_total;         // content length of the body, 0 if unknown
+static unsigned resume_tries;
+static u32_t resume_at;             // end of the backoff, then of the connect timeout
+static char resume_buf[MAX_HEADER];
+static unsigned resume_len;
+static bool resume_ssl;
+
+// idle keep-alive connections, handed back to stream_sock for the next request to the same server
+#define POOL_SIZE 4
+#define POOL_IDLE 30000 // ms
+
+static struct {
+	sockfd fd;
+#if USE_SSL
+	SSL *ssl;
+#endif
+	struct sockaddr_in addr;
+	char host[256];
+	u32_t since;
+} pool[POOL_SIZE];
+static bool keep_alive;            // response allows reuse of the connection once its body is complete
+static bool reused;                // connection came from the pool and has not yet received a response
+
+// chunked transfer encoding is removed in place as the body is read, so streambuf only ever holds the entity
+static enum { CHUNK_SIZE = 0, CHUNK_EXT, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER, CHUNK_TRAILER_LINE, CHUNK_END }
+	chunk_state;
+static bool chunked;
+static u64_t chunk_left;
+
+#if GZIP
+// a content encoded body is read into the staging area and inflated from there into streambuf
+static z_stream zstrm;
+static bool inflating;             // zstrm is initialised for the current body
+static bool inflate_more;          // last inflate filled the space given, it may hold further output
+#else
+#define inflating    false
+#define inflate_more false
+#endif
+
+// socket receive sized from the measured stream rate: the socket buffer holds a couple of seconds of stream, poll
+// only wakes once a few ms of stream has queued and a full streambuf waits for a rate dependent amount of space
+#define RATE_MS      500               // interval over which each rate sample is taken
+#define RCVBUF_MS    2000
+#define RCVBUF_MIN   (64 * 1024)
+#define RCVBUF_MAX   (4 * 1024 * 1024)
+#define RCVLOWAT_MS  20
+#define RCVLOWAT_MAX (64 * 1024)
+#define READ_MS      100
+#define READ_MIN     (16 * 1024)
+#define READ_MAX     (256 * 1024)
+
+static u32_t rate;                 // bytes/s of the current stream, moving average of the samples
+static u32_t rate_at;              // start of the current sample
+static u64_t rate_bytes;           // stream.bytes at rate_at
+static sockfd rate_fd = -1;        // socket the sample and receive options apply to
+static unsigned rcv_lowat;         // 0 while at the socket default
+static size_t read_chunk = STREAM_WAKE_SPACE;
+
 struct streamstate stream;
 
 #if USE_SSL
@@ -100,7 +198,110 @@ static int _poll(struct pollfd *pollinfo, int timeout) {
 	}
 	return poll(pollinfo, 1, timeout);
 }
+
+// tls sessions are kept per host so the next connection, typically for the next track, can resume rather
+// than repeating the full handshake
+#define SSL_CACHE_SIZE    8
+#define HANDSHAKE_TIMEOUT 10000 // ms
+
+static struct {
+	char host[256];
+	u16_t port;
+	SSL_SESSION *session;
+	u32_t used;
+} ssl_cache[SSL_CACHE_SIZE];
+
+static bool ssl_ready;        // handshake complete on the current connection
+static bool ssl_fallback;     // ssl was only tried as the port is 443, use a plain socket if the handshake fails
+static short handshake_events;
+static u32_t handshake_start;
+
+// cache entry for the current host, or if create the entry to replace when not cached
+static int _ssl_cache_find(bool create) {
+	int i, oldest = 0;
+	for (i = 0; i < SSL_CACHE_SIZE; ++i) {
+		if (ssl_cache[i].session && ssl_cache[i].port == addr.sin_port && !strcmp(ssl_cache[i].host, host)) {
+			return i;
+		}
+		if (!ssl_cache[i].session || (ssl_cache[oldest].session && ssl_cache[i].used < ssl_cache[oldest].used)) {
+			oldest = i;
+		}
+	}
+	return create ? oldest : -1;
+}
+
+static void _ssl_cache_put(void) {
+	SSL_SESSION *session;
+	int i;
+
+	if (!*host || (session = SSL_get1_session(ssl)) == NULL) return;
+
+	i = _ssl_cache_find(true);
+	if (ssl_cache[i].session) {
+		SSL_SESSION_free(ssl_cache[i].session);
+	}
+	strcpy(ssl_cache[i].host, host);
+	ssl_cache[i].port = addr.sin_port;
+	ssl_cache[i].session = session;
+	ssl_cache[i].used = gettime_ms();
+}
+
+static void _ssl_cache_drop(void) {
+	int i = _ssl_cache_find(false);
+	if (i >= 0) {
+		SSL_SESSION_free(ssl_cache[i].session);
+		ssl_cache[i].session = NULL;
+	}
+}
+
+static void _ssl_cache_clear(void) {
+	int i;
+	for (i = 0; i < SSL_CACHE_SIZE; ++i) {
+		if (ssl_cache[i].session) {
+			SSL_SESSION_free(ssl_cache[i].session);
+			ssl_cache[i].session = NULL;
+		}
+	}
+}
+
+// release the connection, keeping its session which for tls 1.3 is only sent once the handshake is over
+static void _ssl_close(void) {
+	if (!ssl) return;
+	if (ssl_ready) {
+		_ssl_cache_put();
+	}
+	SSL_shutdown(ssl);
+	SSL_free(ssl);
+	ssl = NULL;
+	ssl_ready = false;
+}
+
+// step the handshake as far as the socket allows, 1 when complete, 0 to wait for handshake_events, -1 on failure
+static int _handshake(void) {
+	int status, err;
+
+	ERR_clear_error();
+	status = SSL_connect(ssl);
+
+	if (status == 1) {
+		ssl_ready = true;
+		LOG_INFO("ssl connected to %s, session %s", host, SSL_session_reused(ssl) ? "resumed" : "new");
+		_ssl_cache_put();
+		return 1;
+	}
+
+	err = SSL_get_error(ssl, status);
+	if ((err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) && gettime_ms() - handshake_start < HANDSHAKE_TIMEOUT) {
+		handshake_events = err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+		return 0;
+	}
+
+	LOG_WARN("unable to open SSL socket %d (%d)", status, err);
+	_ssl_cache_drop();
+	return -1;
+}
 #else
+#define _ssl_close()
 #define _recv(fd, buf, n, opt) recv(fd, buf, n, opt)
 #define _send(fd, buf, n, opt) send(fd, buf, n, opt)
 #define _poll(pollinfo, timeout) poll(pollinfo, 1, timeout)
@@ -108,9 +309,7 @@ static int _poll(struct pollfd *pollinfo, int timeout) {
 #endif // USE_SSL
 
 
-static bool send_header(void) {
-	char *ptr = stream.header;
-	int len = stream.header_len;
+static bool send_header(char *ptr, int len) {
 
 	unsigned try = 0;
 	ssize_t n;
@@ -133,6 +332,7 @@ static bool send_header(void) {
 			stream.disconnect = LOCAL_DISCONNECT;
 			stream.state = DISCONNECT;
 			wake_controller();
+			wake_decode();
 			return false;
 		}
 		LOG_SDEBUG("wrote %d bytes to socket", n);
@@ -145,85 +345,960 @@ static bool send_header(void) {
 
 static bool running = true;
 
+// strip chunk framing from data in place, returns the body bytes left at the start of data - called with mutex locked
+// a malformed chunk ends the body early and the connection is not kept
+static unsigned _dechunk(u8_t *data, unsigned len) {
+	u8_t *in = data, *out = data, *end = data + len;
+
+	while (in < end) {
+		u8_t c;
+
+		if (chunk_state == CHUNK_DATA) {
+			unsigned n = min((u64_t)(end - in), chunk_left);
+			memmove(out, in, n);
+			out += n;
+			in += n;
+			chunk_left -= n;
+			if (!chunk_left) chunk_state = CHUNK_DATA_END;
+			continue;
+		}
+
+		if (chunk_state == CHUNK_END) break;
+
+		c = *in++;
+
+		switch (chunk_state) {
+		case CHUNK_SIZE:
+			if (c >= '0' && c <= '9' && chunk_left >> 60 == 0) {
+				chunk_left = (chunk_left << 4) | (c - '0');
+				break;
+			}
+			if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f' && chunk_left >> 60 == 0) {
+				chunk_left = (chunk_left << 4) | ((c | 0x20) - 'a' + 10);
+				break;
+			}
+			if (c == ';' || c == ' ' || c == '\t') {
+				chunk_state = CHUNK_EXT;
+				break;
+			}
+			if (c == '\r') {
+				break;
+			}
+			if (c != '\n') {
+				LOG_WARN("bad chunk size");
+				chunk_state = CHUNK_END;
+				keep_alive = false;
+				break;
+			}
+			// fall through
+		case CHUNK_EXT:
+			if (c == '\n') {
+				chunk_state = chunk_left ? CHUNK_DATA : CHUNK_TRAILER;
+			}
+			break;
+		case CHUNK_DATA_END:
+			if (c == '\n') {
+				chunk_state = CHUNK_SIZE;
+			}
+			break;
+		case CHUNK_TRAILER:
+			if (c == '\n') {
+				chunk_state = CHUNK_END;
+			} else if (c != '\r') {
+				chunk_state = CHUNK_TRAILER_LINE;
+			}
+			break;
+		case CHUNK_TRAILER_LINE:
+			if (c == '\n') {
+				chunk_state = CHUNK_TRAILER;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return out - data;
+}
+
+// read stream body, taking any body bytes received with the headers first
+// returns 0 at the end of a chunked body as well as when the connection is closed
+static int _recv_body(void *buffer, size_t bytes) {
+	if (stage_pos < stage_len) {
+		int n = min(bytes, stage_len - stage_pos);
+		memcpy(buffer, stage_buf + stage_pos, n);
+		stage_pos += n;
+		return n;
+	}
+	if (!chunked) {
+		return _recv(fd, buffer, bytes, 0);
+	}
+	// read again if all that arrived was framing, until the socket would block
+	while (chunk_state != CHUNK_END) {
+		int n = _recv(fd, buffer, bytes, 0);
+		if (n <= 0) return n;
+		if ((n = _dechunk(buffer, n)) > 0) return n;
+	}
+	return 0;
+}
+
+// split staged icy stream into audio for streambuf and meta data, returns audio bytes added - called with mutex locked
+// any audio which does not fit in streambuf stays staged until the decoder frees space
+static unsigned _icy_demux(void) {
+	unsigned added = 0;
+
+	while (stage_pos < stage_len) {
+		unsigned avail = stage_len - stage_pos;
+
+		if (stream.meta_next) {
+			// audio up to the next meta block
+			unsigned n = min(avail, min(stream.meta_next, min(_buf_space(fillbuf), _buf_cont_write(fillbuf))));
+			if (!n) break;
+			memcpy(fillbuf->writep, stage_buf + stage_pos, n);
+			_buf_inc_writep(fillbuf, n);
+			stream.bytes += n;
+			stream.meta_next -= n;
+			stage_pos += n;
+			added += n;
+
+		} else if (stream.meta_left == 0) {
+			// meta length
+			stream.meta_left = 16 * stage_buf[stage_pos++];
+			stream.header_len = 0; // amount of received meta data
+			// MAX_HEADER must be more than meta max of 16 * 255
+			if (stream.meta_left == 0) {
+				stream.meta_next = stream.meta_interval;
+			}
+
+		} else {
+			// meta data, possibly split across reads
+			unsigned n = min(avail, stream.meta_left);
+			memcpy(stream.header + stream.header_len, stage_buf + stage_pos, n);
+			stream.meta_left -= n;
+			stream.header_len += n;
+			stage_pos += n;
+
+			if (stream.meta_left == 0) {
+				*(stream.header + stream.header_len) = '\0';
+				LOG_INFO("icy meta: len: %u\n%s", stream.header_len, stream.header);
+				stream.meta_send = true;
+				wake_controller();
+				stream.meta_next = stream.meta_interval;
+			}
+		}
+	}
+
+	return added;
+}
+
+// body bytes received in the same read as the end of headers are staged ahead of further reads, so they are
+// decoded along with the rest of the body once the headers are parsed - called with mutex locked
+static void _early_body(u8_t *data, unsigned len) {
+	memcpy(stage_buf, data, len);
+	stage_len = len;
+	stage_pos = 0;
+}
+
 static void _disconnect(stream_state state, disconnect_code disconnect) {
 	stream.state = state;
 	stream.disconnect = disconnect;
+	_ssl_close();
+	closesocket(fd);
+	fd = -1;
+	wake_controller();
+	wake_decode();
+}
+
+#if GZIP
+// inflate staged body into streambuf, returns bytes added - called with mutex locked
+static unsigned _inflate(void) {
+	unsigned space = min(_buf_space(fillbuf), _buf_cont_write(fillbuf));
+	unsigned added;
+	int ret;
+
+	if (!space) return 0;
+
+	zstrm.next_in = stage_buf + stage_pos;
+	zstrm.avail_in = stage_len - stage_pos;
+	zstrm.next_out = fillbuf->writep;
+	zstrm.avail_out = space;
+
+	ret = inflate(&zstrm, Z_NO_FLUSH);
+
+	stage_pos = stage_len - zstrm.avail_in;
+	added = space - zstrm.avail_out;
+	inflate_more = ret == Z_OK && !zstrm.avail_out;
+
+	_buf_inc_writep(fillbuf, added);
+	stream.bytes += added;
+
+	if (ret == Z_STREAM_END) {
+		// anything after the compressed data is not part of the stream
+		stage_pos = stage_len;
+	} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+		LOG_WARN("inflate error: %d %s", ret, zstrm.msg ? zstrm.msg : "");
+		_disconnect(DISCONNECT, LOCAL_DISCONNECT);
+	}
+
+	return added;
+}
+
+static void _inflate_end(void) {
+	if (inflating) {
+		inflateEnd(&zstrm);
+		inflating = false;
+	}
+	inflate_more = false;
+}
+#endif
+
+static void _pool_close(int i) {
+#if USE_SSL
+	if (pool[i].ssl) {
+		SSL_shutdown(pool[i].ssl);
+		SSL_free(pool[i].ssl);
+		pool[i].ssl = NULL;
+	}
+#endif
+	closesocket(pool[i].fd);
+	pool[i].fd = -1;
+}
+
+// idle connection to the server about to be requested, unless the server has closed it meanwhile
+// sets ssl for a tls connection - called with mutex locked
+static sockfd _pool_get(bool use_ssl) {
+	u32_t now = gettime_ms();
+	int i;
+
+	for (i = 0; i < POOL_SIZE; ++i) {
+		struct pollfd pollinfo = { pool[i].fd, POLLIN, 0 };
+		sockfd sock = pool[i].fd;
+
+		if (sock < 0) continue;
+
+		if (now - pool[i].since > POOL_IDLE) {
+			_pool_close(i);
+			continue;
+		}
+
+		if (pool[i].addr.sin_addr.s_addr != addr.sin_addr.s_addr || pool[i].addr.sin_port != addr.sin_port ||
+			strcmp(pool[i].host, host)) {
+			continue;
+		}
+
+#if USE_SSL
+		if ((pool[i].ssl != NULL) != use_ssl) continue;
+#else
+		if (use_ssl) continue;
+#endif
+
+		// nothing should arrive on an idle connection, readable means closed by the server
+		if (poll(&pollinfo, 1, 0) != 0) {
+			_pool_close(i);
+			continue;
+		}
+
+#if USE_SSL
+		ssl = pool[i].ssl;
+		ssl_ready = ssl != NULL;
+		pool[i].ssl = NULL;
+#endif
+		pool[i].fd = -1;
+
+		LOG_INFO("reusing connection to %s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+		return sock;
+	}
+
+	return -1;
+}
+
+// all of the body received, only known for a chunked or keep-alive response
+static bool _body_complete(void) {
+	if (chunked) return chunk_state == CHUNK_END;
+	return keep_alive && resume_total && !stream.meta_interval && stream.bytes >= resume_total;
+}
+
+// end of body on a keep-alive connection, park it for reuse instead of closing - called with mutex locked
+static void _disconnect_keep(void) {
+	int i, slot = 0;
+
+	for (i = 0; i < POOL_SIZE; ++i) {
+		if (pool[i].fd < 0) {
+			slot = i;
+			break;
+		}
+		if (pool[i].since < pool[slot].since) {
+			slot = i;
+		}
+	}
+	if (pool[slot].fd >= 0) {
+		_pool_close(slot);
+	}
+
+	LOG_INFO("end of body (%u bytes), keeping connection to %s:%d", stream.bytes, inet_ntoa(addr.sin_addr),
+			 ntohs(addr.sin_port));
+
+#if !WIN
+	// the next response headers may be shorter than the low water mark set for this body
+	if (rcv_lowat) {
+		set_recvlowat(fd, 1);
+		rcv_lowat = 0;
+	}
+#endif
+
+	pool[slot].fd = fd;
+#if USE_SSL
+	pool[slot].ssl = ssl;
+	ssl = NULL;
+	ssl_ready = false;
+#endif
+	pool[slot].addr = addr;
+	strcpy(pool[slot].host, host);
+	pool[slot].since = gettime_ms();
+
+	fd = -1;
+	stream.state = DISCONNECT;
+	stream.disconnect = DISCONNECT_OK;
+	wake_controller();
+	wake_decode();
+}
+
+// end of a body whose length is known, keep the connection if the response allows - called with mutex locked
+static void _body_end(void) {
+	if (keep_alive) {
+		_disconnect_keep();
+	} else {
+		LOG_INFO("end of body (%u bytes)", stream.bytes);
+		_disconnect(DISCONNECT, DISCONNECT_OK);
+	}
+}
+
+static void _disconnect_or_resume(disconnect_code disconnect);
+
+#if IOURING
+// io_uring engine - keeps reads in flight straight into streambuf for plain sockets and files which are not mapped
+// several file reads are queued each following on from the last, socket reads are one at a time behind a poll
+// as data arriving for a later recv could otherwise leave a gap; completions are committed in stream order
+// the ring is used with the mutex locked other than for the stream thread's wait for completions, so other threads
+// can cancel reads in flight with _uring_quiesce before closing fd or flushing or resizing streambuf
+#define URING_DEPTH  4
+#define URING_CHUNK  (64 * 1024)
+#define URING_WAKE   (URING_DEPTH)     // user data of stream_wake poll
+#define URING_POLL   (URING_DEPTH + 1) // user data of socket poll ahead of a recv
+#define URING_IGNORE (URING_DEPTH + 2) // user data of cancel requests
+#define URING_DATA(x) ((void *)(uintptr_t)(x))
+#define URING_QUIESCE_MS 1000          // cancelled reads are normally complete well within this
+
+static struct io_uring ring;
+static bool uring_ok;
+static struct {
+	unsigned len;
+	int res;
+	bool done;
+} slot[URING_DEPTH];
+static unsigned slot_head, slot_count;
+static u8_t *uring_end;               // end of streambuf area covered by reads in flight
+static bool uring_discard;            // results still in flight no longer follow on from writep
+static bool uring_ending;             // disconnect with uring_disconnect once reads in flight are reaped
+static disconnect_code uring_disconnect;
+static bool uring_wake_armed;
+
+static bool _uring_use(void) {
+	if (!uring_ok) return false;
+	if (stream.state == STREAMING_FILE) return !(fillbuf->flags & BUF_MAPPED);
+#if USE_SSL
+	if (ssl) return false;
+#endif
+	return (stream.state == STREAMING_BUFFERING || stream.state == STREAMING_HTTP) && !stream.meta_interval &&
+		!chunked && !inflating && stage_pos == stage_len && resume == RESUME_NONE;
+}
+
+// collect completions and commit finished reads into streambuf in stream order - called with mutex locked
+static void _uring_reap(void) {
+	struct io_uring_cqe *cqe;
+	unsigned head, seen = 0;
+
+	io_uring_for_each_cqe(&ring, head, cqe) {
+		uintptr_t data = (uintptr_t)io_uring_cqe_get_data(cqe);
+		if (data < URING_DEPTH) {
+			slot[data].res = cqe->res;
+			slot[data].done = true;
+		} else if (data == URING_WAKE) {
+			// consume the wake so the poll can be rearmed, unless wait_wake has already done so
+			struct pollfd pollinfo = { stream_wake, POLLIN, 0 };
+			uring_wake_armed = false;
+			if (poll(&pollinfo, 1, 0) > 0) {
+				wake_clear(stream_wake);
+			}
+		}
+		seen++;
+	}
+	io_uring_cq_advance(&ring, seen);
+
+	while (slot_count && slot[slot_head].done) {
+		int res = slot[slot_head].res;
+
+		slot[slot_head].done = false;
+
+		if (!uring_discard) {
+			if (res > 0) {
+				_buf_inc_writep(fillbuf, res);
+				stream.bytes += res;
+				LOG_SDEBUG("streambuf read %d bytes", res);
+			} else if (res == 0) {
+				LOG_INFO("end of stream (%u bytes)", stream.bytes);
+				uring_ending = true;
+				uring_disconnect = DISCONNECT_OK;
+			} else if (res != -EAGAIN && res != -EINTR && res != -ECANCELED) {
+				LOG_INFO("error reading: %s (%d)", strerror(-res), -res);
+				uring_ending = true;
+				uring_disconnect = REMOTE_DISCONNECT;
+			}
+			// anything short of the full read leaves later reads out of place, they are reissued
+			if (res != (int)slot[slot_head].len) {
+				uring_discard = true;
+			}
+		}
+
+		slot_head = (slot_head + 1) % URING_DEPTH;
+		slot_count--;
+	}
+
+	if (!slot_count) {
+		uring_discard = false;
+		uring_end = fillbuf->writep;
+		if (uring_ending) {
+			uring_ending = false;
+			_disconnect_or_resume(uring_disconnect);
+		} else if (stream.state != STREAMING_FILE && _body_complete()) {
+			_disconnect_keep();
+		}
+	}
+
+	if (stream.state == STREAMING_BUFFERING && stream.bytes > stream.threshold) {
+		stream.state = STREAMING_HTTP;
+		wake_controller();
+	}
+}
+
+// cancel reads in flight and wait until the kernel has finished with them - called with mutex locked
+static void _uring_cancel(void) {
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	u32_t start = gettime_ms();
+	unsigned n;
+
+	for (n = 0; n < slot_count; ++n) {
+		if ((sqe = io_uring_get_sqe(&ring)) == NULL) break;
+		io_uring_prep_cancel(sqe, URING_DATA((slot_head + n) % URING_DEPTH), 0);
+		io_uring_sqe_set_data(sqe, URING_DATA(URING_IGNORE));
+	}
+	// a recv linked behind a poll only starts once the poll completes
+	if ((sqe = io_uring_get_sqe(&ring)) != NULL) {
+		io_uring_prep_cancel(sqe, URING_DATA(URING_POLL), 0);
+		io_uring_sqe_set_data(sqe, URING_DATA(URING_IGNORE));
+	}
+	io_uring_submit(&ring);
+
+	uring_discard = true;
+	uring_ending = false;
+
+	// completions are waited for and reaped here, the stream thread's own wait only reaps once it has the mutex
+	while (slot_count) {
+		struct __kernel_timespec ts = { 0, 100 * 1000000 };
+		int res = io_uring_wait_cqe_timeout(&ring, &cqe, &ts);
+		if ((res < 0 && res != -ETIME) || gettime_ms() - start > URING_QUIESCE_MS) {
+			LOG_ERROR("unable to reap io_uring reads");
+			slot_count = 0;
+			break;
+		}
+		_uring_reap();
+	}
+}
+
+// keep reads in flight in free streambuf space, wait for completions, a wake or timeout and commit what completed
+// called with mutex locked, returns with it unlocked
+static void _uring_run(size_t space) {
+	struct __kernel_timespec ts = { 0, 100 * 1000000 };
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	bool file = stream.state == STREAMING_FILE;
+
+	if (!slot_count) {
+		uring_end = fillbuf->writep;
+	}
+
+	while (slot_count < (file ? URING_DEPTH : 1) && !uring_discard && !uring_ending && io_uring_sq_space_left(&ring) >= 2) {
+		size_t covered = uring_end - fillbuf->writep;
+		unsigned len = space > covered ? min(space - covered, URING_CHUNK) : 0;
+		unsigned i = (slot_head + slot_count) % URING_DEPTH;
+
+		// a keep-alive body is not read past its end
+		if (keep_alive && resume_total) {
+			len = stream.bytes + covered < resume_total ? min(len, resume_total - stream.bytes - covered) : 0;
+		}
+
+		if (!len) break;
+
+		if (file) {
+			sqe = io_uring_get_sqe(&ring);
+			io_uring_prep_read(sqe, fd, uring_end, len, stream.bytes + covered);
+		} else {
+			// socket is non blocking so have the kernel wait for data before the recv
+			sqe = io_uring_get_sqe(&ring);
+			io_uring_prep_poll_add(sqe, fd, POLLIN);
+			io_uring_sqe_set_data(sqe, URING_DATA(URING_POLL));
+			sqe->flags |= IOSQE_IO_LINK;
+			sqe = io_uring_get_sqe(&ring);
+			io_uring_prep_recv(sqe, fd, uring_end, len, 0);
+		}
+		io_uring_sqe_set_data(sqe, URING_DATA(i));
+
+		slot[i].len = len;
+		slot[i].done = false;
+		uring_end += len;
+		slot_count++;
+	}
+
+	// wake on stream_wake as well as completions
+	if (!uring_wake_armed && (sqe = io_uring_get_sqe(&ring)) != NULL) {
+		io_uring_prep_poll_add(sqe, stream_wake, POLLIN);
+		io_uring_sqe_set_data(sqe, URING_DATA(URING_WAKE));
+		uring_wake_armed = true;
+	}
+
+	io_uring_submit(&ring);
+
+	UNLOCK;
+
+	io_uring_wait_cqe_timeout(&ring, &cqe, &ts);
+
+	LOCK;
+	_uring_reap();
+	UNLOCK;
+}
+
+// called with mutex locked by threads other than the stream thread to have any reads in flight cancelled
+static void _uring_quiesce(void) {
+	if (slot_count) {
+		_uring_cancel();
+	}
+}
+#endif
+
+static int _socket_new(void) {
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (sock < 0) {
+		LOG_ERROR("failed to create socket");
+		return -1;
+	}
+
+	LOG_INFO("connecting to %s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+	set_nonblock(sock);
+	set_nosigpipe(sock);
+	set_recvbufsize(sock);
+
+	return sock;
+}
+
+#if USE_SSL
+// the handshake is driven by the stream thread as the socket becomes ready, see _handshake
+static void _ssl_start(int sock) {
+	int i;
+
+	ssl = SSL_new(SSLctx);
+	SSL_set_fd(ssl, sock);
+
+	// add SNI
+	if (*host) SSL_set_tlsext_host_name(ssl, host);
+
+	if ((i = _ssl_cache_find(false)) >= 0) {
+		SSL_set_session(ssl, ssl_cache[i].session);
+		ssl_cache[i].used = gettime_ms();
+	}
+
+	ssl_ready = false;
+	handshake_events = POLLOUT;
+	handshake_start = gettime_ms();
+}
+#endif
+
+static int connect_socket(bool use_ssl) {
+	int sock = _socket_new();
+
+	if (sock < 0) {
+		return -1;
+	}
+
+	if (connect_timeout(sock, (struct sockaddr *) &addr, sizeof(addr), 10) < 0) {
+		LOG_INFO("unable to connect to server");
+		closesocket(sock);
+		return -1;
+	}
+
+#if USE_SSL
+	if (use_ssl) {
+		_ssl_start(sock);
+	}
+#endif
+
+	return sock;
+}
+
+// keep the request so an interrupted body can be fetched again from where it stopped, only plain GET requests are
+// kept and any range the server asked for becomes the base for resumed ranges
+static void _resume_store(const char *header, size_t header_len, bool use_ssl) {
+	const char *line = header, *end = header + header_len;
+
+	resume = RESUME_NONE;
+	resume_tries = 0;
+	resume_base = 0;
+	resume_total = 0;
+	resume_req_len = 0;
+	resume_ssl = use_ssl;
+
+	if (!resume_req || header_len < 4 || header_len >= MAX_HEADER || strncmp(header, "GET ", 4)) {
+		return;
+	}
+
+	while (line < end) {
+		const char *next = memchr(line, '\n', end - line);
+		next = next ? next + 1 : end;
+		if (!strncasecmp(line, "Range:", 6)) {
+			sscanf(line + 6, " bytes=" FMT_u64 "-", &resume_base);
+		} else {
+			memcpy(resume_req + resume_req_len, line, next - line);
+			resume_req_len += next - line;
+		}
+		line = next;
+	}
+
+	if (resume_req_len < 4 || memcmp(resume_req + resume_req_len - 4, "\r\n\r\n", 4)) {
+		resume_req_len = 0;
+	}
+}
+
+// true if the response header field name is present and its value includes token
+static bool _header_has(const char *name, const char *token) {
+	const char *p = strcasestr(stream.header, name);
+	size_t len = strlen(token);
+
+	if (!p) return false;
+
+	for (p += strlen(name); *p && *p != '\r' && *p != '\n'; ++p) {
+		if (!strncasecmp(p, token, len)) return true;
+	}
+	return false;
+}
+
+// response headers received, note the body length to spot an early close or the end of a keep-alive body and set
+// up decoding of any transfer or content encoding of the body - called with mutex locked
+static void _resume_headers(void) {
+	char *p = strcasestr(stream.header, "Content-Length:");
+	bool encoded = false;
+
+	resume_total = 0;
+	if (p) {
+		sscanf(p + 15, FMT_u64, &resume_total);
+	}
+
+	chunked = _header_has("Transfer-Encoding:", "chunked");
+	chunk_state = CHUNK_SIZE;
+	chunk_left = 0;
+
+	if (_header_has("Content-Encoding:", "gzip") || _header_has("Content-Encoding:", "deflate")) {
+#if GZIP
+		_inflate_end();
+		memset(&zstrm, 0, sizeof(zstrm));
+		// window bits of 15 + 32 accepts either a gzip or zlib header
+		if (inflateInit2(&zstrm, 15 + 32) == Z_OK) {
+			inflating = true;
+			LOG_INFO("inflating content encoded stream");
+		} else {
+			LOG_WARN("unable to inflate content encoded stream");
+		}
+#else
+		LOG_WARN("content encoded stream not supported");
+#endif
+		encoded = true;
+	}
+
+	// http/1.1 is persistent unless closed, http/1.0 only if asked to be
+	if (!strncmp(stream.header, "HTTP/1.0", 8)) {
+		keep_alive = strcasestr(stream.header, "Connection: keep-alive") != NULL;
+	} else {
+		keep_alive = strcasestr(stream.header, "Connection: close") == NULL;
+	}
+
+	// the length and ranges of an encoded body do not match the decoded bytes counted in stream.bytes, and a range
+	// response would bring framing of its own, so these are read to the end without resuming
+	if (chunked || encoded) {
+		resume_total = 0;
+		resume_req_len = 0;
+	}
+	keep_alive = keep_alive && !encoded &&
+		(chunked || (resume_total && !strcasestr(stream.header, "Transfer-Encoding:")));
+	reused = false;
+
+	// body bytes received with the headers were staged before the framing was known
+	if (chunked && stage_len) {
+		stage_len = _dechunk(stage_buf, stage_len);
+	}
+}
+
+// start resuming the body if possible, otherwise disconnect - called with mutex locked
+static void _disconnect_or_resume(disconnect_code disconnect) {
+	bool early_close = disconnect == DISCONNECT_OK && resume_total && stream.bytes < resume_total;
+	u32_t delay;
+
+	if ((disconnect == DISCONNECT_OK && !early_close) || !resume_req_len || stream.meta_interval ||
+		(stream.state != STREAMING_BUFFERING && stream.state != STREAMING_HTTP) || resume_tries >= RESUME_TRIES) {
+		_disconnect(DISCONNECT, disconnect);
+		return;
+	}
+
+	_ssl_close();
+	closesocket(fd);
+	fd = -1;
+
+	delay = RESUME_BACKOFF << resume_tries++;
+	resume = RESUME_WAIT;
+	resume_at = gettime_ms() + delay;
+	stage_len = stage_pos = 0;
+
+	LOG_WARN("stream interrupted at " FMT_u64 " bytes, resuming in %u ms (try %u of %u)", stream.bytes, delay,
+			 resume_tries, RESUME_TRIES);
+}
+
+// start reconnecting once the backoff has passed, the connect completes in the poll loop so the mutex is not
+// held while waiting for the server - called with mutex locked as slimproto may disconnect meanwhile
+static void _resume_connect(void) {
+	int sock = _socket_new();
+
+	if (sock >= 0 && connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+#if !WIN
+		if (last_error() != EINPROGRESS) {
+#else
+		if (last_error() != WSAEWOULDBLOCK) {
+#endif
+			closesocket(sock);
+			sock = -1;
+		}
+	}
+
+	if (sock < 0) {
+		LOG_INFO("unable to connect to server");
+		resume = RESUME_NONE;
+		_disconnect_or_resume(REMOTE_DISCONNECT);
+		return;
+	}
+
+	fd = sock;
+	resume = RESUME_CONNECT;
+	resume_at = gettime_ms() + RESUME_CONNECT_TIMEOUT;
+}
+
+// the socket of a resume connect has become writable or failed - called with mutex locked
+static void _resume_connected(void) {
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&error, &len);
+	if (error) {
+		LOG_INFO("unable to connect to server: %s", strerror(error));
+		resume = RESUME_NONE;
+		_disconnect_or_resume(REMOTE_DISCONNECT);
+		return;
+	}
+
+#if USE_SSL
+	if (resume_ssl) {
+		_ssl_start(fd);
+	}
+#endif
+
+	resume = RESUME_SEND;
+	resume_len = 0;
+}
+
+static void _resume_send(void) {
+	char req[MAX_HEADER + 64];
+	int len = resume_req_len - 2; // ahead of the blank line ending the request
+
+	memcpy(req, resume_req, len);
+	len += sprintf(req + len, "Range: bytes=" FMT_u64 "-\r\n\r\n", resume_base + stream.bytes);
+
+	LOG_DEBUG("resume request: %.*s", len, req);
+
+	if (send_header(req, len)) {
+		resume = RESUME_RECV;
+	}
+}
+
+// read the response to the range request, only a partial content response starting at the requested offset
+// is accepted and any body bytes read with it are staged ahead of further reads - called with mutex locked
+static void _resume_recv(void) {
+	u64_t from = 0;
+	char *end;
+	int n = _recv(fd, resume_buf + resume_len, MAX_HEADER - 1 - resume_len, 0);
+
+	if (n <= 0) {
+		if (n < 0 && _last_error() == ERROR_WOULDBLOCK) return;
+		resume = RESUME_NONE;
+		_disconnect_or_resume(REMOTE_DISCONNECT);
+		return;
+	}
+
+	resume_len += n;
+	resume_buf[resume_len] = '\0';
+
+	if ((end = strstr(resume_buf, "\r\n\r\n")) == NULL) {
+		if (resume_len >= MAX_HEADER - 1) {
+			LOG_WARN("resume response headers too long");
+			resume = RESUME_NONE;
+			_disconnect(DISCONNECT, REMOTE_DISCONNECT);
+		}
+		return;
+	}
+	end += 4;
+
+	resume = RESUME_NONE;
+
+	if (!strstr(resume_buf, " 206 ") || !strcasestr(resume_buf, "Content-Range:") ||
+		sscanf(strcasestr(resume_buf, "Content-Range:") + 14, " bytes " FMT_u64 "-", &from) != 1 ||
+		from != resume_base + stream.bytes) {
+		LOG_WARN("server did not resume at " FMT_u64 ", ending stream", resume_base + stream.bytes);
+		_disconnect(DISCONNECT, REMOTE_DISCONNECT);
+		return;
+	}
+
+	LOG_INFO("stream resumed at " FMT_u64 " bytes", stream.bytes);
+
+	resume_tries = 0;
+	stage_len = resume_buf + resume_len - end;
+	stage_pos = 0;
+	memcpy(stage_buf, end, stage_len);
+}
+
 #if USE_SSL
-	if (ssl) {
-		SSL_shutdown(ssl);
-		SSL_free(ssl);
-		ssl = NULL;
+// step the handshake of a new connection or a resume, on failure fall back to a plain socket if ssl was only tried
+// because of the port, otherwise end the stream - called with mutex locked
+static void _handshake_step(void) {
+	int sock, res = _handshake();
+
+	if (res == 0) return;
+
+	if (res > 0) {
+		// a resume carries on in RESUME_SEND
+		if (stream.state == TLS_HANDSHAKE) {
+			stream.state = SEND_HEADERS;
+		}
+		return;
 	}
-#endif
-	closesocket(fd);
-	fd = -1;
-	wake_controller();
-}
 
-static int connect_socket(bool use_ssl) {
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	SSL_free(ssl);
+	ssl = NULL;
 
-	if (sock < 0) {
-		LOG_ERROR("failed to create socket");
-		return -1;
+	if (resume != RESUME_NONE) {
+		resume = RESUME_NONE;
+		_disconnect_or_resume(REMOTE_DISCONNECT);
+		return;
 	}
 
-	LOG_INFO("connecting to %s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+	if (ssl_fallback) {
+		ssl_fallback = false;
+		closesocket(fd);
+		fd = -1;
+		LOG_INFO("now attempting without SSL");
+		if ((sock = connect_socket(false)) >= 0) {
+			fd = sock;
+			stream.state = SEND_HEADERS;
+			return;
+		}
+	}
 
-	set_nonblock(sock);
-	set_nosigpipe(sock);
-	set_recvbufsize(sock);
+	_disconnect(DISCONNECT, UNREACHABLE);
+}
+#endif
 
-	if (connect_timeout(sock, (struct sockaddr *) &addr, sizeof(addr), 10) < 0) {
-		LOG_INFO("unable to connect to server");
-		closesocket(sock);
-		return -1;
+#if !WIN
+// the end of a keep-alive body is not followed by a close, so lowat must not exceed what is left of the body
+// or the last of it never polls as readable, and is kept at the default when the length is not known
+static unsigned _lowat_limit(unsigned lowat) {
+	if (keep_alive) {
+		if (chunked || !resume_total) return 1;
+		if (stream.bytes + lowat > resume_total) {
+			return resume_total > stream.bytes ? (unsigned)(resume_total - stream.bytes) : 1;
+		}
+	}
+	return lowat;
+}
+#endif
+
+// sample the stream rate and size socket receive for it - called with mutex locked after each read from the socket
+static void _rate_update(void) {
+	u32_t now = gettime_ms();
+	u32_t elapsed = now - rate_at;
+
+	if (fd != rate_fd) {
+		// new connection for this stream, its receive options are at the defaults
+		rate_fd = fd;
+		rate_at = now;
+		rate_bytes = stream.bytes;
+		rcv_lowat = 0;
+		return;
 	}
 
-#if USE_SSL
-	if (use_ssl) {
-		ssl = SSL_new(SSLctx);
-		SSL_set_fd(ssl, sock);
+#if !WIN
+	if (rcv_lowat > 1 && _lowat_limit(rcv_lowat) < rcv_lowat) {
+		rcv_lowat = _lowat_limit(rcv_lowat);
+		set_recvlowat(fd, rcv_lowat);
+	}
+#endif
 
-		// add SNI
-		if (*host) SSL_set_tlsext_host_name(ssl, host);
+	if (elapsed < RATE_MS) return;
 
-		while (1) {
-			int status, err = 0;
+	// reads are paced by the decoder once streambuf is full, so this settles on the stream bitrate
+	rate = rate ? (u32_t)(((u64_t)rate * 3 + (stream.bytes - rate_bytes) * 1000 / elapsed) / 4) :
+				  (u32_t)((stream.bytes - rate_bytes) * 1000 / elapsed);
+	rate_at = now;
+	rate_bytes = stream.bytes;
 
-			ERR_clear_error();
-			status = SSL_connect(ssl);
+	read_chunk = min((u64_t)rate * READ_MS / 1000, READ_MAX);
+	if (read_chunk < READ_MIN) read_chunk = READ_MIN;
 
-			// successful negotiation
-			if (status == 1) break;
+#if !WIN
+	{
+		int rcvbuf = min((u64_t)rate * RCVBUF_MS / 1000, RCVBUF_MAX);
+		unsigned lowat;
 
-			// error or non-blocking requires more time
-			if (status < 0) {
-				err = SSL_get_error(ssl, status);
-				if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
-					usleep(1000);
-					continue;
-				}
-			}
+		rcvbuf = set_recvbufmin(fd, rcvbuf < RCVBUF_MIN ? RCVBUF_MIN : rcvbuf);
+		lowat = min((u64_t)rate * RCVLOWAT_MS / 1000, min(RCVLOWAT_MAX, rcvbuf / 4));
 
-			LOG_WARN("unable to open SSL socket %d (%d)", status, err);
-			closesocket(sock);
-			SSL_free(ssl);
-			ssl = NULL;
+		if (!lowat) lowat = 1;
+		lowat = _lowat_limit(lowat);
 
-			return -1;
+		if (lowat > rcv_lowat * 5 / 4 || lowat < rcv_lowat * 3 / 4) {
+			set_recvlowat(fd, lowat);
+			rcv_lowat = lowat;
+			LOG_DEBUG("stream rate: %u bytes/s rcvbuf: %d lowat: %u read: %u", rate, rcvbuf, lowat, (unsigned)read_chunk);
 		}
 	}
 #endif
-
-	return sock;
 }
 
 static void *stream_thread() {
+#if LINUX
+	char placed[128];
+	LOG_INFO("thread %s", thread_place("stream", placed, sizeof(placed)));
+#endif
+
 	while (running) {
 
 		struct pollfd pollinfo;
-		size_t space;
+		size_t space, want;
 
 		LOCK;
 
@@ -234,23 +1309,92 @@ static void *stream_thread() {
 		}
 #endif
 
-		space = min(_buf_space(streambuf), _buf_cont_write(streambuf));
+#if IOURING
+		if (slot_count && fd < 0) {
+			_uring_cancel();
+		}
+#endif
+
+		// reconnect an interrupted stream once its backoff has passed
+		if (resume == RESUME_WAIT) {
+			s32_t wait = resume_at - gettime_ms();
+			if (wait > 0) {
+				UNLOCK;
+				wait_wake(stream_wake, wait);
+				continue;
+			}
+			_resume_connect();
+		}
+
+		if (resume == RESUME_CONNECT && (s32_t)(gettime_ms() - resume_at) > 0) {
+			LOG_INFO("unable to connect to server: timed out");
+			resume = RESUME_NONE;
+			_disconnect_or_resume(REMOTE_DISCONNECT);
+		}
+
+		space = min(_buf_space(fillbuf), _buf_cont_write(fillbuf));
+		want = min(read_chunk, fillbuf->size / 2);
+
+#if LINUX || OSX || FREEBSD
+		if (fillbuf->flags & BUF_MAPPED) {
+			// mapped file is published no further ahead of the decoder than the allocated streambuf would hold
+			size_t ahead = _buf_used(fillbuf);
+			space = 0;
+			if (ahead < fillbuf->base_size) {
+				space = min(fillbuf->base_size - ahead, (size_t)(fillbuf->wrap - 1 - fillbuf->writep));
+			} else {
+				want = fillbuf->size - 1 - fillbuf->base_size + min(STREAM_WAKE_SPACE, fillbuf->base_size / 2);
+			}
+		}
+#endif
 
 		if (fd < 0 || !space || stream.state <= STREAMING_WAIT) {
+			// sleep until a stream is opened, cont is received or the decoder frees some space in streambuf
+			// each of which signals stream_wake, timeout is only a safety net
+			if (fd >= 0 && !space && stream.state > STREAMING_WAIT && _buf_want_write(fillbuf, want)) {
+				UNLOCK;
+				continue;
+			}
 			UNLOCK;
-			usleep(100000);
+			wait_wake(stream_wake, 1000);
+			continue;
+		}
+
+#if IOURING
+		if (slot_count || _uring_use()) {
+			_uring_run(space);
 			continue;
 		}
+#endif
 
 		if (stream.state == STREAMING_FILE) {
 
-			int n = read(fd, streambuf->writep, space);
+			int n;
+
+#if LINUX || OSX || FREEBSD
+			if (fillbuf->flags & BUF_MAPPED) {
+				// no copy, make the next part of the file visible to the decoder and have the kernel start reading it
+				uintptr_t page = (uintptr_t)fillbuf->writep & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+				madvise((void *)page, fillbuf->writep + space - (u8_t *)page, MADV_WILLNEED);
+				_buf_inc_writep(fillbuf, space);
+				stream.bytes += space;
+				LOG_SDEBUG("streambuf mapped %u bytes", (unsigned)space);
+				if (fillbuf->writep == fillbuf->wrap - 1) {
+					LOG_INFO("end of stream");
+					_disconnect(DISCONNECT, DISCONNECT_OK);
+				}
+				UNLOCK;
+				continue;
+			}
+#endif
+
+			n = read(fd, fillbuf->writep, space);
 			if (n == 0) {
 				LOG_INFO("end of stream");
 				_disconnect(DISCONNECT, DISCONNECT_OK);
 			}
 			if (n > 0) {
-				_buf_inc_writep(streambuf, n);
+				_buf_inc_writep(fillbuf, n);
 				stream.bytes += n;
 				LOG_SDEBUG("streambuf read %d bytes", n);
 			}
@@ -266,14 +1410,24 @@ static void *stream_thread() {
 
 			pollinfo.fd = fd;
 			pollinfo.events = POLLIN;
-			if (stream.state == SEND_HEADERS) {
+			if (stream.state == SEND_HEADERS || resume == RESUME_CONNECT || resume == RESUME_SEND) {
 				pollinfo.events |= POLLOUT;
 			}
+#if USE_SSL
+			if (ssl && !ssl_ready) {
+				pollinfo.events = handshake_events;
+			}
+#endif
 		}
 
 		UNLOCK;
 
-		if (_poll(&pollinfo, 100)) {
+		// staged body bytes are available without polling
+		if (stage_pos < stage_len) {
+			pollinfo.revents = POLLIN;
+		}
+
+		if (stage_pos < stage_len || _poll(&pollinfo, 100)) {
 
 			LOCK;
 
@@ -283,30 +1437,75 @@ static void *stream_thread() {
 				continue;
 			}
 
+#if USE_SSL
+			if (ssl && !ssl_ready) {
+				_handshake_step();
+				UNLOCK;
+				continue;
+			}
+#endif
+
 			if ((pollinfo.revents & POLLOUT) && stream.state == SEND_HEADERS) {
-				if (send_header()) stream.state = RECV_HEADERS;
+				if (send_header(stream.header, stream.header_len)) stream.state = RECV_HEADERS;
 				header_mlen = stream.header_len;
 				stream.header_len = 0;
 				UNLOCK;
 				continue;
 			}
+
+			// connect, range request and response of a resumed stream
+			if (resume == RESUME_CONNECT || resume == RESUME_SEND || resume == RESUME_RECV) {
+				if (resume == RESUME_CONNECT && (pollinfo.revents & (POLLOUT | POLLERR | POLLHUP))) {
+					_resume_connected();
+				} else if (resume == RESUME_SEND && (pollinfo.revents & POLLOUT)) {
+					_resume_send();
+				} else if (resume == RESUME_RECV && (pollinfo.revents & (POLLIN | POLLHUP))) {
+					_resume_recv();
+				}
+				UNLOCK;
+				continue;
+			}
 					
 			if (pollinfo.revents & (POLLIN | POLLHUP)) {
 
 				// get response headers
 				if (stream.state == RECV_HEADERS) {
 
-					// read one byte at a time to catch end of header
-					char c;
+					// read what is available and scan for the end of header
 					static int endtok;
+					char *ptr, *end;
 
-					int n = _recv(fd, &c, 1, 0);
+					int n = _recv(fd, stream.header + stream.header_len, MAX_HEADER - 1 - stream.header_len, 0);
 					if (n <= 0) {
 						if (n < 0 && _last_error() == ERROR_WOULDBLOCK) {
 							UNLOCK;
 							continue;
 						}
 						LOG_INFO("error reading headers: %s", n ? strerror(last_error()) : "closed");
+
+						// the server closed the idle connection just as it was reused, connect afresh
+						if (reused && !stream.header_len) {
+							int sock;
+#if USE_SSL
+							bool use_ssl = ssl != NULL;
+#else
+							bool use_ssl = false;
+#endif
+							_ssl_close();
+							closesocket(fd);
+							fd = -1;
+							reused = false;
+							stream.header_len = header_mlen;
+
+							sock = connect_socket(use_ssl);
+
+							if (sock >= 0) {
+								fd = sock;
+								stream.state = use_ssl ? TLS_HANDSHAKE : SEND_HEADERS;
+								UNLOCK;
+								continue;
+							}
+						}
 #if USE_SSL
 						if (!ssl && !stream.header_len) {
 							int sock;
@@ -320,7 +1519,9 @@ static void *stream_thread() {
 						
 							if (sock >= 0) {
 								fd = sock;
-								stream.state = SEND_HEADERS;
+								resume_ssl = true;
+								ssl_fallback = false;
+								stream.state = TLS_HANDSHAKE;
 								UNLOCK;
 								continue;
 							}
@@ -331,78 +1532,86 @@ static void *stream_thread() {
 						continue;
 					}
 
-					*(stream.header + stream.header_len) = c;
-					stream.header_len++;
-
-					if (stream.header_len > MAX_HEADER - 1) {
-						LOG_ERROR("received headers too long: %u", stream.header_len);
-						_disconnect(DISCONNECT, LOCAL_DISCONNECT);
+					end = stream.header + stream.header_len + n;
+					for (ptr = stream.header + stream.header_len; ptr < end && endtok < 4; ++ptr) {
+						if (ptr > stream.header && (*ptr == '\r' || *ptr == '\n')) {
+							endtok++;
+						} else {
+							endtok = 0;
+						}
 					}
 
-					if (stream.header_len > 1 && (c == '\r' || c == '\n')) {
-						endtok++;
-						if (endtok == 4) {
-							*(stream.header + stream.header_len) = '\0';
-							LOG_INFO("headers: len: %d\n%s", stream.header_len, stream.header);
-							stream.state = stream.cont_wait ? STREAMING_WAIT : STREAMING_BUFFERING;
-							wake_controller();
+					if (endtok == 4) {
+						// body bytes which arrived in the same read are kept before the header is terminated
+						if (ptr < end) {
+							_early_body((u8_t *)ptr, end - ptr);
 						}
-					} else {
 						endtok = 0;
+						stream.header_len = ptr - stream.header;
+						*(stream.header + stream.header_len) = '\0';
+						LOG_INFO("headers: len: %d\n%s", stream.header_len, stream.header);
+						_resume_headers();
+						stream.state = stream.cont_wait ? STREAMING_WAIT : STREAMING_BUFFERING;
+						wake_controller();
+					} else {
+						stream.header_len += n;
+						if (stream.header_len >= MAX_HEADER - 1) {
+							LOG_ERROR("received headers too long: %u", stream.header_len);
+							_disconnect(DISCONNECT, LOCAL_DISCONNECT);
+						}
 					}
 				
 					UNLOCK;
 					continue;
 				}
 				
-				// receive icy meta data
-				if (stream.meta_interval && stream.meta_next == 0) {
+				// icy and content encoded streams are read in large chunks into the staging area and demultiplexed or
+				// inflated from there
+				if (stream.meta_interval || inflating) {
+					unsigned added;
 
-					if (stream.meta_left == 0) {
-						// read meta length
-						u8_t c;
-						int n = _recv(fd, &c, 1, 0);
+					if (stage_pos == stage_len && !inflate_more) {
+						int n = _recv(fd, stage_buf, STAGE_SIZE, 0);
 						if (n <= 0) {
-							if (n < 0 && _last_error() == ERROR_WOULDBLOCK) {
+							int error = n ? _last_error() : 0;
+							if (n < 0 && error == ERROR_WOULDBLOCK) {
 								UNLOCK;
 								continue;
 							}
-							LOG_INFO("error reading icy meta: %s", n ? strerror(last_error()) : "closed");
-							_disconnect(STOPPED, LOCAL_DISCONNECT);
+							if (stream.meta_interval && !inflating && stream.meta_next == 0) {
+								// the read was for a meta block, failing that stops the stream as a local disconnect
+								LOG_INFO("error reading icy meta: %s", n ? strerror(error) : "closed");
+								_disconnect(STOPPED, LOCAL_DISCONNECT);
+							} else if (n == 0) {
+								LOG_INFO("end of stream (%u bytes)", stream.bytes);
+								_disconnect(DISCONNECT, DISCONNECT_OK);
+							} else {
+								LOG_INFO("error reading: %s (%d)", strerror(error), error);
+								_disconnect(DISCONNECT, REMOTE_DISCONNECT);
+							}
 							UNLOCK;
 							continue;
 						}
-						stream.meta_left = 16 * c;
-						stream.header_len = 0; // amount of received meta data
-						// MAX_HEADER must be more than meta max of 16 * 255
+						stage_len = chunked ? _dechunk(stage_buf, n) : n;
+						stage_pos = 0;
+						_rate_update();
 					}
 
-					if (stream.meta_left) {
-						int n = _recv(fd, stream.header + stream.header_len, stream.meta_left, 0);
-						if (n <= 0) {
-							if (n < 0 && _last_error() == ERROR_WOULDBLOCK) {
-								UNLOCK;
-								continue;
-							}
-							LOG_INFO("error reading icy meta: %s", n ? strerror(last_error()) : "closed");
-							_disconnect(STOPPED, LOCAL_DISCONNECT);
-							UNLOCK;
-							continue;
-						}
-						stream.meta_left -= n;
-						stream.header_len += n;
+#if GZIP
+					added = inflating ? _inflate() : _icy_demux();
+#else
+					added = _icy_demux();
+#endif
+
+					if (stream.state == STREAMING_BUFFERING && stream.bytes > stream.threshold) {
+						stream.state = STREAMING_HTTP;
+						wake_controller();
 					}
-					
-					if (stream.meta_left == 0) {
-						if (stream.header_len) {
-							*(stream.header + stream.header_len) = '\0';
-							LOG_INFO("icy meta: len: %u\n%s", stream.header_len, stream.header);
-							stream.meta_send = true;
-							wake_controller();
-						}
-						stream.meta_next = stream.meta_interval;
-						UNLOCK;
-						continue;
+
+					LOG_SDEBUG("streambuf read %u bytes, staged %u", added, stage_len - stage_pos);
+
+					if (fd >= 0 && stage_pos == stage_len && !inflate_more && _body_complete()) {
+						_body_end();
 					}
 
 				// stream body into streambuf
@@ -410,31 +1619,29 @@ static void *stream_thread() {
 					int n;
 					int error;
 
-					space = min(_buf_space(streambuf), _buf_cont_write(streambuf));
-					if (stream.meta_interval) {
-						space = min(space, stream.meta_next);
+					space = min(_buf_space(fillbuf), _buf_cont_write(fillbuf));
+					if (keep_alive && resume_total) {
+						space = min(space, resume_total - stream.bytes);
 					}
 					
-					n = _recv(fd, streambuf->writep, space, 0);
-					if (n == 0) {
+					n = _recv_body(fillbuf->writep, space);
+					if (n == 0 && !_body_complete()) {
 						LOG_INFO("end of stream (%u bytes)", stream.bytes);
-						_disconnect(DISCONNECT, DISCONNECT_OK);
+						_disconnect_or_resume(DISCONNECT_OK);
 					}
 					if (n < 0) {
 						error = _last_error();
 						if (error != ERROR_WOULDBLOCK) {
 							LOG_INFO("error reading: %s (%d)", strerror(error), error);
-							_disconnect(DISCONNECT, REMOTE_DISCONNECT);
+							_disconnect_or_resume(REMOTE_DISCONNECT);
 						}
 					}
 					
 					if (n > 0) {
-						_buf_inc_writep(streambuf, n);
+						_buf_inc_writep(fillbuf, n);
 						stream.bytes += n;
-						if (stream.meta_interval) {
-							stream.meta_next -= n;
-						}
-					} else {
+						_rate_update();
+					} else if (n < 0 || !_body_complete()) {
 						UNLOCK;
 						continue;
 					}
@@ -445,6 +1652,11 @@ static void *stream_thread() {
 					}
 				
 					LOG_SDEBUG("streambuf read %d bytes", n);
+
+					// checked once the last of the body is read as the server sends nothing further to poll for
+					if (_body_complete()) {
+						_body_end();
+					}
 				}
 			}
 
@@ -453,10 +1665,27 @@ static void *stream_thread() {
 		} else {
 			
 			LOG_SDEBUG("poll timeout");
+#if USE_SSL
+			// let a stalled handshake time out
+			LOCK;
+			if (fd >= 0 && ssl && !ssl_ready) {
+				_handshake_step();
+			}
+			UNLOCK;
+#endif
 		}
 	}
 	
+#if IOURING
+	LOCK;
+	if (slot_count) {
+		_uring_cancel();
+	}
+	UNLOCK;
+#endif
+
 #if USE_SSL	
+	_ssl_cache_clear();
 	if (SSLctx) {
 		SSL_CTX_free(SSLctx);
 	}	
@@ -468,16 +1697,21 @@ static void *stream_thread() {
 static thread_type thread;
 
 void stream_init(log_level level, unsigned stream_buf_size) {
+	int i;
+
 	loglevel = level;
 
 	LOG_INFO("init stream");
 	LOG_DEBUG("streambuf size: %u", stream_buf_size);
 
-	buf_init(streambuf, stream_buf_size);
+	// mirror streambuf where possible so codecs always see contiguous data across wrap
+	buf_init(streambuf, stream_buf_size, BUF_MIRROR);
 	if (streambuf->buf == NULL) {
 		LOG_ERROR("unable to malloc buffer");
 		exit(0);
 	}
+	LOG_DEBUG("streambuf %s: %u", streambuf->flags & BUF_MIRROR ? "mirrored" : "not mirrored", streambuf->size);
+	LOG_INFO("streambuf backing: %s", mem_backing(streambuf->mem));
 	
 #if USE_SSL
 #if !LINKALL && !NO_SSLSYM
@@ -502,9 +1736,27 @@ void stream_init(log_level level, unsigned stream_buf_size) {
 	stream.state = STOPPED;
 	stream.header = malloc(MAX_HEADER);
 	*stream.header = '\0';
+	resume_req = malloc(MAX_HEADER);
 
 	fd = -1;
 
+	for (i = 0; i < POOL_SIZE; ++i) {
+		pool[i].fd = -1;
+	}
+
+	wake_create(stream_wake);
+	streambuf->wake_writer = &stream_wake;
+
+#if IOURING
+	uring_ok = io_uring_queue_init(4 * URING_DEPTH, &ring, 0) == 0;
+	// waits with a timeout must not submit, as threads other than the stream thread wait to cancel reads
+	if (uring_ok && !(ring.features & IORING_FEAT_EXT_ARG)) {
+		io_uring_queue_exit(&ring);
+		uring_ok = false;
+	}
+	LOG_INFO("stream io: %s", uring_ok ? "io_uring" : "poll");
+#endif
+
 #if LINUX || FREEBSD
 	touch_memory(streambuf->buf, streambuf->size);
 #endif
@@ -530,19 +1782,109 @@ void stream_init(log_level level, unsigned stream_buf_size) {
 }
 
 void stream_close(void) {
+	int i;
+
 	LOG_INFO("close stream");
 	LOCK;
 	running = false;
+	for (i = 0; i < POOL_SIZE; ++i) {
+		if (pool[i].fd >= 0) {
+			_pool_close(i);
+		}
+	}
 	UNLOCK;
+	wake_stream();
 #if LINUX || OSX || FREEBSD
 	pthread_join(thread, NULL);
 #endif
+#if IOURING
+	if (uring_ok) {
+		io_uring_queue_exit(&ring);
+	}
+#endif
+	wake_close(stream_wake);
 	free(stream.header);
+	free(resume_req);
+#if GZIP
+	_inflate_end();
+#endif
+	buf_destroy(&nextbuf);
 	buf_destroy(streambuf);
 }
 
+// called from other threads when the stream thread may now be able to run
+void wake_stream(void) {
+	wake_signal(stream_wake);
+}
+
+// resize streambuf to hold stream_buf_ms of audio, byte rate is measured from the data the decoder has consumed
+// while producing decoded_ms of audio - called from the decode thread, buffered data is retained
+void stream_autosize(u64_t decoded_ms) {
+	u64_t rate;
+	size_t size;
+
+	if (!stream_buf_ms || !decoded_ms || (streambuf->flags & BUF_MAPPED)) return;
+
+	LOCK;
+
+	// stream.bytes counts the prefetched stream once it has started, not the one being decoded
+	if (stream.prefetch) {
+		UNLOCK;
+		return;
+	}
+
+	rate = (stream.bytes - _buf_used(streambuf)) * 1000 / decoded_ms;
+	size = rate * stream_buf_ms / 1000;
+	if (size < STREAMBUF_MIN) size = STREAMBUF_MIN;
+	if (size > STREAMBUF_MAX) size = STREAMBUF_MAX;
+
+	LOG_INFO("stream rate: %u bytes/s streambuf %ums: %u", (unsigned)rate, stream_buf_ms, (unsigned)size);
+
+	if (size > streambuf->size * 5 / 4 || size < streambuf->size * 3 / 4) {
+		size_t old_size = streambuf->size;
+#if IOURING
+		// reads in flight target the storage being replaced
+		_uring_quiesce();
+#endif
+		if (_buf_resize(streambuf, size)) {
+			LOG_INFO("streambuf resized from %u to %u", (unsigned)old_size, (unsigned)streambuf->size);
+		} else {
+			LOG_DEBUG("unable to resize streambuf with %u bytes buffered", _buf_used(streambuf));
+		}
+	}
+
+	UNLOCK;
+}
+
+// drop a prefetched stream which will not be played - called with mutex locked once any reads into it are complete
+static void _prefetch_cancel(void) {
+	if (stream.prefetch) {
+		LOG_INFO("dropping prefetched stream");
+	}
+	if (stream.prefetch || prefetch_reserved) {
+		buf_destroy(&nextbuf);
+		fillbuf = streambuf;
+		stream.prefetch = false;
+		prefetch_reserved = false;
+	}
+	prefetch_armed = false;
+}
+
 void stream_file(const char *header, size_t header_len, unsigned threshold) {
-	buf_flush(streambuf);
+#if IOURING
+	LOCK;
+	_uring_quiesce();
+	UNLOCK;
+#endif
+
+	LOCK;
+	// opening a stream other than the one stream_prefetch was called for drops any prefetched stream
+	if (!prefetch_armed) _prefetch_cancel();
+	prefetch_armed = false;
+	UNLOCK;
+
+	// a prefetch buffer starts empty, streambuf is still being drained by the decoder
+	if (!stream.prefetch) buf_flush(streambuf);
 
 	LOCK;
 
@@ -559,13 +1901,37 @@ void stream_file(const char *header, size_t header_len, unsigned threshold) {
 #endif
 
 	stream.state = STREAMING_FILE;
+	resume = RESUME_NONE;
+	resume_req_len = 0;
+	keep_alive = false;
+	reused = false;
 	if (fd < 0) {
 		LOG_INFO("can't open file: %s", stream.header);
 		stream.state = DISCONNECT;
 	}
+
+#if LINUX || OSX || FREEBSD
+	// map regular files and let the decoder read the page cache directly rather than copying through streambuf
+	if (fd >= 0) {
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && _buf_map(fillbuf, fd, st.st_size)) {
+			LOG_INFO("mapped local file: %u bytes", (unsigned)st.st_size);
+		} else {
+#if LINUX || FREEBSD
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+			LOG_DEBUG("reading local file");
+		}
+	}
+#endif
 	wake_controller();
 	
 	stream.cont_wait = false;
+	stage_len = stage_pos = 0;
+	chunked = false;
+#if GZIP
+	_inflate_end();
+#endif
 	stream.meta_interval = 0;
 	stream.meta_next = 0;
 	stream.meta_left = 0;
@@ -573,13 +1939,20 @@ void stream_file(const char *header, size_t header_len, unsigned threshold) {
 	stream.sent_headers = false;
 	stream.bytes = 0;
 	stream.threshold = threshold;
+	rate = 0;
+	rate_fd = -1;
+	read_chunk = STREAM_WAKE_SPACE;
 
 	UNLOCK;
+
+	wake_stream();
+	wake_decode();
 }
 
 void stream_sock(u32_t ip, u16_t port, bool use_ssl, const char *header, size_t header_len, unsigned threshold, bool cont_wait) {
 	char *p;
 	int sock;
+	bool from_pool = false;
 
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
@@ -594,26 +1967,64 @@ void stream_sock(u32_t ip, u16_t port, bool use_ssl, const char *header, size_t
 	}	
 
 	port = ntohs(port);
-	sock = connect_socket(use_ssl || port == 443);
 
-	// try one more time with plain socket
-	if (sock < 0 && port == 443 && !use_ssl) sock = connect_socket(false);
+	LOCK;
+	sock = _pool_get(use_ssl || port == 443);
+	UNLOCK;
+
+	if (sock >= 0) {
+		from_pool = true;
+	} else {
+		sock = connect_socket(use_ssl || port == 443);
+
+		// try one more time with plain socket
+		if (sock < 0 && port == 443 && !use_ssl) sock = connect_socket(false);
+	}
 
 	if (sock < 0) {
 		LOCK;
 		stream.state = DISCONNECT;
 		stream.disconnect = UNREACHABLE;
+		prefetch_armed = false;
 		UNLOCK;
+		wake_decode();
 		return;
 	}
 
-	buf_flush(streambuf);
+#if IOURING
+	LOCK;
+	_uring_quiesce();
+	UNLOCK;
+#endif
+
+	LOCK;
+	// opening a stream other than the one stream_prefetch was called for drops any prefetched stream
+	if (!prefetch_armed) _prefetch_cancel();
+	prefetch_armed = false;
+	UNLOCK;
+
+	// a prefetch buffer starts empty, streambuf is still being drained by the decoder
+	if (!stream.prefetch) buf_flush(streambuf);
 
 	LOCK;
 
 	fd = sock;
+	reused = from_pool;
+	keep_alive = false;
+#if USE_SSL
+	stream.state = ssl && !ssl_ready ? TLS_HANDSHAKE : SEND_HEADERS;
+	ssl_fallback = ssl && !ssl_ready && port == 443 && !use_ssl;
+	_resume_store(header, header_len, ssl != NULL);
+#else
 	stream.state = SEND_HEADERS;
+	_resume_store(header, header_len, false);
+#endif
 	stream.cont_wait = cont_wait;
+	stage_len = stage_pos = 0;
+	chunked = false;
+#if GZIP
+	_inflate_end();
+#endif
 	stream.meta_interval = 0;
 	stream.meta_next = 0;
 	stream.meta_left = 0;
@@ -627,26 +2038,99 @@ void stream_sock(u32_t ip, u16_t port, bool use_ssl, const char *header, size_t
 	stream.sent_headers = false;
 	stream.bytes = 0;
 	stream.threshold = threshold;
+	rate = 0;
+	rate_fd = -1;
+	read_chunk = STREAM_WAKE_SPACE;
 
 	UNLOCK;
+
+	wake_stream();
 }
 
 bool stream_disconnect(void) {
 	bool disc = false;
 	LOCK;
-#if USE_SSL
-	if (ssl) {
-		SSL_shutdown(ssl);
-		SSL_free(ssl);
-		ssl = NULL;
-	}
+#if IOURING
+	_uring_quiesce();
 #endif
+	_ssl_close();
 	if (fd != -1) {
 		closesocket(fd);
 		fd = -1;
 		disc = true;
 	}
+	// a resume waiting to reconnect has no socket but is still a stream to disconnect
+	if (resume == RESUME_WAIT) {
+		disc = true;
+	}
+	resume = RESUME_NONE;
+	resume_req_len = 0;
 	stream.state = STOPPED;
+	_prefetch_cancel();
 	UNLOCK;
 	return disc;
 }
+
+static bool _prefetch_alloc(void) {
+	buf_init(&nextbuf, streambuf->base_size, BUF_MIRROR);
+	if (!nextbuf.buf) {
+		mutex_destroy(nextbuf.mutex);
+		LOG_WARN("unable to allocate prefetch buffer");
+		return false;
+	}
+	nextbuf.wake_writer = &stream_wake;
+	return true;
+}
+
+// allocate the prefetch buffer before the server is told the current stream is complete, so the next stream can be
+// received without disturbing the one still being decoded - only the slimproto thread changes nextbuf while unused
+bool stream_prefetch_reserve(void) {
+	if (stream.prefetch || prefetch_reserved) {
+		return prefetch_reserved;
+	}
+	if (!_prefetch_alloc()) {
+		return false;
+	}
+	LOCK;
+	prefetch_reserved = true;
+	UNLOCK;
+	return true;
+}
+
+// the next stream is about to be opened while the decoder still drains streambuf, receive it into a second buffer
+// called with decode mutex locked so the decoder cannot complete before the switch is pending
+bool stream_prefetch(void) {
+	LOCK;
+
+	if (stream.prefetch || (!prefetch_reserved && !_prefetch_alloc())) {
+		UNLOCK;
+		return false;
+	}
+
+	prefetch_reserved = false;
+	fillbuf = &nextbuf;
+	stream.prefetch = true;
+	prefetch_armed = true;
+
+	UNLOCK;
+
+	LOG_INFO("prefetching next stream: %u", (unsigned)nextbuf.size);
+	return true;
+}
+
+// decoder has completed the previous stream, make the prefetched one current - called with decode mutex locked
+void stream_prefetch_switch(void) {
+	LOCK;
+#if IOURING
+	_uring_quiesce();
+#endif
+	if (stream.prefetch) {
+		LOG_INFO("switching to prefetched stream: %u bytes", _buf_used(&nextbuf));
+		_buf_swap(streambuf, &nextbuf);
+		fillbuf = streambuf;
+		stream.prefetch = false;
+		buf_destroy(&nextbuf);
+	}
+	UNLOCK;
+	wake_stream();
+}
@@ -0,0 +1,389 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *      Ralph Irving 2015-2023, ralph_irving@hotmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// codec benchmark - build with "make bench"
+// runs codec->decode from a file held in memory, in place of the stream and decode threads, and discards
+// the decoded output in place of the output thread, so only the codec and sample conversion are measured
+// one line of key=value results is written to stdout per file:
+//   rtf - seconds of audio decoded per second of wall time spent in codec->decode
+//   ns_per_frame, cpu_ns_per_frame - wall and process cpu time per output frame, cpu includes decode workers
+//   mallocs, mallocs_per_sec - malloc/calloc/realloc and aligned allocation calls from codec open to close, per second
+//   of audio (glibc only)
+
+#include "../squeezelite.h"
+
+#include <time.h>
+
+extern log_level loglevel;               // decode.c, shared by the codecs
+
+extern struct buffer *streambuf;
+extern struct buffer *outputbuf;
+extern struct streamstate stream;
+extern struct outputstate output;
+extern struct decodestate decode;
+extern struct codec *codec;
+extern bool pcm_check_header;
+
+#define LOCK_S   buf_lock(streambuf)
+#define UNLOCK_S buf_unlock(streambuf)
+#define LOCK_O   buf_lock(outputbuf)
+#define UNLOCK_O buf_unlock(outputbuf)
+
+#if LINUX && defined(__GLIBC__)
+// count allocations from every thread, including those made inside codec libraries, by interposing the libc entry points
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+#define MALLOC_COUNT 1
+static volatile unsigned long mallocs;
+
+void *malloc(size_t size) {
+	__sync_fetch_and_add(&mallocs, 1);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	__sync_fetch_and_add(&mallocs, 1);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	__sync_fetch_and_add(&mallocs, 1);
+	return __libc_realloc(ptr, size);
+}
+
+// mem_alloc, and so buffers and arena_spill, allocate aligned
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+	void *mem;
+	if (!alignment || (alignment & (alignment - 1)) || alignment % sizeof(void *)) {
+		return EINVAL;
+	}
+	__sync_fetch_and_add(&mallocs, 1);
+	if ((mem = __libc_memalign(alignment, size)) == NULL) {
+		return ENOMEM;
+	}
+	*ptr = mem;
+	return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+	__sync_fetch_and_add(&mallocs, 1);
+	return __libc_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+	__sync_fetch_and_add(&mallocs, 1);
+	return __libc_memalign(alignment, size);
+}
+#else
+#define MALLOC_COUNT 0
+static unsigned long mallocs;
+#endif
+
+// file extension to codec id and the sample size parameter slimproto would pass to codec->open
+static const struct {
+	const char *ext;
+	u8_t format;
+	u8_t sample_size;
+} formats[] = {
+	{ "flac", 'f', 'f' }, { "flc", 'f', 'f' },
+	{ "wav", 'p', '1' }, { "aif", 'p', '1' }, { "aiff", 'p', '1' }, { "pcm", 'p', '1' },
+	{ "mp3", 'm', '?' },
+	{ "aac", 'a', '2' }, { "m4a", 'a', '5' }, { "mp4", 'a', '5' },
+	{ "alac", 'l', '?' },
+	{ "ogg", 'o', '?' },
+	{ "opus", 'u', '?' },
+	{ "dsf", 'd', '?' }, { "dff", 'd', '?' },
+	{ NULL, 0, 0 }
+};
+
+static struct codec *codec_list[MAX_CODECS];
+
+struct result {
+	u64_t frames;
+	u64_t wall_ns, cpu_ns;
+	unsigned long mallocs;
+	unsigned rate;
+	decode_state state;
+};
+
+static u64_t now_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (u64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void register_codecs(void) {
+	int i = 0;
+#if DSD
+	codec_list[i++] = register_dsd();
+#endif
+#if ALAC
+	codec_list[i++] = register_alac();
+#endif
+#ifndef NO_FAAD
+	codec_list[i++] = register_faad();
+#endif
+	codec_list[i++] = register_vorbis();
+#if OPUS
+	codec_list[i++] = register_opus();
+#endif
+	codec_list[i++] = register_flac();
+	codec_list[i++] = register_pcm();
+#if !defined(NO_MAD)
+	codec_list[i++] = register_mad();
+#elif !defined(NO_MPG123)
+	codec_list[i++] = register_mpg();
+#endif
+}
+
+static struct codec *find_codec(u8_t format) {
+	int i;
+	for (i = 0; i < MAX_CODECS; ++i) {
+		if (codec_list[i] && codec_list[i]->id == format) {
+			return codec_list[i];
+		}
+	}
+	return NULL;
+}
+
+// copy as much of the file as fits into streambuf, returns the new file position
+static size_t feed(const u8_t *data, size_t len, size_t pos) {
+	size_t bytes;
+
+	LOCK_S;
+	while (pos < len && (bytes = min(_buf_space(streambuf), _buf_cont_write(streambuf))) > 0) {
+		bytes = min(bytes, len - pos);
+		memcpy(streambuf->writep, data + pos, bytes);
+		_buf_inc_writep(streambuf, bytes);
+		pos += bytes;
+	}
+	UNLOCK_S;
+
+	return pos;
+}
+
+// decode the whole file once, following the decode thread's rules for when codec->decode is called
+static void run(const u8_t *data, size_t len, u8_t sample_size, struct result *r) {
+	size_t pos = 0;
+	unsigned long mallocs_start = mallocs;
+
+	buf_flush(streambuf);
+	buf_flush(outputbuf);
+
+	stream.state = STREAMING_FILE;
+	stream.prefetch = false;
+	decode.new_stream = true;
+	decode.state = DECODE_RUNNING;
+	output.next_sample_rate = 0;
+#if PROCESS
+	decode.direct = true;
+	decode.process = false;
+#endif
+
+	// default slimproto parameters for headerless pcm: 16 bit, 44.1kHz, stereo, little endian
+	// opened before streambuf is filled as codecs may adjust it, as when slimproto opens a codec ahead of the stream
+	codec->open(sample_size, '3', '2', '1');
+
+	pos = feed(data, len, pos);
+
+	while (decode.state == DECODE_RUNNING) {
+		u64_t wall, cpu;
+		size_t used;
+		bool toend;
+
+		LOCK_S;
+		used = _buf_used(streambuf);
+		toend = STREAM_ENDED;
+		UNLOCK_S;
+
+		if (used > codec->min_read_bytes || toend) {
+			wall = now_ns(CLOCK_MONOTONIC);
+			cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+
+			decode.state = codec->decode();
+			_decode_publish();
+
+			r->cpu_ns += now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+			r->wall_ns += now_ns(CLOCK_MONOTONIC) - wall;
+
+			LOCK_O;
+			used = _buf_used(outputbuf);
+			_buf_inc_readp(outputbuf, used);
+			UNLOCK_O;
+			r->frames += used / BYTES_PER_FRAME;
+		}
+
+		// the first decode call sees a file stream so pcm reads its header length, later ones see the end once all is fed
+		pos = feed(data, len, pos);
+		if (pos == len) {
+			stream.state = DISCONNECT;
+		}
+	}
+
+	codec->close();
+
+	r->mallocs += mallocs - mallocs_start;
+	r->rate = output.next_sample_rate;
+	r->state = decode.state;
+}
+
+static u8_t *load(const char *path, size_t *len) {
+	FILE *fp = fopen(path, "rb");
+	u8_t *data = NULL;
+	long size;
+
+	if (!fp) {
+		return NULL;
+	}
+
+	if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0) {
+		data = malloc(size);
+		if (data && fread(data, 1, size, fp) != (size_t)size) {
+			free(data);
+			data = NULL;
+		}
+		*len = size;
+	}
+
+	fclose(fp);
+	return data;
+}
+
+static void usage(const char *argv0) {
+	printf("Usage: %s [-c <codec>] [-n <runs>] [-d <log level>] <file> ...\n"
+		   "  -c <codec>\t\tCodec id used for every file, default chosen by file extension\n"
+		   "\t\t\tf=flac p=pcm m=mp3 a=aac l=alac o=ogg u=opus d=dsd\n"
+		   "  -n <runs>\t\tDecode each file <runs> times and report the total, default 1\n"
+		   "  -d <log level>\tinfo|debug|sdebug, codec logging to stderr\n",
+		   argv0);
+}
+
+int main(int argc, char **argv) {
+	u8_t force = 0;
+	unsigned runs = 1;
+	int i, failed = 0;
+
+	loglevel = lWARN;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+		if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+			force = argv[++i][0];
+		} else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			runs = atoi(argv[++i]);
+			if (!runs) runs = 1;
+		} else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+			++i;
+			if (!strcmp(argv[i], "info"))   loglevel = lINFO;
+			if (!strcmp(argv[i], "debug"))  loglevel = lDEBUG;
+			if (!strcmp(argv[i], "sdebug")) loglevel = lSDEBUG;
+		} else {
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (i == argc) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	LOG_INFO("sample conversion using %s", conv_init());
+
+	buf_init(streambuf, STREAMBUF_SIZE, BUF_MIRROR);
+	buf_init(outputbuf, OUTPUTBUF_SIZE, 0);
+	if (!streambuf->buf || !outputbuf->buf) {
+		fprintf(stderr, "unable to allocate buffers\n");
+		exit(1);
+	}
+
+	// no stream thread to check the content, so pcm parses wav/aiff headers itself
+	pcm_check_header = true;
+
+	register_codecs();
+
+	for (; i < argc; ++i) {
+		const char *path = argv[i];
+		const char *ext = strrchr(path, '.');
+		u8_t format = force, sample_size = '?';
+		struct result r;
+		size_t len = 0;
+		u8_t *data;
+		unsigned n;
+		int f;
+
+		for (f = 0; formats[f].ext; ++f) {
+			if (ext && !strcasecmp(ext + 1, formats[f].ext)) {
+				if (!format || format == formats[f].format) {
+					format = formats[f].format;
+					sample_size = formats[f].sample_size;
+				}
+				break;
+			}
+		}
+
+		if (!format || !(codec = find_codec(format))) {
+			fprintf(stderr, "%s: no codec available\n", path);
+			failed = 1;
+			continue;
+		}
+
+		if (!(data = load(path, &len))) {
+			fprintf(stderr, "%s: unable to read\n", path);
+			failed = 1;
+			continue;
+		}
+
+		memset(&r, 0, sizeof(r));
+		for (n = 0; n < runs && r.state != DECODE_ERROR; ++n) {
+			run(data, len, sample_size, &r);
+		}
+
+		free(data);
+
+		if (r.state == DECODE_ERROR || !r.frames || !r.rate) {
+			fprintf(stderr, "%s: decode failed\n", path);
+			failed = 1;
+			continue;
+		}
+
+		printf("codec=%c rate=%u runs=%u frames=" FMT_u64 " audio_s=%.3f wall_s=%.6f cpu_s=%.6f rtf=%.1f "
+			   "ns_per_frame=%.1f cpu_ns_per_frame=%.1f ",
+			   format, r.rate, runs, r.frames, (double)r.frames / r.rate, r.wall_ns / 1e9, r.cpu_ns / 1e9,
+			   r.wall_ns ? (double)r.frames / r.rate / (r.wall_ns / 1e9) : 0.0,
+			   (double)r.wall_ns / r.frames, (double)r.cpu_ns / r.frames);
+		if (MALLOC_COUNT) {
+			printf("mallocs=%lu mallocs_per_sec=%.2f ", r.mallocs, r.mallocs / ((double)r.frames / r.rate));
+		} else {
+			printf("mallocs=- mallocs_per_sec=- ");
+		}
+		printf("file=%s\n", path);
+		fflush(stdout);
+	}
+
+	codec = NULL;
+	buf_destroy(streambuf);
+	buf_destroy(outputbuf);
+
+	return failed;
+}
@@ -19,8 +19,15 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include "squeezelite.h"
 
+#if LINUX
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 #if LINUX || OSX || FREEBSD
 #include <sys/ioctl.h>
 #include <net/if.h>
@@ -43,6 +50,7 @@
 #endif
 #if WIN
 #include <iphlpapi.h>
+#include <malloc.h>
 #if USE_SSL
 #include <stdlib.h>
 #include <string.h>
@@ -57,6 +65,9 @@
 #endif
 
 #include <fcntl.h>
+#if LINUX || FREEBSD
+#include <sys/mman.h>
+#endif
 
 // logging functions
 const char *logtime(void) {
@@ -120,6 +131,27 @@ u32_t gettime_ms(void) {
 #endif
 }
 
+// microsecond clock for measuring short intervals
+u64_t gettime_us(void) {
+#if WIN
+	return (u64_t)GetTickCount() * 1000;
+#else
+#if LINUX || FREEBSD
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts)) {
+#else
+	if (!clock_gettime(CLOCK_REALTIME, &ts)) {
+#endif
+		return (u64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+#endif
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (u64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
 // mac address
 #if LINUX && !defined(SUN)
 // search first 4 interfaces returned by IFCONF
@@ -297,6 +329,27 @@ void set_recvbufsize(sockfd s) {
 #endif
 }
 
+#if !WIN
+// grow TCP receive buffer to at least bytes, never shrinks one the kernel has already autotuned larger
+// returns the size in effect, which the kernel reports doubled for its own overhead
+int set_recvbufmin(sockfd s, int bytes) {
+	int opt = 0;
+	socklen_t len = sizeof(opt);
+	getsockopt(s, SOL_SOCKET, SO_RCVBUF, (void*) &opt, &len);
+	if (opt < bytes) {
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, (void*) &bytes, sizeof(bytes));
+		len = sizeof(opt);
+		getsockopt(s, SOL_SOCKET, SO_RCVBUF, (void*) &opt, &len);
+	}
+	return opt;
+}
+
+// bytes which must be queued before the socket polls readable, end of stream and errors still wake at once
+void set_recvlowat(sockfd s, int bytes) {
+	setsockopt(s, SOL_SOCKET, SO_RCVLOWAT, (void*) &bytes, sizeof(bytes));
+}
+#endif
+
 // connect for socket already set to non blocking with timeout in seconds
 int connect_timeout(sockfd sock, const struct sockaddr *addr, socklen_t addrlen, int timeout) {
 	fd_set w, e;
@@ -398,6 +451,26 @@ event_type wait_readwake(event_handle handles[], int timeout) {
 #endif
 }
 
+// wait for a wake event to be signalled, returns false on timeout
+bool wait_wake(event_event e, int timeout) {
+#if WINEVENT
+	return WaitForSingleObject(e, timeout) == WAIT_OBJECT_0;
+#else
+	struct pollfd pollinfo;
+#if SELFPIPE
+	pollinfo.fd = e.fds[0];
+#else
+	pollinfo.fd = e;
+#endif
+	pollinfo.events = POLLIN;
+	if (poll(&pollinfo, 1, timeout) > 0) {
+		wake_clear(pollinfo.fd);
+		return true;
+	}
+	return false;
+#endif
+}
+
 // pack/unpack to network byte order
 void packN(u32_t *dest, u32_t val) {
 	u8_t *ptr = (u8_t *)dest;
@@ -499,6 +572,314 @@ void touch_memory(u8_t *buf, size_t size) {
 }
 #endif
 
+// allocator for audio buffers - backing requested by mem_mode, set from command line
+// each allocation is preceded by a header of one cache line so the pointer returned is cache line aligned
+unsigned mem_mode = 0;
+
+struct memhdr {
+	size_t size;
+	bool mapped;
+	bool locked;
+};
+
+#if LINUX
+size_t mem_hugepage_size(void) {
+	static size_t huge = 0;
+	if (!huge) {
+		char line[128];
+		FILE *fp = fopen("/proc/meminfo", "r");
+		huge = 2 * 1024 * 1024;
+		if (fp) {
+			while (fgets(line, sizeof(line), fp)) {
+				unsigned kb;
+				if (sscanf(line, "Hugepagesize: %u kB", &kb) == 1) {
+					huge = (size_t)kb * 1024;
+					break;
+				}
+			}
+			fclose(fp);
+		}
+	}
+	return huge;
+}
+#endif
+
+void *mem_alloc(size_t size, unsigned *got) {
+	size_t total = size + MEM_ALIGN;
+	u8_t *base = NULL;
+	struct memhdr *hdr;
+	bool mapped = false;
+
+	*got = 0;
+
+#if LINUX
+	// huge pages only worthwhile for allocations of at least one huge page, try hugetlbfs pages then hint for thp
+	if ((mem_mode & MEM_HUGE) && size >= mem_hugepage_size()) {
+		size_t huge = mem_hugepage_size();
+		size_t page = sysconf(_SC_PAGESIZE);
+#ifdef MAP_HUGETLB
+		base = mmap(NULL, (total + huge - 1) / huge * huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (base != MAP_FAILED) {
+			total = (total + huge - 1) / huge * huge;
+			*got |= MEM_HUGE;
+		} else {
+			base = NULL;
+		}
+#endif
+		if (!base) {
+			total = (total + page - 1) / page * page;
+			base = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (base == MAP_FAILED) {
+				base = NULL;
+				total = size + MEM_ALIGN;
+			}
+#ifdef MADV_HUGEPAGE
+			if (base && madvise(base, total, MADV_HUGEPAGE) == 0) {
+				*got |= MEM_THP;
+			}
+#endif
+		}
+		mapped = base != NULL;
+	}
+#endif
+
+	if (!base) {
+#if WIN
+		base = _aligned_malloc(total, MEM_ALIGN);
+#else
+		if (posix_memalign((void **)&base, MEM_ALIGN, total) != 0) {
+			base = NULL;
+		}
+#endif
+	}
+
+	if (!base) {
+		return NULL;
+	}
+
+	hdr = (struct memhdr *)base;
+	hdr->size = total;
+	hdr->mapped = mapped;
+	hdr->locked = false;
+
+#if !WIN
+	if ((mem_mode & MEM_LOCK) && mlock(base, total) == 0) {
+		hdr->locked = true;
+		*got |= MEM_LOCK;
+	}
+#endif
+
+	return base + MEM_ALIGN;
+}
+
+void mem_free(void *ptr) {
+	u8_t *base;
+	struct memhdr *hdr;
+
+	if (!ptr) return;
+
+	base = (u8_t *)ptr - MEM_ALIGN;
+	hdr = (struct memhdr *)base;
+
+#if !WIN
+	if (hdr->locked) {
+		munlock(base, hdr->size);
+	}
+#endif
+#if LINUX
+	if (hdr->mapped) {
+		munmap(base, hdr->size);
+		return;
+	}
+#endif
+#if WIN
+	_aligned_free(base);
+#else
+	free(base);
+#endif
+}
+
+// bump allocator for codec state of the current stream - storage is obtained once with mem_alloc and every allocation
+// is released together by arena_reset, so decoding makes no heap calls and its memory is bounded by the arena size
+// other than for anything the arena can not hold, which the codec places on the heap with arena_spill
+void arena_init(struct arena *a, size_t size) {
+	a->base = mem_alloc(size, &a->mem);
+	a->size = a->base ? size : 0;
+	a->used = 0;
+	a->spill = NULL;
+}
+
+// returns NULL once the arena is exhausted, allocations are cache line aligned
+void *arena_alloc(struct arena *a, size_t len) {
+	u8_t *ptr;
+
+	len = (len + MEM_ALIGN - 1) / MEM_ALIGN * MEM_ALIGN;
+	if (len > a->size - a->used) {
+		return NULL;
+	}
+
+	ptr = a->base + a->used;
+	a->used += len;
+
+	return ptr;
+}
+
+// heap allocation released along with the arena, for what arena_alloc can not hold - the block is chained from
+// its first cache line so the allocation stays aligned
+void *arena_spill(struct arena *a, size_t len) {
+	unsigned got;
+	u8_t *block = mem_alloc(len + MEM_ALIGN, &got);
+
+	if (!block) {
+		return NULL;
+	}
+
+	*(void **)block = a->spill;
+	a->spill = block;
+
+	return block + MEM_ALIGN;
+}
+
+void arena_reset(struct arena *a) {
+	while (a->spill) {
+		void *next = *(void **)a->spill;
+		mem_free(a->spill);
+		a->spill = next;
+	}
+	a->used = 0;
+}
+
+// describe backing obtained by mem_alloc for logging
+const char *mem_backing(unsigned got) {
+	static const char *desc[] = { "normal pages", "normal pages, locked", "thp advised", "thp advised, locked",
+								  "huge pages", "huge pages, locked" };
+	return desc[((got & MEM_HUGE) ? 4 : (got & MEM_THP) ? 2 : 0) + ((got & MEM_LOCK) ? 1 : 0)];
+}
+
+#if LINUX
+// thread placement - scheduling policy, rt priority or nice level and cpu affinity per named thread
+// configured from the command line, or as a default by the owner of a thread, and applied by each thread to itself
+#define MAX_PLACEMENTS 8
+
+static struct placement {
+	char name[16];
+	int policy;       // -1 leaves policy unchanged
+	int prio;         // rt priority for SCHED_FIFO/SCHED_RR, nice level for SCHED_OTHER
+	int cpus;         // cpus in cpu_set, 0 leaves affinity unchanged
+	cpu_set_t cpu_set;
+} placements[MAX_PLACEMENTS];
+
+static int num_placements = 0;
+
+static struct placement *_placement(const char *name) {
+	int i;
+	for (i = 0; i < num_placements; ++i) {
+		if (!strcmp(placements[i].name, name)) return &placements[i];
+	}
+	return NULL;
+}
+
+// parse name:policy[:prio[:cpus]],... eg decode:fifo:40:2-3,stream:other:-5 where policy is fifo, rr, other or empty
+// and cpus a list of n or n-m joined by +, returns false if spec is not valid
+bool thread_placement(char *spec) {
+	char *entry;
+
+	for (entry = strtok(spec, ","); entry; entry = strtok(NULL, ",")) {
+		struct placement *p;
+		char *name = entry, *policy, *prio = NULL, *cpus = NULL;
+
+		if ((policy = strchr(name, ':')) == NULL) return false;
+		*policy++ = '\0';
+		if ((prio = strchr(policy, ':')) != NULL) {
+			*prio++ = '\0';
+			if ((cpus = strchr(prio, ':')) != NULL) *cpus++ = '\0';
+		}
+
+		if ((p = _placement(name)) == NULL) {
+			if (num_placements == MAX_PLACEMENTS || strlen(name) >= sizeof(p->name)) return false;
+			p = &placements[num_placements++];
+			strcpy(p->name, name);
+		}
+
+		if (!strcmp(policy, "fifo")) p->policy = SCHED_FIFO;
+		else if (!strcmp(policy, "rr")) p->policy = SCHED_RR;
+		else if (!strcmp(policy, "other")) p->policy = SCHED_OTHER;
+		else if (!*policy) p->policy = -1;
+		else return false;
+
+		p->prio = prio ? atoi(prio) : 0;
+
+		CPU_ZERO(&p->cpu_set);
+		p->cpus = 0;
+		while (cpus && *cpus) {
+			char *end;
+			int first = strtol(cpus, &end, 10), last = first;
+			if (end == cpus) return false;
+			if (*end == '-') last = strtol(end + 1, &end, 10);
+			for (; first <= last && first < CPU_SETSIZE; ++first) {
+				CPU_SET(first, &p->cpu_set);
+				p->cpus++;
+			}
+			if (*end && *end != '+') return false;
+			cpus = *end ? end + 1 : end;
+		}
+	}
+
+	return true;
+}
+
+// default placement for a thread, used unless configured from the command line, cpu < 0 for no affinity
+void thread_placement_default(const char *name, int policy, int prio, int cpu) {
+	struct placement *p;
+
+	if (_placement(name) || num_placements == MAX_PLACEMENTS) return;
+
+	p = &placements[num_placements++];
+	strncpy(p->name, name, sizeof(p->name) - 1);
+	p->policy = policy;
+	p->prio = prio;
+	CPU_ZERO(&p->cpu_set);
+	p->cpus = 0;
+	if (cpu >= 0) {
+		CPU_SET(cpu, &p->cpu_set);
+		p->cpus = 1;
+	}
+}
+
+// apply placement for name to the calling thread, returns the placement obtained for the caller to log
+const char *thread_place(const char *name, char *buf, size_t len) {
+	struct placement *p = _placement(name);
+	struct sched_param param;
+	cpu_set_t cpu_set;
+	pid_t tid = syscall(SYS_gettid);
+	int policy, n, i;
+	char *fail = "";
+
+	if (p) {
+		if (p->policy >= 0) {
+			param.sched_priority = p->policy == SCHED_OTHER ? 0 : p->prio;
+			if (pthread_setschedparam(pthread_self(), p->policy, &param) != 0) fail = " (policy failed)";
+		}
+		if (p->policy == SCHED_OTHER && setpriority(PRIO_PROCESS, tid, p->prio) != 0) fail = " (nice failed)";
+		if (p->cpus && pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &p->cpu_set) != 0) fail = " (affinity failed)";
+	}
+
+	pthread_getschedparam(pthread_self(), &policy, &param);
+	n = snprintf(buf, len, "%s: %s priority: %d nice: %d cpus:", name,
+				 policy == SCHED_FIFO ? "SCHED_FIFO" : policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER",
+				 param.sched_priority, getpriority(PRIO_PROCESS, tid));
+
+	if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set) == 0) {
+		for (i = 0; i < CPU_SETSIZE && n > 0 && n < len; ++i) {
+			if (CPU_ISSET(i, &cpu_set)) n += snprintf(buf + n, len - n, " %d", i);
+		}
+	}
+	if (n > 0 && n < len) snprintf(buf + n, len - n, "%s", fail);
+
+	return buf;
+}
+#endif
+
 #if WIN || SUN
 char *strcasestr(const char *haystack, const char *needle) {
 	size_t length_needle;
@@ -33,12 +33,6 @@
 #define FRAME_BUF 2048
 #endif
 
-#if BYTES_PER_FRAME == 4		
-#define ALIGN(n) 	(n)
-#else
-#define ALIGN(n) 	(n << 16)		
-#endif
-
 // automatically select between floating point (preferred) and fixed point libraries:
 // NOTE: works with Tremor version here: http://svn.xiph.org/trunk/Tremor, not vorbisidec.1.0.2 currently in ubuntu
 
@@ -77,22 +71,21 @@ extern struct buffer *outputbuf;
 extern struct streamstate stream;
 extern struct outputstate output;
 extern struct decodestate decode;
-extern struct processstate process;
 
-#define LOCK_S   mutex_lock(streambuf->mutex)
-#define UNLOCK_S mutex_unlock(streambuf->mutex)
-#define LOCK_O   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O mutex_unlock(outputbuf->mutex)
+#define LOCK_S   buf_lock(streambuf)
+#define UNLOCK_S buf_unlock(streambuf)
+#define LOCK_O   buf_lock(outputbuf)
+#define UNLOCK_O buf_unlock(outputbuf)
 #if PROCESS
-#define LOCK_O_direct   if (decode.direct) mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct if (decode.direct) mutex_unlock(outputbuf->mutex)
-#define LOCK_O_not_direct   if (!decode.direct) mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_not_direct if (!decode.direct) mutex_unlock(outputbuf->mutex)
+#define LOCK_O_direct   if (decode.direct) buf_lock(outputbuf)
+#define UNLOCK_O_direct if (decode.direct) buf_unlock(outputbuf)
+#define LOCK_O_not_direct   if (!decode.direct) buf_lock(outputbuf)
+#define UNLOCK_O_not_direct if (!decode.direct) buf_unlock(outputbuf)
 #define IF_DIRECT(x)    if (decode.direct) { x }
 #define IF_PROCESS(x)   if (!decode.direct) { x }
 #else
-#define LOCK_O_direct   mutex_lock(outputbuf->mutex)
-#define UNLOCK_O_direct mutex_unlock(outputbuf->mutex)
+#define LOCK_O_direct   buf_lock(outputbuf)
+#define UNLOCK_O_direct buf_unlock(outputbuf)
 #define LOCK_O_not_direct
 #define UNLOCK_O_not_direct
 #define IF_DIRECT(x)    { x }
@@ -136,11 +129,11 @@ static decode_state vorbis_decode(void) {
 	static int channels;
 	frames_t frames;
 	int bytes, s, n;
-	u8_t *write_buf;
+	u8_t *write_buf, *out_buf;
 
 	LOCK_S;
 
-	if (stream.state <= DISCONNECT && v->end) {
+	if (STREAM_ENDED && v->end) {
 		UNLOCK_S;
 		return DECODE_COMPLETE;
 	}
@@ -185,23 +178,18 @@ static decode_state vorbis_decode(void) {
 		}
 	}
 	
+#if !FRAME_BUF
+	LOCK_O_direct;
+#endif
+	frames = decode_reserve(&out_buf);
+	write_buf = out_buf;
 #if FRAME_BUF
+	// decode via frame buffer when direct, copied into the reserved space below
 	IF_DIRECT(
-		frames = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
 		frames = min(frames, FRAME_BUF);
 		write_buf = v->write_buf;
 	);
-#else
-	LOCK_O_direct;
-	IF_DIRECT(
-		frames = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
-		write_buf = outputbuf->writep;
-	);
 #endif
-	IF_PROCESS(
-		frames = process.max_in_frames;
-		write_buf = process.inbuf;
-	);
 	
 	bytes = frames * 2 * channels; // samples returned are 16 bits
 	v->end = frames == 0;
@@ -228,54 +216,18 @@ static decode_state vorbis_decode(void) {
 #endif	
 
 	if (n > 0) {
-		frames_t count;
-		s16_t *iptr;
-		ISAMPLE_T *optr;
-
 		frames = n / 2 / channels;
-		count = frames * channels;
-
-		// work backward to unpack samples (if needed)
-		iptr = (s16_t *) write_buf + count;
-		IF_DIRECT(
-			optr = (ISAMPLE_T *) outputbuf->writep + frames * 2;
-		)
-		IF_PROCESS(
-			optr = (ISAMPLE_T *) write_buf + frames * 2;
-		)
-
-		if (channels == 2) {
-#if BYTES_PER_FRAME == 4
-#if FRAME_BUF
-			// copy needed only when DIRECT and FRAME_BUF
-			IF_DIRECT(
-				memcpy(outputbuf->writep, write_buf, frames * BYTES_PER_FRAME);
-			)
-#endif			
-#else
-			while (count--) {
-				*--optr = ALIGN(*--iptr);
-			}
-#endif
-		} else if (channels == 1) {
-			while (count--) {
-				*--optr = ALIGN(*--iptr);
-				*--optr = ALIGN(*iptr);
-			}
-		}
-		
-		IF_DIRECT(
-			_buf_inc_writep(outputbuf, frames * BYTES_PER_FRAME);
-		);
-		IF_PROCESS(
-			process.in_frames = frames;
-		);
+
+		// expand 16 bit samples in place, or from the frame buffer
+		conv_interleaved16((ISAMPLE_T *)out_buf, (s16_t *)write_buf, frames, channels);
+
+		decode_commit(frames);
 
 		LOG_SDEBUG("wrote %u frames", frames);
 
 	} else if (n == 0) {
 
-		if (stream.state <= DISCONNECT) {
+		if (STREAM_ENDED) {
 			LOG_INFO("partial decode");
 			UNLOCK_O_direct;
 			return DECODE_COMPLETE;